@@ -0,0 +1,305 @@
+(* Benchmarks of the conversions between q values and K objects, of the
+   native IPC codec, with and without compression, and of eval/rpc round
+   trips to a local stand-in for a kdb+ server. Each result is printed as one JSON object per line, so that
+   runs on two commits can be compared line by line.
+
+   Usage: q_bench [-quick] [-filter substring] [-label name] *)
+
+open Bigarray
+open Q
+
+let quick = ref false
+let filter = ref ""
+let label = ref ""
+
+
+(* Fixtures *)
+
+let vector_types =
+  ["bool"; "short"; "int32"; "int64"; "float64"; "timestamp"; "symbol"; "strings"]
+
+let chars_of_string s =
+  let a = Array1.create char c_layout (String.length s) in
+  String.iteri (fun i c -> a.{i} <- c) s;
+  a
+
+let string_of_chars a = String.init (Array1.dim a) (fun i -> a.{i})
+
+let make_vector ty n =
+  let ba kind f =
+    let a = Array1.create kind c_layout n in
+    for i = 0 to n - 1 do a.{i} <- f i done;
+    a in
+  match ty with
+  | "bool" -> V_bool (ba int8_unsigned (fun i -> i land 1), A_none)
+  | "short" -> V_short (ba int16_unsigned (fun i -> i land 0x7fff), A_none)
+  | "int32" -> V_int32 (ba int32 Int32.of_int, A_none)
+  | "int64" -> V_int64 (ba int64 Int64.of_int, A_none)
+  | "float64" -> V_float64 (ba float64 float_of_int, A_none)
+  | "timestamp" -> V_timestamp (ba int64 (fun i -> Int64.mul (Int64.of_int i) 1_000_000L), A_none)
+  | "symbol" -> V_symbol (Array.init n (fun i -> "sym" ^ string_of_int (i mod 1000)), A_none)
+  | "strings" ->
+    V_mixed (Array.init n (fun i -> V_char (chars_of_string ("order-" ^ string_of_int i), A_none)))
+  | _ -> invalid_arg ty
+
+let make_table width rows =
+  let types = [| "int64"; "float64"; "symbol"; "timestamp" |] in
+  Table { colnames = V_symbol (Array.init width (fun i -> "c" ^ string_of_int i), A_none);
+          cols = V_mixed (Array.init width (fun i -> make_vector types.(i mod 4) rows));
+          attrib_t = A_none }
+
+let lengths () = if !quick then [1; 1000; 100_000] else [1; 100; 10_000; 1_000_000]
+
+let widths () = if !quick then [1; 8] else [1; 8; 32]
+
+let table_rows () = if !quick then 1000 else 10_000
+
+(* (name, parameters as JSON fields, value) *)
+let fixtures () =
+  let vectors =
+    List.concat_map (fun ty ->
+        List.map (fun n ->
+            (Printf.sprintf "v_%s_%d" ty n,
+             Printf.sprintf "\"type\":%S,\"length\":%d,\"width\":1" ty n,
+             make_vector ty n))
+          (lengths ()))
+      vector_types in
+  let tables =
+    List.map (fun w ->
+        (Printf.sprintf "t_%d" w,
+         Printf.sprintf "\"type\":\"table\",\"length\":%d,\"width\":%d" (table_rows ()) w,
+         make_table w (table_rows ())))
+      (widths ()) in
+  vectors @ tables
+
+
+(* GC time, from the runtime events of the main domain *)
+
+let gc_ns = ref 0L
+
+let gc_cursor = lazy (
+  Runtime_events.start ();
+  Runtime_events.create_cursor None)
+
+let gc_callbacks =
+  let depth = ref 0 and start = ref 0L in
+  let is_gc = function
+    | Runtime_events.EV_MINOR | Runtime_events.EV_MAJOR_SLICE -> true
+    | _ -> false in
+  let runtime_begin ring ts phase =
+    if ring = 0 && is_gc phase then begin
+      if !depth = 0 then start := Runtime_events.Timestamp.to_int64 ts;
+      incr depth
+    end in
+  let runtime_end ring ts phase =
+    if ring = 0 && is_gc phase && !depth > 0 then begin
+      decr depth;
+      if !depth = 0 then
+        gc_ns := Int64.add !gc_ns (Int64.sub (Runtime_events.Timestamp.to_int64 ts) !start)
+    end in
+  Runtime_events.Callbacks.create ~runtime_begin ~runtime_end ()
+
+let poll_gc () =
+  ignore (Runtime_events.read_poll (Lazy.force gc_cursor) gc_callbacks None)
+
+
+(* Measurements *)
+
+type stats = {
+  iters : int;
+  seconds : float;
+  minor_words : float;
+  major_words : float;
+  minor_gcs : int;
+  major_gcs : int;
+  gc_seconds : float;
+}
+
+let min_time () = if !quick then 0.05 else 0.5
+
+(* Runs [f] once to warm up, then repeatedly for [min_time] seconds, or
+   [count] times *)
+let measure ?count f =
+  let t = Unix.gettimeofday () in
+  f ();
+  let once = Unix.gettimeofday () -. t in
+  let batch = max 1 (int_of_float (0.001 /. Float.max once 1e-9)) in
+  Gc.full_major ();
+  poll_gc ();
+  let gc0 = !gc_ns in
+  let s0 = Gc.quick_stat () in
+  let t0 = Unix.gettimeofday () in
+  let iters = ref 0 in
+  let continue () =
+    match count with
+    | Some n -> !iters < n
+    | None -> Unix.gettimeofday () -. t0 < min_time () in
+  while continue () do
+    let n = match count with Some n -> min batch (n - !iters) | None -> batch in
+    for _ = 1 to n do f () done;
+    iters := !iters + n;
+    poll_gc ()
+  done;
+  let seconds = Unix.gettimeofday () -. t0 in
+  let s1 = Gc.quick_stat () in
+  { iters = !iters; seconds;
+    minor_words = s1.minor_words -. s0.minor_words;
+    major_words = s1.major_words -. s0.major_words;
+    minor_gcs = s1.minor_collections - s0.minor_collections;
+    major_gcs = s1.major_collections - s0.major_collections;
+    gc_seconds = Int64.to_float (Int64.sub !gc_ns gc0) *. 1e-9 }
+
+let selected bench name =
+  let key = bench ^ " " ^ name in
+  let n = String.length !filter in
+  let rec search i = i + n <= String.length key && (String.sub key i n = !filter || search (i + 1)) in
+  n = 0 || search 0
+
+let print_result bench params ?(extra = "") ~bytes s =
+  let per x = x /. float_of_int s.iters in
+  Printf.printf
+    "{\"label\":%S,\"bench\":%S,%s,\"bytes\":%d,\"iters\":%d,\"ns_per_op\":%.1f,\
+     \"mb_per_s\":%.1f,\"minor_words_per_op\":%.1f,\"major_words_per_op\":%.1f,\
+     \"minor_gcs\":%d,\"major_gcs\":%d,\"gc_ms\":%.3f%s}\n%!"
+    !label bench params bytes s.iters (per s.seconds *. 1e9)
+    (float_of_int bytes *. float_of_int s.iters /. s.seconds /. 1e6)
+    (per s.minor_words) (per s.major_words) s.minor_gcs s.major_gcs
+    (s.gc_seconds *. 1e3) extra
+
+let run bench (name, params, _) ?extra ~bytes f =
+  if selected bench name then print_result bench params ?extra ~bytes (measure f)
+
+(* Runs [f] [n] times, and reports the percentiles of its latency *)
+let run_latency bench (name, params, _) ~bytes ~n f =
+  if selected bench name then begin
+    let samples = Array.make n 0. in
+    (* The warm-up call of [measure] is not sampled *)
+    let i = ref (-1) in
+    let s = measure ~count:n (fun () ->
+        let t = Unix.gettimeofday () in
+        f ();
+        if !i >= 0 then samples.(!i) <- Unix.gettimeofday () -. t;
+        incr i) in
+    assert (!i = n);
+    Array.sort compare samples;
+    let pct p = samples.(min (Array.length samples - 1) (int_of_float (p *. float_of_int (Array.length samples)))) *. 1e6 in
+    let extra = Printf.sprintf ",\"p50_us\":%.1f,\"p90_us\":%.1f,\"p99_us\":%.1f,\"max_us\":%.1f"
+        (pct 0.5) (pct 0.9) (pct 0.99) (pct 1.0) in
+    print_result bench params ~extra ~bytes s
+  end
+
+
+(* A stand-in for a kdb+ server on the loopback interface. It replies to the
+   query [name] with the fixture [name], and to [(f; x)] with [x]. Replies
+   to compressed requests are compressed *)
+
+let rec really_read fd buf off len =
+  if len > 0 then begin
+    let n = Unix.read fd buf off len in
+    if n = 0 then raise End_of_file;
+    really_read fd buf (off + n) (len - n)
+  end
+
+let rec write_all fd buf off len =
+  if len > 0 then begin
+    let n = Unix.write fd buf off len in
+    write_all fd buf (off + n) (len - n)
+  end
+
+let serve_connection fixtures fd =
+  let b = Bytes.create 1 in
+  (* Handshake: credentials and capability, up to a NUL *)
+  let rec handshake () =
+    really_read fd b 0 1;
+    if Bytes.get b 0 <> '\000' then handshake () in
+  let header = Bytes.create 8 in
+  try
+    handshake ();
+    write_all fd (Bytes.of_string "\003") 0 1;
+    while true do
+      really_read fd header 0 8;
+      let len = Int32.to_int (Bytes.get_int32_le header 4) in
+      let msg = Bytes.create len in
+      Bytes.blit header 0 msg 0 8;
+      really_read fd msg 8 (len - 8);
+      let compression_threshold = if Bytes.get_uint8 header 2 <> 0 then Some 0 else None in
+      let reply =
+        match Ipc.deserialize msg with
+        | (ty, V_char (s, _)) -> (ty, Option.value ~default:Unit (Hashtbl.find_opt fixtures (string_of_chars s)))
+        | (ty, V_mixed [| V_char _; x |]) -> (ty, x)
+        | (ty, _) -> (ty, Unit) in
+      match reply with
+      | (Ipc.Sync, v) ->
+        let out = Ipc.serialize ?compression_threshold Ipc.Response v in
+        write_all fd out 0 (Bytes.length out)
+      | _ -> ()
+    done
+  with End_of_file | Unix.Unix_error _ | Failure _ -> Unix.close fd
+
+let start_server fixtures =
+  let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.setsockopt sock Unix.SO_REUSEADDR true;
+  Unix.bind sock (Unix.ADDR_INET (Unix.inet_addr_loopback, 0));
+  Unix.listen sock 8;
+  let port = match Unix.getsockname sock with
+    | Unix.ADDR_INET (_, port) -> port
+    | Unix.ADDR_UNIX _ -> assert false in
+  let rec accept () =
+    let (fd, _) = Unix.accept sock in
+    ignore (Domain.spawn (fun () -> serve_connection fixtures fd));
+    accept () in
+  ignore (Domain.spawn accept);
+  port
+
+
+let () =
+  Arg.parse [
+    ("-quick", Arg.Set quick, " Smaller sizes and shorter runs");
+    ("-filter", Arg.Set_string filter, "s Only run benchmarks whose name contains s");
+    ("-label", Arg.Set_string label, "name Label of the results, such as a commit");
+  ] (fun _ -> ()) "q_bench [-quick] [-filter s] [-label name]";
+  let fixtures = fixtures () in
+  (* Conversions and codec *)
+  List.iter (fun ((_, _, v) as fx) ->
+      let msg = Ipc.serialize Ipc.Response v in
+      let bytes = Bytes.length msg in
+      run "encode_k" fx ~bytes (fun () -> ignore (Kobj.of_q_val v));
+      let k = Kobj.of_q_val v in
+      run "decode_k" fx ~bytes (fun () -> ignore (Kobj.to_q_val k));
+      run "encode_ipc" fx ~bytes (fun () -> ignore (Ipc.serialize Ipc.Response v));
+      run "decode_ipc" fx ~bytes (fun () -> ignore (Ipc.deserialize msg));
+      (* Throughput of the uncompressed bytes, and the compressed size.
+         Messages that compression does not halve are sent as they are *)
+      let zipped = Ipc.serialize ~compression_threshold:0 Ipc.Response v in
+      let extra = Printf.sprintf ",\"compressed_bytes\":%d" (Bytes.length zipped) in
+      run "encode_ipc_compressed" fx ~extra ~bytes
+        (fun () -> ignore (Ipc.serialize ~compression_threshold:0 Ipc.Response v));
+      run "decode_ipc_compressed" fx ~extra ~bytes (fun () -> ignore (Ipc.deserialize zipped)))
+    fixtures;
+  (* Temporal conversions, into a vector of their own so that the fixture,
+     shared with the round trips, is left as it is *)
+  List.iter (fun ((_, _, v) as fx) ->
+      match v with
+      | V_timestamp (a, _) ->
+        let dst = Array1.create int64 c_layout (Array1.dim a) in
+        run "time_to_unix" fx ~bytes:(Array1.size_in_bytes a)
+          (fun () -> ignore (Time.timestamp_to_unix ~dst a))
+      | _ -> ())
+    fixtures;
+  (* Round trips *)
+  let table = Hashtbl.create 64 in
+  List.iter (fun (name, _, v) -> Hashtbl.replace table name v) fixtures;
+  let port = start_server table in
+  let conn = open_connection "127.0.0.1" port in
+  let zconn = open_connection ~compression_threshold:0 "127.0.0.1" port in
+  let n = if !quick then 200 else 2000 in
+  List.iter (fun ((name, _, v) as fx) ->
+      let bytes = Bytes.length (Ipc.serialize Ipc.Response v) in
+      run_latency "eval_k" fx ~bytes ~n (fun () -> ignore (eval conn name));
+      run_latency "eval_ipc" fx ~bytes ~n (fun () -> ignore (Ipc.eval conn name));
+      run_latency "rpc_k" fx ~bytes ~n (fun () -> ignore (rpc conn "echo" v));
+      run_latency "rpc_ipc" fx ~bytes ~n (fun () -> ignore (Ipc.rpc conn "echo" v));
+      run_latency "rpc_ipc_compressed" fx ~bytes ~n (fun () -> ignore (Ipc.rpc zconn "echo" v)))
+    fixtures;
+  close_connection zconn;
+  close_connection conn
@@ -21,6 +21,9 @@ type attrib =
 (* Note: there are no q enumerations. In the q-rpc protocol they are symbol vectors *)
 (* Note: lambdas, operators, partial applications (types 100, 102 and 104) are not supported in this version*)
 
+(* A symbol dictionary, implemented in C *)
+type sym_dict
+
 type  q_val = 
   (* scalars *)
   | Bool of bool
@@ -40,7 +43,7 @@ type  q_val =
   | Time of int32
   | Timestamp of int64
   | Timespan of int64
-  | Guid of string
+  | Guid of string (* 16 bytes *)
   (* vectors of scalars *)
   | V_bool of uint8_bigarray * attrib
   | V_byte of uint8_bigarray * attrib
@@ -59,12 +62,19 @@ type  q_val =
   | V_time of int32_bigarray * attrib
   | V_timestamp of int64_bigarray * attrib
   | V_timespan of  int64_bigarray * attrib
-  | V_guid of string array * attrib
+  | V_guid of uint8_bigarray * attrib (* 16 bytes per GUID *)
   (* mixed lists *)
   | V_mixed of q_val array
   (* tables and dictionaries *)
   | Table of q_table
   | Dict of q_dict
+  (* symbol vector as indices into a symbol dictionary, see open_connection *)
+  | V_symbol_enum of int32_bigarray * sym_dict * attrib
+  (* list of strings: their chars one after the other, and the n + 1 offsets
+     at which they start and end. See open_connection *)
+  | V_strings of char_bigarray * int64_bigarray
+  (* a vector and its validity. See open_connection *)
+  | V_valid of q_val * validity
   (* result of Q functions that return void. In q, (::) of type 101 *)
   | Unit
 
@@ -74,15 +84,237 @@ and q_table = { colnames: q_val; (* Always a Q_v_symbol *)
                 cols: q_val;
 		attrib_t: attrib }
 
+(* Bit i of [bitmap] (least significant first) is set when element i is not
+   null. The bitmap is empty when [null_count] is 0 *)
+and validity = { bitmap: uint8_bigarray; null_count: int }
+
+
+(* Sets up the custom operations of the bigarrays that hold q vectors *)
+external q_init_ : unit -> unit = "q_init"
+
+let () = q_init_ ()
+
+
+module Sym_dict = struct
+  type t = sym_dict
+
+  external create : unit -> t = "q_sym_dict_create"
+
+  external length : t -> int = "q_sym_dict_length"
+
+  external get : t -> int32 -> string = "q_sym_dict_get"
+
+  external intern : t -> string -> int32 = "q_sym_dict_intern"
+
+  external find_ : t -> string -> int32 = "q_sym_dict_find"
+
+  let find dict sym =
+    match find_ dict sym with
+    | (-1l) -> None
+    | i -> Some i
+end
+
+
+(* Instrumentation *)
+
+module Stats = struct
+  (* The counters of a connection, added to by the C stubs *)
+  type raw
+
+  external raw_create : unit -> raw = "q_stats_create"
+
+  (* [| send; wait; decode; bytes out; bytes in; type; count; ... |] *)
+  external raw_take : raw -> int array = "q_stats_take"
+
+  external clock : unit -> int = "q_stats_clock" [@@noalloc]
+
+  type call = {
+    name : string;
+    query : string;
+    wall_ns : int;
+    send_ns : int;
+    wait_ns : int;
+    decode_ns : int;
+    bytes_out : int;
+    bytes_in : int;
+    objects : (int * int) list;
+    minor_words : float;
+    failed : bool;
+  }
+
+  type histogram = {
+    bounds : float array;
+    counts : int array;
+    sum : float;
+  }
 
-type q_conn = int32
+  type snapshot = {
+    calls : int;
+    failures : int;
+    bytes_out : int;
+    bytes_in : int;
+    minor_words : float;
+    objects : (int * int) list;
+    wall : histogram;
+    send : histogram;
+    wait : histogram;
+    decode : histogram;
+  }
 
-external q_connect_ : string -> int -> q_conn = "q_connect"
+  (* Upper bounds of the latency buckets, in seconds *)
+  let bounds = [| 1e-5; 2.5e-5; 5e-5; 1e-4; 2.5e-4; 5e-4; 1e-3; 2.5e-3; 5e-3;
+                  1e-2; 2.5e-2; 5e-2; 0.1; 0.25; 0.5; 1.; 2.5; 5.; 10. |]
+
+  (* Histograms of the phases of calls, in this order *)
+  let n_phases = 4
+
+  type t = {
+    lock : Mutex.t;
+    hook : (call -> unit) option;
+    mutable n_calls : int;
+    mutable n_failures : int;
+    mutable total_out : int;
+    mutable total_in : int;
+    mutable total_words : float;
+    by_type : int array;        (* objects decoded, by q type land 255 *)
+    buckets : int array array;  (* per phase, one more than [bounds] *)
+    sums : float array;         (* per phase, in seconds *)
+  }
+
+  let create ?hook () =
+    { lock = Mutex.create (); hook;
+      n_calls = 0; n_failures = 0; total_out = 0; total_in = 0; total_words = 0.;
+      by_type = Array.make 256 0;
+      buckets = Array.init n_phases (fun _ -> Array.make (Array.length bounds + 1) 0);
+      sums = Array.make n_phases 0. }
+
+  let reset t =
+    Mutex.lock t.lock;
+    t.n_calls <- 0;
+    t.n_failures <- 0;
+    t.total_out <- 0;
+    t.total_in <- 0;
+    t.total_words <- 0.;
+    Array.fill t.by_type 0 256 0;
+    Array.iter (fun b -> Array.fill b 0 (Array.length b) 0) t.buckets;
+    Array.fill t.sums 0 n_phases 0.;
+    Mutex.unlock t.lock
+
+  let observe t phase ns =
+    let seconds = float_of_int ns *. 1e-9 in
+    let rec bucket i =
+      if i = Array.length bounds || seconds <= bounds.(i) then i else bucket (i + 1) in
+    let b = t.buckets.(phase) and i = bucket 0 in
+    b.(i) <- b.(i) + 1;
+    t.sums.(phase) <- t.sums.(phase) +. seconds
+
+  let add t (c : call) =
+    Mutex.lock t.lock;
+    t.n_calls <- t.n_calls + 1;
+    if c.failed then t.n_failures <- t.n_failures + 1;
+    t.total_out <- t.total_out + c.bytes_out;
+    t.total_in <- t.total_in + c.bytes_in;
+    t.total_words <- t.total_words +. c.minor_words;
+    List.iter (fun (ty, n) -> t.by_type.(ty land 255) <- t.by_type.(ty land 255) + n) c.objects;
+    observe t 0 c.wall_ns;
+    observe t 1 c.send_ns;
+    observe t 2 c.wait_ns;
+    observe t 3 c.decode_ns;
+    Mutex.unlock t.lock;
+    Option.iter (fun hook -> hook c) t.hook
+
+  (* Runs the call [f] on a connection with counters [raw], and adds it to [t] *)
+  let measure raw t name query f =
+    ignore (raw_take raw); (* traffic of functions that are not measured *)
+    let words = Gc.minor_words () in
+    let start = clock () in
+    let finish failed =
+      let wall_ns = clock () - start in
+      let minor_words = Gc.minor_words () -. words in
+      let r = raw_take raw in
+      let rec objects i = if i >= Array.length r then [] else (r.(i), r.(i + 1)) :: objects (i + 2) in
+      add t { name; query; wall_ns; send_ns = r.(0); wait_ns = r.(1); decode_ns = r.(2);
+              bytes_out = r.(3); bytes_in = r.(4); objects = objects 5; minor_words; failed } in
+    match f () with
+    | result -> finish false; result
+    | exception e ->
+      let bt = Printexc.get_raw_backtrace () in
+      finish true;
+      Printexc.raise_with_backtrace e bt
+
+  let snapshot t =
+    let histogram phase =
+      { bounds = Array.copy bounds; counts = Array.copy t.buckets.(phase); sum = t.sums.(phase) } in
+    Mutex.lock t.lock;
+    let objects = ref [] in
+    for i = 255 downto 0 do
+      if t.by_type.(i) > 0 then
+        objects := ((if i >= 128 then i - 256 else i), t.by_type.(i)) :: !objects
+    done;
+    let s = { calls = t.n_calls; failures = t.n_failures;
+              bytes_out = t.total_out; bytes_in = t.total_in;
+              minor_words = t.total_words; objects = List.sort compare !objects;
+              wall = histogram 0; send = histogram 1; wait = histogram 2; decode = histogram 3 } in
+    Mutex.unlock t.lock;
+    s
+
+  let to_prometheus ?(prefix = "q") t =
+    let s = snapshot t in
+    let b = Buffer.create 4096 in
+    let counter name help v =
+      Printf.bprintf b "# HELP %s_%s %s\n# TYPE %s_%s counter\n%s_%s %s\n"
+        prefix name help prefix name prefix name v in
+    counter "calls_total" "Calls made" (string_of_int s.calls);
+    counter "call_failures_total" "Calls that raised" (string_of_int s.failures);
+    counter "sent_bytes_total" "Bytes of requests" (string_of_int s.bytes_out);
+    counter "received_bytes_total" "Bytes of replies" (string_of_int s.bytes_in);
+    counter "minor_words_total" "Words allocated by calls" (Printf.sprintf "%.0f" s.minor_words);
+    Printf.bprintf b "# HELP %s_decoded_objects_total Objects decoded, by q type\n\
+                      # TYPE %s_decoded_objects_total counter\n" prefix prefix;
+    List.iter (fun (ty, n) -> Printf.bprintf b "%s_decoded_objects_total{type=\"%d\"} %d\n" prefix ty n)
+      s.objects;
+    Printf.bprintf b "# HELP %s_call_seconds Time of calls, by phase\n\
+                      # TYPE %s_call_seconds histogram\n" prefix prefix;
+    List.iter (fun (phase, h) ->
+        let total = ref 0 in
+        Array.iteri (fun i n ->
+            total := !total + n;
+            let le = if i < Array.length h.bounds then Printf.sprintf "%g" h.bounds.(i) else "+Inf" in
+            Printf.bprintf b "%s_call_seconds_bucket{phase=\"%s\",le=\"%s\"} %d\n" prefix phase le !total)
+          h.counts;
+        Printf.bprintf b "%s_call_seconds_sum{phase=\"%s\"} %g\n" prefix phase h.sum;
+        Printf.bprintf b "%s_call_seconds_count{phase=\"%s\"} %d\n" prefix phase !total)
+      ["wall", s.wall; "send", s.send; "wait", s.wait; "decode", s.decode];
+    Buffer.contents b
+end
+
+
+(* Note: the C stubs access the fields of q_conn, see enum q_conn_field *)
+type q_conn = {
+  handle : int32;
+  sym_dict : sym_dict option; (* Some d: symbol vectors are decoded against d *)
+  compression : int; (* Ipc messages longer than this are compressed *)
+  packed_strings : bool; (* lists of strings are decoded as V_strings *)
+  stats : conn_stats option; (* Some s: calls are measured *)
+  validity : bool; (* vectors are decoded as V_valid *)
+  endpoint : string; (* host:port *)
+}
+
+(* Note: the C stubs read [raw], see conn_call_stats *)
+and conn_stats = { raw : Stats.raw; sink : Stats.t }
+
+external q_connect_ : string -> int -> int32 = "q_connect"
 
 exception Q_connect of string
 
+(* Note: raised by the C stubs, with the message of a q error *)
+exception Q_error of string
+
+let () = Callback.register_exception "Q.Q_error" (Q_error "")
+
 
-let open_connection host port =
+let open_connection ?(symbol_enum = false) ?(packed_strings = false)
+    ?(compression_threshold = max_int) ?stats ?(validity = false) host port =
   match q_connect_ host port with
   | (0l) -> 
     raise (Q_connect (host ^ ":" ^ (string_of_int port) ^  " authentication error"))
@@ -90,16 +322,2103 @@ let open_connection host port =
     raise (Q_connect (host ^ ":" ^ (string_of_int port) ^  " host unknown or connection refused on port"))
   | (-2l) -> 
     raise (Q_connect (host ^ ":" ^ (string_of_int port) ^  " timeout error"))
-  | handle -> handle
+  | handle ->
+    { handle;
+      sym_dict = if symbol_enum then Some (Sym_dict.create ()) else None;
+      compression = max 0 compression_threshold;
+      packed_strings;
+      stats = Option.map (fun sink -> { raw = Stats.raw_create (); sink }) stats;
+      validity;
+      endpoint = host ^ ":" ^ string_of_int port }
+
+let symbol_dict conn = conn.sym_dict
+
+let endpoint conn = conn.endpoint
+
+
+(* Runs [f], the call [name] of [query] on a connection with statistics [s].
+   Calls on connections without statistics are made directly, to allocate
+   no closure *)
+let measured s name query f = Stats.measure s.raw s.sink name query f
+
+external eval_async_ : q_conn -> string -> unit = "q_eval_async"
+
+external eval_ : q_conn -> string -> q_val = "q_eval"
+
+external rpc_async_ : q_conn -> string -> q_val -> unit = "q_rpc_async"
+
+external rpc_ : q_conn -> string -> q_val -> q_val = "q_rpc"
+
+external recv_ : q_conn -> q_val = "q_recv"
+
+let eval_async conn str =
+  match conn.stats with
+  | None -> eval_async_ conn str
+  | Some s -> measured s "eval_async" str (fun () -> eval_async_ conn str)
+
+let eval conn str =
+  match conn.stats with
+  | None -> eval_ conn str
+  | Some s -> measured s "eval" str (fun () -> eval_ conn str)
+
+let rpc_async conn str v =
+  match conn.stats with
+  | None -> rpc_async_ conn str v
+  | Some s -> measured s "rpc_async" str (fun () -> rpc_async_ conn str v)
+
+let rpc conn str v =
+  match conn.stats with
+  | None -> rpc_ conn str v
+  | Some s -> measured s "rpc" str (fun () -> rpc_ conn str v)
+
+let recv conn =
+  match conn.stats with
+  | None -> recv_ conn
+  | Some s -> measured s "recv" "" (fun () -> recv_ conn)
+
+external wait_readable : q_conn -> float -> bool = "q_wait_readable"
+
+external close_connection : q_conn -> unit = "q_close"
+
+(* The Failure raised by the stubs when a connection is lost *)
+let network_error = "Network error"
+
+
+(* K objects *)
+
+module Kobj = struct
+  type t
+
+  external of_q_val : q_val -> t = "q_kobj_of_q_val"
+
+  external to_q_val_ : sym_dict option -> bool -> t -> q_val = "q_kobj_to_q_val"
+
+  let to_q_val ?sym_dict ?(packed_strings = false) k = to_q_val_ sym_dict packed_strings k
+
+  external eval : q_conn -> string -> t = "q_kobj_eval"
+
+  external rpc : q_conn -> string -> q_val -> t = "q_kobj_rpc"
+
+  external release : t -> unit = "q_kobj_release"
+
+  (* Parts of K objects, see Parallel. Column -1 is the object itself *)
+
+  external header : t -> int -> int * int * int = "q_kobj_header"
+
+  external colnames : t -> string array = "q_kobj_colnames"
+
+  external part : t -> int -> t = "q_kobj_part"
+
+  external decode_column : sym_dict option -> bool -> t -> int -> q_val = "q_kobj_decode_column"
+
+  external symbols : t -> int -> int -> int -> string array = "q_kobj_symbols"
+
+  external mixed : t -> int -> int -> int -> q_val array = "q_kobj_mixed"
+end
+
+
+(* Typed tables *)
+
+module Schema = struct
+  type _ col_type =
+    | S_bool : uint8_bigarray col_type
+    | S_byte : uint8_bigarray col_type
+    | S_short : uint16_bigarray col_type
+    | S_int32 : int32_bigarray col_type
+    | S_int64 : int64_bigarray col_type
+    | S_float32 : float32_bigarray col_type
+    | S_float64 : float64_bigarray col_type
+    | S_char : char_bigarray col_type
+    | S_symbol : string array col_type
+    | S_symbol_enum : (int32_bigarray * sym_dict) col_type
+    | S_strings : (char_bigarray * int64_bigarray) col_type
+    | S_month : int32_bigarray col_type
+    | S_date : int32_bigarray col_type
+    | S_datetime : float64_bigarray col_type
+    | S_minute : int32_bigarray col_type
+    | S_second : int32_bigarray col_type
+    | S_time : int32_bigarray col_type
+    | S_timestamp : int64_bigarray col_type
+    | S_timespan : int64_bigarray col_type
+    | S_guid : uint8_bigarray col_type
+    | S_q_val : q_val col_type
+
+  type _ t =
+    | Nil : unit t
+    | Col : string * 'a col_type * 'b t -> ('a * 'b) t
+
+  exception Mismatch of string
+
+  let bool = S_bool
+  let byte = S_byte
+  let short = S_short
+  let int32 = S_int32
+  let int64 = S_int64
+  let float32 = S_float32
+  let float64 = S_float64
+  let char = S_char
+  let symbol = S_symbol
+  let symbol_enum = S_symbol_enum
+  let strings = S_strings
+  let month = S_month
+  let date = S_date
+  let datetime = S_datetime
+  let minute = S_minute
+  let second = S_second
+  let time = S_time
+  let timestamp = S_timestamp
+  let timespan = S_timespan
+  let guid = S_guid
+  let q_val = S_q_val
+
+  let nil = Nil
+
+  let col name ty rest = Col (name, ty, rest)
+
+  let rec column : type a. string -> a col_type -> q_val -> a = fun name ty v ->
+    match ty, v with
+    | S_q_val, v -> v
+    | _, V_valid (v, _) -> column name ty v
+    | S_bool, V_bool (a, _) -> a
+    | S_byte, V_byte (a, _) -> a
+    | S_short, V_short (a, _) -> a
+    | S_int32, V_int32 (a, _) -> a
+    | S_int64, V_int64 (a, _) -> a
+    | S_float32, V_float32 (a, _) -> a
+    | S_float64, V_float64 (a, _) -> a
+    | S_char, V_char (a, _) -> a
+    | S_symbol, V_symbol (a, _) -> a
+    | S_symbol_enum, V_symbol_enum (a, d, _) -> (a, d)
+    | S_strings, V_strings (a, o) -> (a, o)
+    | S_month, V_month (a, _) -> a
+    | S_date, V_date (a, _) -> a
+    | S_datetime, V_datetime (a, _) -> a
+    | S_minute, V_minute (a, _) -> a
+    | S_second, V_second (a, _) -> a
+    | S_time, V_time (a, _) -> a
+    | S_timestamp, V_timestamp (a, _) -> a
+    | S_timespan, V_timespan (a, _) -> a
+    | S_guid, V_guid (a, _) -> a
+    | _ -> raise (Mismatch ("column " ^ name ^ " has the wrong type"))
+
+  (* The names and columns of a table, or of a keyed table *)
+  let columns = function
+    | Table { colnames = V_symbol (names, _); cols = V_mixed cols; _ } -> (names, cols)
+    | Dict { keys = Table { colnames = V_symbol (knames, _); cols = V_mixed kcols; _ };
+             vals = Table { colnames = V_symbol (vnames, _); cols = V_mixed vcols; _ }; _ } ->
+      (Array.append knames vnames, Array.append kcols vcols)
+    | _ -> raise (Mismatch "not a table")
+
+  let index names name =
+    let rec loop i =
+      if i = Array.length names then raise (Mismatch ("no column " ^ name))
+      else if names.(i) = name then i
+      else loop (i + 1) in
+    loop 0
+
+  let rec lookup : type a. string array -> q_val array -> a t -> a = fun names cols schema ->
+    match schema with
+    | Nil -> ()
+    | Col (name, ty, rest) ->
+      let c = column name ty cols.(index names name) in
+      (c, lookup names cols rest)
+
+  let decode schema v =
+    let (names, cols) = columns v in
+    lookup names cols schema
+
+  (* The tables of a K object, with their column names: the object itself,
+     or the keys and values of a keyed table *)
+  let kobj_tables k =
+    let table k = (k, Kobj.colnames k) in
+    match Kobj.header k (-1) with
+    | (98, _, _) -> [| table k |]
+    | (99, _, _) ->
+      (try [| table (Kobj.part k 0); table (Kobj.part k 1) |]
+       with Invalid_argument _ -> raise (Mismatch "not a table"))
+    | _ -> raise (Mismatch "not a table")
+
+  let decode_kobj ?sym_dict ?(packed_strings = false) schema k =
+    let tables = kobj_tables k in
+    let names = Array.concat (Array.to_list (Array.map snd tables)) in
+    (* Column [i] of all the tables, from the first *)
+    let rec decode_column name ty i j =
+      let (t, names) = tables.(j) in
+      if i < Array.length names then column name ty (Kobj.decode_column sym_dict packed_strings t i)
+      else decode_column name ty (i - Array.length names) (j + 1) in
+    let rec lookup : type a. a t -> a = function
+      | Nil -> ()
+      | Col (name, ty, rest) ->
+        let c = decode_column name ty (index names name) 0 in
+        (c, lookup rest) in
+    lookup schema
+
+  let of_kobj schema conn k =
+    Fun.protect ~finally:(fun () -> Kobj.release k)
+      (fun () -> decode_kobj ?sym_dict:conn.sym_dict ~packed_strings:conn.packed_strings schema k)
+
+  let eval schema conn str =
+    let f () = of_kobj schema conn (Kobj.eval conn str) in
+    match conn.stats with
+    | None -> f ()
+    | Some s -> measured s "Schema.eval" str f
+
+  let rpc schema conn str v =
+    let f () = of_kobj schema conn (Kobj.rpc conn str v) in
+    match conn.stats with
+    | None -> f ()
+    | Some s -> measured s "Schema.rpc" str f
+end
+
+
+(* Arrow export *)
+
+module Arrow = struct
+  external export : q_val -> schema:nativeint -> array:nativeint -> unit = "q_arrow_export"
+
+  external collect : unit -> unit = "q_arrow_collect"
+end
+
+
+(* Temporal conversions *)
+
+module Time = struct
+  external shift_int64 : int64_bigarray -> int64_bigarray -> int64 -> unit = "q_time_shift_int64"
+  external shift_int32 : int32_bigarray -> int32_bigarray -> int32 -> unit = "q_time_shift_int32"
+  external affine_float64 :
+    float64_bigarray -> float64_bigarray -> float -> float -> unit = "q_time_affine_float64"
+  external months_to_days : int32_bigarray -> int32_bigarray -> unit = "q_time_months_to_days"
+  external days_to_months : int32_bigarray -> int32_bigarray -> unit = "q_time_days_to_months"
+  external widen_int32 : int32_bigarray -> int64_bigarray -> int64 -> unit = "q_time_widen_int32"
+  external narrow_int64 : int64_bigarray -> int32_bigarray -> int64 -> unit = "q_time_narrow_int64"
+  external epoch_days : unit -> int32 = "q_time_epoch_days"
+
+  (* 2000.01.01 in Unix time, from Q_EPOCH_DAYS in q_interface.h *)
+  let epoch_days = epoch_days ()
+  let epoch_seconds = Int32.to_float epoch_days *. 86400.
+  let epoch_ns = Int64.mul (Int64.of_int32 epoch_days) 86_400_000_000_000L
+
+  let convert_to kind f ?dst src =
+    let dst = match dst with
+      | Some dst -> dst
+      | None -> Array1.create kind c_layout (Array1.dim src) in
+    f src dst;
+    dst
+
+  let convert f ?dst src = convert_to (Array1.kind src) f ?dst src
+
+  let timestamp_to_unix ?dst a = convert (fun a b -> shift_int64 a b epoch_ns) ?dst a
+  let timestamp_of_unix ?dst a = convert (fun a b -> shift_int64 a b (Int64.neg epoch_ns)) ?dst a
+  let date_to_unix ?dst a = convert (fun a b -> shift_int32 a b epoch_days) ?dst a
+  let date_of_unix ?dst a = convert (fun a b -> shift_int32 a b (Int32.neg epoch_days)) ?dst a
+  let datetime_to_unix ?dst a =
+    convert (fun a b -> affine_float64 a b (Int32.to_float epoch_days) 86400.) ?dst a
+  let datetime_of_unix ?dst a =
+    convert (fun a b -> affine_float64 a b (-. epoch_seconds) (1. /. 86400.)) ?dst a
+  let month_to_unix ?dst a = convert months_to_days ?dst a
+  let month_of_unix ?dst a = convert days_to_months ?dst a
+
+  (* Nanoseconds per unit of each time of day *)
+  let ns_per_minute = 60_000_000_000L
+  let ns_per_second = 1_000_000_000L
+  let ns_per_ms = 1_000_000L
+
+  let minute_to_ns ?dst a = convert_to int64 (fun a b -> widen_int32 a b ns_per_minute) ?dst a
+  let minute_of_ns ?dst a = convert_to int32 (fun a b -> narrow_int64 a b ns_per_minute) ?dst a
+  let second_to_ns ?dst a = convert_to int64 (fun a b -> widen_int32 a b ns_per_second) ?dst a
+  let second_of_ns ?dst a = convert_to int32 (fun a b -> narrow_int64 a b ns_per_second) ?dst a
+  let time_to_ns ?dst a = convert_to int64 (fun a b -> widen_int32 a b ns_per_ms) ?dst a
+  let time_of_ns ?dst a = convert_to int32 (fun a b -> narrow_int64 a b ns_per_ms) ?dst a
+end
+
+
+(* Native IPC *)
+
+module Ipc = struct
+  (* Note: the constructors are numbered as in the message header *)
+  type msg_type = Async | Sync | Response
+
+  external serialize_ : msg_type -> int -> q_val -> bytes = "q_ipc_serialize"
+
+  let serialize ?(compression_threshold = max_int) ty v =
+    serialize_ ty (max 0 compression_threshold) v
+
+  external deserialize_ : sym_dict option -> bool -> bytes -> int -> int -> msg_type * q_val
+    = "q_ipc_deserialize"
+
+  let deserialize ?sym_dict ?(packed_strings = false) bytes =
+    deserialize_ sym_dict packed_strings bytes 0 (Bytes.length bytes)
+
+  external encode_request : msg_type -> string -> q_val option -> bytes = "q_ipc_encode_request"
+
+  external fd : q_conn -> Unix.file_descr = "q_ipc_fd"
+
+  external send_ : q_conn -> msg_type -> q_val -> unit = "q_ipc_send"
+
+  let send conn ty v =
+    match conn.stats with
+    | None -> send_ conn ty v
+    | Some s -> measured s "Ipc.send" "" (fun () -> send_ conn ty v)
+
+  external send_request : q_conn -> msg_type -> string -> q_val option -> unit = "q_ipc_send_request"
+
+  external recv : q_conn -> msg_type * q_val = "q_ipc_recv"
+
+  let rec await_response conn =
+    match recv conn with
+    | (Response, v) -> v
+    | _ -> await_response conn
+
+  let eval_async_ conn str = send_request conn Async str None
+
+  let eval_ conn str =
+    send_request conn Sync str None;
+    await_response conn
+
+  let rpc_async_ conn str v = send_request conn Async str (Some v)
+
+  let rpc_ conn str v =
+    send_request conn Sync str (Some v);
+    await_response conn
+
+  let eval_async conn str =
+    match conn.stats with
+    | None -> eval_async_ conn str
+    | Some s -> measured s "Ipc.eval_async" str (fun () -> eval_async_ conn str)
+
+  let eval conn str =
+    match conn.stats with
+    | None -> eval_ conn str
+    | Some s -> measured s "Ipc.eval" str (fun () -> eval_ conn str)
+
+  let rpc_async conn str v =
+    match conn.stats with
+    | None -> rpc_async_ conn str v
+    | Some s -> measured s "Ipc.rpc_async" str (fun () -> rpc_async_ conn str v)
+
+  let rpc conn str v =
+    match conn.stats with
+    | None -> rpc_ conn str v
+    | Some s -> measured s "Ipc.rpc" str (fun () -> rpc_ conn str v)
+
+  module Parser = struct
+    type t = {
+      sym_dict : sym_dict option;
+      packed_strings : bool;
+      mutable buf : bytes;
+      mutable start : int; (* the unparsed bytes are buf[start, stop) *)
+      mutable stop : int;
+    }
+
+    let create ?sym_dict ?(packed_strings = false) () =
+      { sym_dict; packed_strings; buf = Bytes.create 65536; start = 0; stop = 0 }
+
+    let buffered t = t.stop - t.start
+
+    let feed t src off len =
+      if off < 0 || len < 0 || off > Bytes.length src - len then invalid_arg "Q.Ipc.Parser.feed";
+      if len > Bytes.length t.buf - t.stop then begin
+        (* Move the unparsed bytes to the front, to a larger buffer if needed *)
+        let used = buffered t in
+        let buf =
+          if used + len <= Bytes.length t.buf then t.buf
+          else Bytes.create (max (used + len) (2 * Bytes.length t.buf)) in
+        Bytes.blit t.buf t.start buf 0 used;
+        t.buf <- buf;
+        t.start <- 0;
+        t.stop <- used
+      end;
+      Bytes.blit src off t.buf t.stop len;
+      t.stop <- t.stop + len
+
+    let next t =
+      if buffered t < 8 then None
+      else
+        let len = Int32.to_int (Bytes.get_int32_le t.buf (t.start + 4)) in
+        if len < 8 then failwith "q IPC: invalid message length";
+        if buffered t < len then None
+        else begin
+          let start = t.start in
+          (* Consume the message first: decoding raises on q errors *)
+          t.start <- start + len;
+          if t.start = t.stop then begin t.start <- 0; t.stop <- 0 end;
+          Some (deserialize_ t.sym_dict t.packed_strings t.buf start len)
+        end
+  end
+end
+
+
+
+(* Pipelining *)
+
+module Pipeline = struct
+  type state =
+    | Pending
+    | Ready of q_val
+    | Failed of exn
+
+  type t = {
+    conn : q_conn;
+    window : int;
+    pending : future Queue.t; (* in the order of the requests *)
+    mutable broken : exn option; (* the failure that desynchronised the replies *)
+  }
+  and future = {
+    pipeline : t;
+    mutable state : state;
+  }
+
+  let create ?(window = 128) conn =
+    if window < 1 then invalid_arg "Q.Pipeline.create";
+    { conn; window; pending = Queue.create (); broken = None }
+
+  (* The replies of kdb+ come in the order of the requests *)
+  let rec read_reply t =
+    match Ipc.recv t.conn with
+    | (Ipc.Response, v) -> (Queue.pop t.pending).state <- Ready v
+    | _ -> read_reply t
+    | exception (Q_error _ as e) ->
+      (* The reply has been read *)
+      (Queue.pop t.pending).state <- Failed e
+    | exception e ->
+      (* The connection is lost, or the next reply may belong to any request:
+         all the pending replies are *)
+      t.broken <- Some e;
+      Queue.iter (fun fut -> fut.state <- Failed e) t.pending;
+      Queue.clear t.pending;
+      raise e
+
+  let submit t str arg =
+    Option.iter raise t.broken;
+    if Queue.length t.pending >= t.window then read_reply t;
+    Ipc.send_request t.conn Ipc.Sync str arg;
+    let fut = { pipeline = t; state = Pending } in
+    Queue.push fut t.pending;
+    fut
+
+  let eval t str = submit t str None
+
+  let rpc t str v = submit t str (Some v)
+
+  let rec await fut =
+    match fut.state with
+    | Ready v -> v
+    | Failed e -> raise e
+    | Pending -> read_reply fut.pipeline; await fut
+
+  let is_ready fut =
+    match fut.state with
+    | Pending -> false
+    | Ready _ | Failed _ -> true
+
+  let in_flight t = Queue.length t.pending
+
+  let flush t =
+    while not (Queue.is_empty t.pending) do read_reply t done
+end
+
+
+
+(* Tickerplant subscriptions *)
+
+module Subscriber = struct
+  type update = { table : string; data : q_val }
+
+  type item =
+    | Batch of update array
+    | Message of q_val
+
+  type t = {
+    conn : q_conn;
+    schema : q_val;
+    queue : item Queue.t;      (* read, not yet consumed *)
+    max_batches : int;
+    lock : Mutex.t;
+    changed : Condition.t;     (* the queue changed, or the reader finished *)
+    stopping : bool Atomic.t;
+    mutable finished : bool;   (* the reader has exited *)
+    mutable error : exn option;
+    mutable domains : unit Domain.t list;
+  }
+
+  let fail t e =
+    Mutex.lock t.lock;
+    if Option.is_none t.error then t.error <- Some e;
+    Atomic.set t.stopping true;
+    Condition.broadcast t.changed;
+    Mutex.unlock t.lock
+
+  (* Blocks while the consumer is [max_batches] behind *)
+  let push t item =
+    Mutex.lock t.lock;
+    while Queue.length t.queue >= t.max_batches && not (Atomic.get t.stopping) do
+      Condition.wait t.changed t.lock
+    done;
+    Queue.push item t.queue;
+    Condition.broadcast t.changed;
+    Mutex.unlock t.lock
+
+  (* Body of the reader domain. A batch is pushed when it holds [batch_size]
+     updates, or [batch_delay] seconds after its first update *)
+  let read t ~batch_size ~batch_delay =
+    let batch = ref [] and count = ref 0 and deadline = ref 0. in
+    let flush () =
+      if !count > 0 then begin
+        push t (Batch (Array.of_list (List.rev !batch)));
+        batch := [];
+        count := 0
+      end in
+    let add update =
+      if !count = 0 then deadline := Unix.gettimeofday () +. batch_delay;
+      batch := update :: !batch;
+      incr count;
+      if !count >= batch_size then flush () in
+    try
+      while not (Atomic.get t.stopping) do
+        let timeout =
+          if !count = 0 then batch_delay else !deadline -. Unix.gettimeofday () in
+        if timeout > 0. && wait_readable t.conn timeout then begin
+          match recv t.conn with
+          | V_mixed [| Symbol "upd"; Symbol table; data |] -> add { table; data }
+          | msg -> flush (); push t (Message msg)
+        end else
+          flush ()
+      done;
+      flush ()
+    with e -> fail t e
+
+  (* Body of the consumer domain *)
+  let rec consume t f on_message =
+    Mutex.lock t.lock;
+    while Queue.is_empty t.queue && not t.finished do
+      Condition.wait t.changed t.lock
+    done;
+    match Queue.take_opt t.queue with
+    | None -> Mutex.unlock t.lock
+    | Some item ->
+      Condition.broadcast t.changed;
+      Mutex.unlock t.lock;
+      match (match item with Batch b -> f b | Message v -> on_message v) with
+      | () -> consume t f on_message
+      | exception e -> fail t e
+
+  let sub_query table syms =
+    let syms =
+      match syms with
+      | [] -> "`"
+      | [s] -> ",`" ^ s
+      | syms -> "`" ^ String.concat "`" syms in
+    ".u.sub[`" ^ table ^ ";" ^ syms ^ "]"
+
+  let subscribe ?(batch_size = 64) ?(batch_delay = 0.01) ?(max_batches = 16)
+      ?(on_message = fun _ -> ()) conn ~table ~syms f =
+    if batch_size < 1 || max_batches < 1 || not (batch_delay > 0.) then
+      invalid_arg "Q.Subscriber.subscribe";
+    let schema = eval conn (sub_query table syms) in
+    let t = {
+      conn; schema;
+      queue = Queue.create ();
+      max_batches;
+      lock = Mutex.create ();
+      changed = Condition.create ();
+      stopping = Atomic.make false;
+      finished = false;
+      error = None;
+      domains = [];
+    } in
+    let reader () =
+      read t ~batch_size ~batch_delay;
+      Mutex.lock t.lock;
+      t.finished <- true;
+      Condition.broadcast t.changed;
+      Mutex.unlock t.lock in
+    t.domains <- [Domain.spawn reader; Domain.spawn (fun () -> consume t f on_message)];
+    t
+
+  let schema t = t.schema
+
+  let wait t =
+    List.iter Domain.join t.domains;
+    Option.iter raise t.error
+
+  let stop t =
+    Atomic.set t.stopping true;
+    Mutex.lock t.lock;
+    Condition.broadcast t.changed;
+    Mutex.unlock t.lock;
+    wait t
+end
+
+
+(* Publishing to a tickerplant *)
+
+module Publisher = struct
+  type col_type =
+    | T_bool | T_byte | T_short | T_int32 | T_int64 | T_float32 | T_float64
+    | T_char | T_symbol | T_month | T_date | T_datetime | T_minute | T_second
+    | T_time | T_timestamp | T_timespan | T_guid
+
+  (* The buffer of a column, reused across flushes *)
+  type column =
+    | C_bool of uint8_bigarray
+    | C_byte of uint8_bigarray
+    | C_short of uint16_bigarray
+    | C_int32 of int32_bigarray
+    | C_int64 of int64_bigarray
+    | C_float32 of float32_bigarray
+    | C_float64 of float64_bigarray
+    | C_char of char_bigarray
+    | C_symbol of string array
+    | C_month of int32_bigarray
+    | C_date of int32_bigarray
+    | C_datetime of float64_bigarray
+    | C_minute of int32_bigarray
+    | C_second of int32_bigarray
+    | C_time of int32_bigarray
+    | C_timestamp of int64_bigarray
+    | C_timespan of int64_bigarray
+    | C_guid of uint8_bigarray (* 16 bytes per GUID *)
+
+  type t = {
+    conn : q_conn;
+    func : string;
+    table : string;
+    columns : column array;
+    max_rows : int;
+    max_delay : float;
+    mutable capacity : int;
+    mutable rows : int;
+    mutable first_row_time : float; (* when the oldest buffered row was added *)
+  }
+
+  let create_column n = function
+    | T_bool -> C_bool (Array1.create int8_unsigned c_layout n)
+    | T_byte -> C_byte (Array1.create int8_unsigned c_layout n)
+    | T_short -> C_short (Array1.create int16_unsigned c_layout n)
+    | T_int32 -> C_int32 (Array1.create int32 c_layout n)
+    | T_int64 -> C_int64 (Array1.create int64 c_layout n)
+    | T_float32 -> C_float32 (Array1.create float32 c_layout n)
+    | T_float64 -> C_float64 (Array1.create float64 c_layout n)
+    | T_char -> C_char (Array1.create char c_layout n)
+    | T_symbol -> C_symbol (Array.make n "")
+    | T_month -> C_month (Array1.create int32 c_layout n)
+    | T_date -> C_date (Array1.create int32 c_layout n)
+    | T_datetime -> C_datetime (Array1.create float64 c_layout n)
+    | T_minute -> C_minute (Array1.create int32 c_layout n)
+    | T_second -> C_second (Array1.create int32 c_layout n)
+    | T_time -> C_time (Array1.create int32 c_layout n)
+    | T_timestamp -> C_timestamp (Array1.create int64 c_layout n)
+    | T_timespan -> C_timespan (Array1.create int64 c_layout n)
+    | T_guid -> C_guid (Array1.create int8_unsigned c_layout (16 * n))
+
+  let grow_bigarray a n =
+    let b = Array1.create (Array1.kind a) c_layout n in
+    Array1.blit a (Array1.sub b 0 (Array1.dim a));
+    b
+
+  let grow_array a n =
+    let b = Array.make n "" in
+    Array.blit a 0 b 0 (Array.length a);
+    b
+
+  let grow_column n = function
+    | C_bool a -> C_bool (grow_bigarray a n)
+    | C_byte a -> C_byte (grow_bigarray a n)
+    | C_short a -> C_short (grow_bigarray a n)
+    | C_int32 a -> C_int32 (grow_bigarray a n)
+    | C_int64 a -> C_int64 (grow_bigarray a n)
+    | C_float32 a -> C_float32 (grow_bigarray a n)
+    | C_float64 a -> C_float64 (grow_bigarray a n)
+    | C_char a -> C_char (grow_bigarray a n)
+    | C_symbol a -> C_symbol (grow_array a n)
+    | C_month a -> C_month (grow_bigarray a n)
+    | C_date a -> C_date (grow_bigarray a n)
+    | C_datetime a -> C_datetime (grow_bigarray a n)
+    | C_minute a -> C_minute (grow_bigarray a n)
+    | C_second a -> C_second (grow_bigarray a n)
+    | C_time a -> C_time (grow_bigarray a n)
+    | C_timestamp a -> C_timestamp (grow_bigarray a n)
+    | C_timespan a -> C_timespan (grow_bigarray a n)
+    | C_guid a -> C_guid (grow_bigarray a (16 * n))
+
+  (* The first [n] elements of a column, without copying its bigarray *)
+  let column_to_q n = function
+    | C_bool a -> V_bool (Array1.sub a 0 n, A_none)
+    | C_byte a -> V_byte (Array1.sub a 0 n, A_none)
+    | C_short a -> V_short (Array1.sub a 0 n, A_none)
+    | C_int32 a -> V_int32 (Array1.sub a 0 n, A_none)
+    | C_int64 a -> V_int64 (Array1.sub a 0 n, A_none)
+    | C_float32 a -> V_float32 (Array1.sub a 0 n, A_none)
+    | C_float64 a -> V_float64 (Array1.sub a 0 n, A_none)
+    | C_char a -> V_char (Array1.sub a 0 n, A_none)
+    | C_symbol a -> V_symbol (Array.sub a 0 n, A_none)
+    | C_month a -> V_month (Array1.sub a 0 n, A_none)
+    | C_date a -> V_date (Array1.sub a 0 n, A_none)
+    | C_datetime a -> V_datetime (Array1.sub a 0 n, A_none)
+    | C_minute a -> V_minute (Array1.sub a 0 n, A_none)
+    | C_second a -> V_second (Array1.sub a 0 n, A_none)
+    | C_time a -> V_time (Array1.sub a 0 n, A_none)
+    | C_timestamp a -> V_timestamp (Array1.sub a 0 n, A_none)
+    | C_timespan a -> V_timespan (Array1.sub a 0 n, A_none)
+    | C_guid a -> V_guid (Array1.sub a 0 (16 * n), A_none)
+
+  let set column i v =
+    match column, v with
+    | C_bool a, Bool x -> a.{i} <- Bool.to_int x
+    | C_byte a, Byte x -> a.{i} <- x
+    | C_short a, Short x -> a.{i} <- x
+    | C_int32 a, Int32 x -> a.{i} <- x
+    | C_int64 a, Int64 x -> a.{i} <- x
+    | C_float32 a, Float32 x -> a.{i} <- x
+    | C_float64 a, Float64 x -> a.{i} <- x
+    | C_char a, Char x -> a.{i} <- x
+    | C_symbol a, Symbol x -> a.(i) <- x
+    | C_month a, Month x -> a.{i} <- x
+    | C_date a, Date x -> a.{i} <- x
+    | C_datetime a, Datetime x -> a.{i} <- x
+    | C_minute a, Minute x -> a.{i} <- x
+    | C_second a, Second x -> a.{i} <- x
+    | C_time a, Time x -> a.{i} <- x
+    | C_timestamp a, Timestamp x -> a.{i} <- x
+    | C_timespan a, Timespan x -> a.{i} <- x
+    | C_guid a, Guid x when String.length x = 16 ->
+      String.iteri (fun j c -> a.{16 * i + j} <- Char.code c) x
+    | _ -> invalid_arg "Q.Publisher.add: value does not match the schema"
+
+  let create ?(func = ".u.upd") ?(max_rows = 1000) ?(max_delay = 0.1) conn ~table schema =
+    if max_rows < 1 || Array.length schema = 0 then invalid_arg "Q.Publisher.create";
+    let capacity = min max_rows 1024 in
+    { conn; func; table; max_rows; max_delay; capacity;
+      columns = Array.map (create_column capacity) schema;
+      rows = 0;
+      first_row_time = 0. }
+
+  let pending t = t.rows
+
+  let flush t =
+    if t.rows > 0 then begin
+      let cols = Array.map (column_to_q t.rows) t.columns in
+      (* The message is encoded from the buffers before send returns *)
+      Ipc.send t.conn Ipc.Async (V_mixed [| Symbol t.func; Symbol t.table; V_mixed cols |]);
+      t.rows <- 0
+    end
+
+  let flush_if_due t =
+    if t.rows > 0 && Unix.gettimeofday () -. t.first_row_time >= t.max_delay then flush t
+
+  let add t row =
+    if Array.length row <> Array.length t.columns then
+      invalid_arg "Q.Publisher.add: wrong number of columns";
+    if t.rows = t.capacity then begin
+      t.capacity <- min t.max_rows (2 * t.capacity);
+      Array.iteri (fun j c -> t.columns.(j) <- grow_column t.capacity c) t.columns
+    end;
+    (* A row that does not match the schema is not counted *)
+    Array.iteri (fun j v -> set t.columns.(j) t.rows v) row;
+    let now = Unix.gettimeofday () in
+    if t.rows = 0 then t.first_row_time <- now;
+    t.rows <- t.rows + 1;
+    if t.rows >= t.max_rows || now -. t.first_row_time >= t.max_delay then flush t
+end
+
+
+(* Connection pools *)
+
+module Pool = struct
+
+  type slot = {
+    endpoint : int;               (* index in the pool's endpoints *)
+    mutable conn : q_conn option; (* None while the connection is broken *)
+    mutable busy : bool;
+  }
+
+  type t = {
+    endpoints : (string * int) array;
+    slots : slot array;
+    load : int array;             (* busy slots per endpoint *)
+    lock : Mutex.t;
+    released : Condition.t;       (* a slot became idle or was reconnected *)
+    broken : Condition.t;         (* a slot needs reconnecting *)
+    affinity : int Domain.DLS.key; (* last slot used by the current domain *)
+    retry_delay : float;
+    stats : Stats.t option;       (* shared by the connections *)
+    mutable closed : bool;
+    mutable repairer : Thread.t option;
+  }
+
+  (* The least loaded idle slot, preferring the one the domain used last.
+     Called with the lock held *)
+  let pick t =
+    let preferred = Domain.DLS.get t.affinity in
+    let better i j =
+      let load i = t.load.(t.slots.(i).endpoint) in
+      j < 0 || load i < load j || (load i = load j && i = preferred) in
+    let best = ref (-1) in
+    Array.iteri
+      (fun i s -> if not s.busy && s.conn <> None && better i !best then best := i)
+      t.slots;
+    !best
+
+  let unreachable t =
+    let (host, port) = t.endpoints.(0) in
+    Q_connect (host ^ ":" ^ (string_of_int port) ^ " no endpoint of the pool is reachable")
+
+  (* Waits while all connections are busy, but fails when none is open:
+     broken connections may take any time to be repaired *)
+  let checkout t =
+    Mutex.lock t.lock;
+    let rec wait () =
+      if t.closed then begin
+        Mutex.unlock t.lock;
+        invalid_arg "Q.Pool: the pool is closed"
+      end else if Array.for_all (fun slot -> slot.conn = None) t.slots then begin
+        Mutex.unlock t.lock;
+        raise (unreachable t)
+      end else
+        match pick t with
+        | -1 -> Condition.wait t.released t.lock; wait ()
+        | i -> i in
+    let i = wait () in
+    let slot = t.slots.(i) in
+    slot.busy <- true;
+    t.load.(slot.endpoint) <- t.load.(slot.endpoint) + 1;
+    Mutex.unlock t.lock;
+    Domain.DLS.set t.affinity i;
+    (i, Option.get slot.conn)
+
+  let release t i ~failed =
+    Mutex.lock t.lock;
+    let slot = t.slots.(i) in
+    slot.busy <- false;
+    t.load.(slot.endpoint) <- t.load.(slot.endpoint) - 1;
+    if failed || t.closed then begin
+      Option.iter close_connection slot.conn;
+      slot.conn <- None;
+      Condition.signal t.broken
+    end;
+    Condition.signal t.released;
+    Mutex.unlock t.lock
+
+  let with_conn t f =
+    let (i, conn) = checkout t in
+    match f conn with
+    | result -> release t i ~failed:false; result
+    | exception (Failure msg as e) when msg = network_error ->
+      release t i ~failed:true; raise e
+    | exception e -> release t i ~failed:false; raise e
+
+  let connect t i =
+    let (host, port) = t.endpoints.(t.slots.(i).endpoint) in
+    match open_connection ?stats:t.stats host port with
+    | conn -> Some conn
+    | exception (Q_connect _) -> None
+
+  (* Body of the thread that reopens broken connections. Endpoints that
+     cannot be reached are retried every [retry_delay] seconds *)
+  let rec repair t =
+    let needs_repair slot = slot.conn = None && not slot.busy in
+    Mutex.lock t.lock;
+    while not t.closed && not (Array.exists needs_repair t.slots) do
+      Condition.wait t.broken t.lock
+    done;
+    let closed = t.closed in
+    let todo = List.filter (fun i -> needs_repair t.slots.(i))
+                 (List.init (Array.length t.slots) Fun.id) in
+    Mutex.unlock t.lock;
+    if not closed then begin
+      let reconnect failed i =
+        match connect t i with
+        | None -> true
+        | Some conn ->
+          Mutex.lock t.lock;
+          if t.closed then close_connection conn
+          else begin
+            t.slots.(i).conn <- Some conn;
+            Condition.broadcast t.released
+          end;
+          Mutex.unlock t.lock;
+          failed in
+      if List.fold_left reconnect false todo then Unix.sleepf t.retry_delay;
+      repair t
+    end
+
+  let create ?(size = 1) ?(retry_delay = 1.0) ?stats endpoints =
+    if size < 1 then invalid_arg "Q.Pool.create: size must be positive";
+    if endpoints = [] then invalid_arg "Q.Pool.create: no endpoints";
+    let endpoints = Array.of_list endpoints in
+    let n = Array.length endpoints in
+    let t = {
+      endpoints;
+      slots = Array.init (size * n)
+                (fun i -> { endpoint = i mod n; conn = None; busy = false });
+      load = Array.make n 0;
+      lock = Mutex.create ();
+      released = Condition.create ();
+      broken = Condition.create ();
+      affinity = Domain.DLS.new_key (fun () -> -1);
+      retry_delay;
+      stats;
+      closed = false;
+      repairer = None;
+    } in
+    Array.iteri (fun i slot -> slot.conn <- connect t i) t.slots;
+    if Array.for_all (fun slot -> slot.conn = None) t.slots then raise (unreachable t);
+    t.repairer <- Some (Thread.create repair t);
+    t
+
+  let close t =
+    Mutex.lock t.lock;
+    let was_closed = t.closed in
+    t.closed <- true;
+    Condition.broadcast t.broken;
+    Condition.broadcast t.released;
+    Mutex.unlock t.lock;
+    if not was_closed then begin
+      Option.iter Thread.join t.repairer;
+      (* Busy connections are closed when they are released *)
+      Mutex.lock t.lock;
+      Array.iter
+        (fun slot -> if not slot.busy then begin
+             Option.iter close_connection slot.conn;
+             slot.conn <- None
+           end)
+        t.slots;
+      Mutex.unlock t.lock
+    end
+
+  let eval_async t str = with_conn t (fun conn -> eval_async conn str)
+
+  let eval t str = with_conn t (fun conn -> eval conn str)
+
+  let rpc_async t str v = with_conn t (fun conn -> rpc_async conn str v)
+
+  let rpc t str v = with_conn t (fun conn -> rpc conn str v)
+
+end
+
+
+(* Result caches *)
+
+module Cache = struct
+
+  type entry = {
+    key : string * string * string; (* server, query, fingerprint *)
+    value : q_val;
+    size : int;
+    expires : float;
+    tags : string list;
+    mutable newer : entry option; (* neighbours in the LRU list *)
+    mutable older : entry option;
+  }
+
+  type t = {
+    lock : Mutex.t;
+    table : (string * string * string, entry) Hashtbl.t; (* server, query, argument *)
+    ttl : float;
+    max_bytes : int;
+    mutable bytes : int;
+    mutable newest : entry option;
+    mutable oldest : entry option;
+    mutable generation : int;     (* incremented by invalidations *)
+    mutable hits : int;
+    mutable misses : int;
+  }
+
+  let create ?(ttl = 60.) ?(max_bytes = 64 * 1024 * 1024) () =
+    if not (ttl >= 0.) || max_bytes < 0 then invalid_arg "Q.Cache.create";
+    { lock = Mutex.create (); table = Hashtbl.create 64; ttl; max_bytes;
+      bytes = 0; newest = None; oldest = None; generation = 0; hits = 0; misses = 0 }
+
+  (* Approximate memory held by a value: the data of bigarrays and strings,
+     and a few words per block *)
+  let rec size_of v =
+    let ba a = 64 + Array1.size_in_bytes a in
+    let strings a = Array.fold_left (fun n s -> n + 16 + String.length s) (16 + 8 * Array.length a) a in
+    match v with
+    | Bool _ | Byte _ | Short _ | Int32 _ | Int64 _ | Float32 _ | Float64 _ | Char _
+    | Month _ | Date _ | Datetime _ | Minute _ | Second _ | Time _ | Timestamp _
+    | Timespan _ | Unit -> 24
+    | Symbol s | Guid s -> 40 + String.length s
+    | V_bool (a, _) | V_byte (a, _) | V_guid (a, _) -> ba a
+    | V_short (a, _) -> ba a
+    | V_int32 (a, _) | V_month (a, _) | V_date (a, _) | V_minute (a, _) | V_second (a, _)
+    | V_time (a, _) | V_symbol_enum (a, _, _) -> ba a
+    | V_int64 (a, _) | V_timestamp (a, _) | V_timespan (a, _) -> ba a
+    | V_float32 (a, _) -> ba a
+    | V_float64 (a, _) | V_datetime (a, _) -> ba a
+    | V_char (a, _) -> ba a
+    | V_symbol (a, _) -> strings a
+    | V_strings (chars, offsets) -> ba chars + ba offsets
+    | V_valid (v, { bitmap; _ }) -> size_of v + 32 + ba bitmap
+    | V_mixed a -> Array.fold_left (fun n v -> n + size_of v) (16 + 8 * Array.length a) a
+    | Table { colnames; cols; _ } -> 32 + size_of colnames + size_of cols
+    | Dict { keys; vals; _ } -> 32 + size_of keys + size_of vals
+
+  (* The LRU list, newest first. Called with the lock held *)
+
+  let unlink t e =
+    (match e.newer with Some n -> n.older <- e.older | None -> t.newest <- e.older);
+    (match e.older with Some o -> o.newer <- e.newer | None -> t.oldest <- e.newer);
+    e.newer <- None;
+    e.older <- None
+
+  let push t e =
+    e.older <- t.newest;
+    (match t.newest with Some n -> n.newer <- Some e | None -> t.oldest <- Some e);
+    t.newest <- Some e
+
+  let remove t e =
+    unlink t e;
+    Hashtbl.remove t.table e.key;
+    t.bytes <- t.bytes - e.size
+
+  let rec evict t =
+    match t.oldest with
+    | Some e when t.bytes > t.max_bytes -> remove t e; evict t
+    | _ -> ()
+
+  let find t key now =
+    match Hashtbl.find_opt t.table key with
+    | Some e when e.expires > now ->
+      unlink t e;
+      push t e;
+      t.hits <- t.hits + 1;
+      Some e.value
+    | Some e -> remove t e; t.misses <- t.misses + 1; None
+    | None -> t.misses <- t.misses + 1; None
+
+  let add t e generation =
+    Mutex.lock t.lock;
+    (* Drop results that may predate an invalidation made during the call *)
+    if generation = t.generation then begin
+      Option.iter (remove t) (Hashtbl.find_opt t.table e.key);
+      Hashtbl.replace t.table e.key e;
+      push t e;
+      t.bytes <- t.bytes + e.size;
+      evict t
+    end;
+    Mutex.unlock t.lock
+
+  let fingerprint = function
+    | None -> ""
+    | Some v -> Digest.bytes (Ipc.serialize Ipc.Sync v)
+
+  let cached t ?ttl ?(tags = []) ~server query arg f =
+    let key = (server, query, fingerprint arg) in
+    let now = Unix.gettimeofday () in
+    Mutex.lock t.lock;
+    let found = find t key now in
+    let generation = t.generation in
+    Mutex.unlock t.lock;
+    match found with
+    | Some v -> v
+    | None ->
+      let value = f () in
+      let ttl = Option.value ttl ~default:t.ttl in
+      let size = size_of value in
+      if ttl > 0. && size <= t.max_bytes then
+        add t { key; value; size; expires = now +. ttl; tags; newer = None; older = None }
+          generation;
+      value
+
+  let eval t ?ttl ?tags conn str =
+    cached t ?ttl ?tags ~server:conn.endpoint str None (fun () -> eval conn str)
+
+  let rpc t ?ttl ?tags conn str v =
+    cached t ?ttl ?tags ~server:conn.endpoint str (Some v) (fun () -> rpc conn str v)
+
+  let invalidate_if t pred =
+    Mutex.lock t.lock;
+    t.generation <- t.generation + 1;
+    let stale = Hashtbl.fold (fun _ e l -> if pred e then e :: l else l) t.table [] in
+    List.iter (remove t) stale;
+    Mutex.unlock t.lock
+
+  let invalidate t query = invalidate_if t (fun { key = (_, q, _); _ } -> q = query)
+
+  let invalidate_tag t tag = invalidate_if t (fun e -> List.mem tag e.tags)
+
+  let clear t = invalidate_if t (fun _ -> true)
+
+  let watch ?(syms = []) t conn ~table =
+    Subscriber.subscribe conn ~table ~syms
+      (Array.iter (fun (u : Subscriber.update) -> invalidate_tag t u.table))
+
+  let locked t f =
+    Mutex.lock t.lock;
+    let x = f t in
+    Mutex.unlock t.lock;
+    x
+
+  let length t = locked t (fun t -> Hashtbl.length t.table)
+
+  let bytes t = locked t (fun t -> t.bytes)
+
+  let hits t = locked t (fun t -> t.hits)
+
+  let misses t = locked t (fun t -> t.misses)
+
+end
+
+
+(* Tables on disk *)
+
+module Hdb = struct
+
+  type sym = {
+    path : string;
+    lock : Mutex.t;
+    mutable strings : string array; (* capacity >= count *)
+    mutable count : int;
+    mutable size : int;             (* bytes of the symbols in the file *)
+    mutable index : (string, int) Hashtbl.t option; (* built for writing *)
+    mutable dict : sym_dict option; (* the symbols interned in order *)
+  }
+
+  let locked sym f =
+    Mutex.lock sym.lock;
+    Fun.protect ~finally:(fun () -> Mutex.unlock sym.lock) f
+
+  let fail path msg = failwith ("Q.Hdb: " ^ path ^ ": " ^ msg)
+
+  (* Column files start with a header: 0xfe 0x20, the type, the attribute,
+     4 unused bytes and the length. The elements follow. Enumerated columns
+     start with a page instead: 0xfd 0x20, the type, the attribute, 4 unused
+     bytes, the name of the enumeration (such as sym) and, in the last 8
+     bytes, the length. Their elements are int64 indices. Lists of symbols,
+     such as sym and .d, cannot be mapped: they are serialized objects,
+     0xff 0x01 followed by the type, the attribute, the int32 length and the
+     NUL terminated symbols *)
+  let header_size = 16
+
+  let enum_header_size = 4096
+
+  let serialized_header_size = 8
+
+  let with_file path f =
+    let fd =
+      try Unix.openfile path [Unix.O_RDONLY] 0
+      with Unix.Unix_error (e, _, _) -> fail path (Unix.error_message e) in
+    Fun.protect ~finally:(fun () -> Unix.close fd) (fun () -> f fd)
+
+  (* The type, attribute and length of a column file, the position of its
+     data and the size of its data *)
+  let read_header path fd =
+    let h = Bytes.create header_size in
+    (* [len] bytes at [pos] of the file into [h] *)
+    let read_at pos len =
+      ignore (Unix.lseek fd pos Unix.SEEK_SET);
+      let rec read off =
+        if off < len then
+          match Unix.read fd h off (len - off) with
+          | 0 -> fail path "truncated file"
+          | n -> read (off + n) in
+      read 0 in
+    let file_size = (Unix.fstat fd).Unix.st_size in
+    read_at 0 serialized_header_size;
+    if Bytes.sub_string h 0 8 = "kxzipped" then fail path "compressed files are not supported";
+    let (ty, attr) = (Bytes.get_int8 h 2, Bytes.get_uint8 h 3) in
+    let (n, pos) = match Bytes.get_uint8 h 0, Bytes.get_uint8 h 1 with
+      | 0xff, 0x01 ->
+        if ty <> 11 then fail path "serialized objects other than symbol lists are not supported";
+        (Int32.to_int (Bytes.get_int32_le h 4), serialized_header_size)
+      | 0xfe, 0x20 ->
+        if ty = 11 then fail path "symbol lists must be serialized objects";
+        read_at 0 header_size;
+        (Int64.to_int (Bytes.get_int64_le h 8), header_size)
+      | 0xfd, 0x20 ->
+        read_at (enum_header_size - 8) 8;
+        (Int64.to_int (Bytes.get_int64_le h 0), enum_header_size)
+      | _ -> fail path "not a kdb+ column file" in
+    if n < 0 then fail path "invalid length";
+    (ty, attr, n, pos, file_size - pos)
+
+  let map fd ~pos kind n =
+    array1_of_genarray (Unix.map_file fd ~pos:(Int64.of_int pos) kind c_layout false [| n |])
+
+  let attrib path = function
+    | 0 -> A_none
+    | 1 -> A_s
+    | 2 -> A_u
+    | 3 -> A_p
+    | 4 -> A_g
+    | _ -> fail path "invalid attribute"
+
+  (* [n] NUL terminated symbols from [a.{pos}], and the position after them *)
+  let parse_symbols path (a : char_bigarray) pos n =
+    let pos = ref pos in
+    let strings = Array.init n (fun _ ->
+        let start = !pos in
+        while !pos < Array1.dim a && a.{!pos} <> '\000' do incr pos done;
+        if !pos = Array1.dim a then fail path "truncated file";
+        incr pos;
+        String.init (!pos - 1 - start) (fun i -> a.{start + i})) in
+    (strings, !pos)
+
+  let symbols path a n = fst (parse_symbols path a 0 n)
+
+  let load_sym path =
+    let (strings, size) = with_file path (fun fd ->
+        match read_header path fd with
+        | (11, _, n, pos, size) -> parse_symbols path (map fd ~pos char size) 0 n
+        | _ -> fail path "not a list of symbols") in
+    { path; lock = Mutex.create (); strings; count = Array.length strings; size;
+      index = None; dict = None }
+
+  let sym_strings sym = locked sym (fun () -> (sym.strings, sym.count))
+
+  let sym_dict sym =
+    locked sym (fun () ->
+        let d = match sym.dict with
+          | Some d -> d
+          | None -> let d = Sym_dict.create () in sym.dict <- Some d; d in
+        for i = Sym_dict.length d to sym.count - 1 do
+          if Sym_dict.intern d sym.strings.(i) <> Int32.of_int i then
+            failwith "Q.Hdb: the sym file has duplicate symbols"
+        done;
+        d)
+
+  (* An enumerated column: int64 indices into [sym] *)
+  let enumeration path sym ~symbol_enum fd n pos size a =
+    let sym = match sym with
+      | Some sym -> sym
+      | None -> fail path "no sym file for an enumerated column" in
+    if n > size / 8 then fail path "truncated file";
+    let idx : int64_bigarray = map ~pos fd int64 n in
+    let (strings, count) = sym_strings sym in
+    let count = Int64.of_int count in
+    for i = 0 to n - 1 do
+      if idx.{i} < 0L || idx.{i} >= count then fail path "symbol index out of the sym file"
+    done;
+    if symbol_enum then
+      V_symbol_enum (Array1.init int32 c_layout n (fun i -> Int64.to_int32 idx.{i}), sym_dict sym, a)
+    else V_symbol (Array.init n (fun i -> strings.(Int64.to_int idx.{i})), a)
+
+  (* A column and its length *)
+  let read_column path ~sym ~symbol_enum =
+    with_file path (fun fd ->
+        let (ty, attr, n, pos, size) = read_header path fd in
+        let a = attrib path attr in
+        let vector elem kind =
+          if n > size / elem then fail path "truncated file";
+          map fd ~pos kind n in
+        let v = match ty with
+          | 1 -> V_bool (vector 1 int8_unsigned, a)
+          | 2 ->
+            if n > size / 16 then fail path "truncated file";
+            V_guid (map fd ~pos int8_unsigned (16 * n), a)
+          | 4 -> V_byte (vector 1 int8_unsigned, a)
+          | 5 -> V_short (vector 2 int16_unsigned, a)
+          | 6 -> V_int32 (vector 4 int32, a)
+          | 7 -> V_int64 (vector 8 int64, a)
+          | 8 -> V_float32 (vector 4 float32, a)
+          | 9 -> V_float64 (vector 8 float64, a)
+          | 10 -> V_char (vector 1 char, a)
+          | 11 -> V_symbol (symbols path (map fd ~pos char size) n, a)
+          | 12 -> V_timestamp (vector 8 int64, a)
+          | 13 -> V_month (vector 4 int32, a)
+          | 14 -> V_date (vector 4 int32, a)
+          | 15 -> V_datetime (vector 8 float64, a)
+          | 16 -> V_timespan (vector 8 int64, a)
+          | 17 -> V_minute (vector 4 int32, a)
+          | 18 -> V_second (vector 4 int32, a)
+          | 19 -> V_time (vector 4 int32, a)
+          | ty when ty >= 20 && ty <= 76 -> enumeration path sym ~symbol_enum fd n pos size a
+          | ty when ty >= 77 -> fail path "nested columns are not supported"
+          | ty -> fail path ("unsupported type " ^ string_of_int ty) in
+        (v, n))
+
+  (* The column names, columns and length of a splayed table *)
+  let splayed dir ~sym ~symbol_enum =
+    let names = match read_column (Filename.concat dir ".d") ~sym:None ~symbol_enum:false with
+      | (V_symbol (names, _), _) -> names
+      | _ -> fail dir ".d is not a list of symbols" in
+    let cols = Array.map (fun name ->
+        read_column (Filename.concat dir name) ~sym ~symbol_enum) names in
+    let n = if Array.length cols = 0 then 0 else snd cols.(0) in
+    if Array.exists (fun (_, m) -> m <> n) cols then fail dir "columns of different lengths";
+    (names, Array.map fst cols, n)
+
+  let mk_table names cols =
+    Table { colnames = V_symbol (names, A_none); cols = V_mixed cols; attrib_t = A_none }
+
+  let default_sym root = function
+    | Some sym -> Some sym
+    | None ->
+      let path = Filename.concat root "sym" in
+      if Sys.file_exists path then Some (load_sym path) else None
+
+  let read_splayed ?sym ?(symbol_enum = false) dir =
+    let sym = default_sym (Filename.dirname dir) sym in
+    let (names, cols, _) = splayed dir ~sym ~symbol_enum in
+    mk_table names cols
+
+  (* Partitions *)
+
+  (* Days from 1970.01.01 of a date of the proleptic Gregorian calendar *)
+  let days_from_civil y m d =
+    let y = if m <= 2 then y - 1 else y in
+    let era = (if y >= 0 then y else y - 399) / 400 in
+    let yoe = y - era * 400 in
+    let doy = (153 * (if m > 2 then m - 3 else m + 9) + 2) / 5 + d - 1 in
+    era * 146097 + yoe * 365 + yoe / 4 - yoe / 100 + doy - 719468
+
+  (* The partition column of a directory name, and its value *)
+  let parse_partition name =
+    let all_digits s = s <> "" && String.for_all (fun c -> c >= '0' && c <= '9') s in
+    match String.split_on_char '.' name with
+    | [y; m; d] when String.length y = 4 && String.length m = 2 && String.length d = 2
+                     && all_digits y && all_digits m && all_digits d ->
+      let (y, m, d) = (int_of_string y, int_of_string m, int_of_string d) in
+      if m < 1 || m > 12 || d < 1 || d > 31 then None
+      else Some ("date", days_from_civil y m d - days_from_civil 2000 1 1)
+    | [y; m] when String.length y = 4 && String.length m = 2 && all_digits y && all_digits m ->
+      let (y, m) = (int_of_string y, int_of_string m) in
+      if m < 1 || m > 12 then None else Some ("month", (y - 2000) * 12 + m - 1)
+    | [i] when all_digits i && String.length i <= 9 -> Some ("int", int_of_string i)
+    | _ -> None
+
+  let partitions root =
+    Sys.readdir root
+    |> Array.to_list
+    |> List.filter_map (fun name ->
+        match parse_partition name with
+        | Some p when Sys.is_directory (Filename.concat root name) -> Some (p, name)
+        | _ -> None)
+    |> List.sort compare
+    |> List.map snd
+
+  let partition_column name n =
+    match parse_partition name with
+    | None -> invalid_arg ("Q.Hdb: not a partition: " ^ name)
+    | Some (col, x) ->
+      let a = Array1.create int32 c_layout n in
+      Array1.fill a (Int32.of_int x);
+      (col, match col with
+        | "date" -> V_date (a, A_none)
+        | "month" -> V_month (a, A_none)
+        | _ -> V_int32 (a, A_none))
+
+  let partition root name ~table ~sym ~symbol_enum =
+    let (names, cols, n) = splayed (Filename.concat (Filename.concat root name) table) ~sym ~symbol_enum in
+    let (col, v) = partition_column name n in
+    (Array.append [| col |] names, Array.append [| v |] cols)
+
+  let read_partition ?sym ?(symbol_enum = false) root ~partition:name ~table =
+    let sym = default_sym root sym in
+    let (names, cols) = partition root name ~table ~sym ~symbol_enum in
+    mk_table names cols
+
+  (* Concatenation of the columns of partitions, without their attributes *)
+  let concat_column = function
+    | [] -> invalid_arg "Q.Hdb.concat_column"
+    | first :: _ as cols ->
+      let mismatch () = failwith "Q.Hdb: partitions have columns of different types" in
+      let cat get =
+        let parts = List.map get cols in
+        let out = Array1.create (Array1.kind (List.hd parts)) c_layout
+            (List.fold_left (fun n a -> n + Array1.dim a) 0 parts) in
+        ignore (List.fold_left (fun off a ->
+            Array1.blit a (Array1.sub out off (Array1.dim a));
+            off + Array1.dim a) 0 parts);
+        out in
+      match first with
+      | V_bool _ -> V_bool (cat (function V_bool (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_byte _ -> V_byte (cat (function V_byte (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_short _ -> V_short (cat (function V_short (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_int32 _ -> V_int32 (cat (function V_int32 (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_int64 _ -> V_int64 (cat (function V_int64 (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_float32 _ -> V_float32 (cat (function V_float32 (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_float64 _ -> V_float64 (cat (function V_float64 (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_char _ -> V_char (cat (function V_char (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_month _ -> V_month (cat (function V_month (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_date _ -> V_date (cat (function V_date (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_datetime _ -> V_datetime (cat (function V_datetime (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_minute _ -> V_minute (cat (function V_minute (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_second _ -> V_second (cat (function V_second (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_time _ -> V_time (cat (function V_time (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_timestamp _ -> V_timestamp (cat (function V_timestamp (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_timespan _ -> V_timespan (cat (function V_timespan (a, _) -> a | _ -> mismatch ()), A_none)
+      | V_symbol_enum (_, dict, _) ->
+        V_symbol_enum (cat (function V_symbol_enum (a, _, _) -> a | _ -> mismatch ()), dict, A_none)
+      | V_symbol _ ->
+        V_symbol (Array.concat (List.map (function V_symbol (a, _) -> a | _ -> mismatch ()) cols), A_none)
+      | V_guid _ -> V_guid (cat (function V_guid (a, _) -> a | _ -> mismatch ()), A_none)
+      | _ -> mismatch ()
+
+  let read_partitioned ?sym ?(symbol_enum = false) ?partitions:names root ~table =
+    let sym = default_sym root sym in
+    let names = match names with Some names -> names | None -> partitions root in
+    (* Partitions without the table are skipped *)
+    let names = List.filter (fun name ->
+        Sys.file_exists (Filename.concat (Filename.concat root name) table)) names in
+    match List.map (fun name -> partition root name ~table ~sym ~symbol_enum) names with
+    | [] -> failwith ("Q.Hdb: " ^ root ^ ": no partition of " ^ table)
+    | (colnames, _) :: _ as parts ->
+      if List.exists (fun (c, _) -> c <> colnames) parts then
+        failwith ("Q.Hdb: " ^ root ^ ": partitions of " ^ table ^ " have different columns");
+      let cols = Array.mapi (fun i _ ->
+          concat_column (List.map (fun (_, cols) -> cols.(i)) parts)) colnames in
+      mk_table colnames cols
+
+  (* Writing *)
+
+  let header ty attr n =
+    let h = Bytes.make header_size '\000' in
+    Bytes.set_uint8 h 0 0xfe;
+    Bytes.set_uint8 h 1 0x20;
+    Bytes.set_int8 h 2 ty;
+    Bytes.set_uint8 h 3 attr;
+    Bytes.set_int64_le h 8 (Int64.of_int n);
+    h
+
+  let rec write_all fd buf off len =
+    if len > 0 then begin
+      let n = Unix.write fd buf off len in
+      write_all fd buf (off + n) (len - n)
+    end
+
+  let with_out path f =
+    let fd =
+      try Unix.openfile path [Unix.O_RDWR; Unix.O_CREAT; Unix.O_TRUNC] 0o644
+      with Unix.Unix_error (e, _, _) -> fail path (Unix.error_message e) in
+    Fun.protect ~finally:(fun () -> Unix.close fd) (fun () -> f fd)
+
+  let rec mkdir_p dir =
+    if not (Sys.file_exists dir) then begin
+      mkdir_p (Filename.dirname dir);
+      try Unix.mkdir dir 0o755 with Unix.Unix_error (Unix.EEXIST, _, _) -> ()
+    end
+
+  let attrib_code = function
+    | A_none -> 0
+    | A_s -> 1
+    | A_u -> 2
+    | A_p -> 3
+    | A_g -> 4
+
+  (* The header [h] and the elements of [a]. The elements are copied into a
+     shared mapping of the file *)
+  let write_data path h (a : (_, _, c_layout) Array1.t) =
+    with_out path (fun fd ->
+        let n = Array1.dim a in
+        write_all fd h 0 (Bytes.length h);
+        if n > 0 then
+          Array1.blit a (array1_of_genarray
+                           (Unix.map_file fd ~pos:(Int64.of_int (Bytes.length h)) (Array1.kind a) c_layout true [| n |])))
+
+  (* [width] elements of [a] per element of the column *)
+  let write_vector ?(width = 1) path ty attr a =
+    write_data path (header ty (attrib_code attr) (Array1.dim a / width)) a
+
+  (* The indices of an enumerated column against the enumeration [domain] *)
+  let write_enumeration path ~domain attr (idx : int64_bigarray) =
+    if String.length domain >= enum_header_size - 16 || String.contains domain '\000' then
+      fail path ("invalid enumeration name " ^ domain);
+    let h = Bytes.make enum_header_size '\000' in
+    Bytes.set_uint8 h 0 0xfd;
+    Bytes.set_uint8 h 1 0x20;
+    Bytes.set_int8 h 2 20;
+    Bytes.set_uint8 h 3 (attrib_code attr);
+    Bytes.blit_string domain 0 h 8 (String.length domain);
+    Bytes.set_int64_le h (enum_header_size - 8) (Int64.of_int (Array1.dim idx));
+    write_data path h idx
+
+  let add_symbol buf s =
+    if String.contains s '\000' then invalid_arg "Q.Hdb: symbol with a NUL character";
+    Buffer.add_string buf s;
+    Buffer.add_char buf '\000'
+
+  (* The int32 count of a serialized list of symbols *)
+  let symbols_count path n =
+    if n > Int32.to_int Int32.max_int then fail path "too many symbols";
+    let count = Bytes.create 4 in
+    Bytes.set_int32_le count 0 (Int32.of_int n);
+    count
+
+  let symbols_header path n =
+    let h = Bytes.make serialized_header_size '\000' in
+    Bytes.set_uint8 h 0 0xff;
+    Bytes.set_uint8 h 1 0x01;
+    Bytes.set_int8 h 2 11;
+    Bytes.blit (symbols_count path n) 0 h 4 4;
+    h
+
+  let write_symbols path strings =
+    let buf = Buffer.create 4096 in
+    Buffer.add_bytes buf (symbols_header path (Array.length strings));
+    Array.iter (add_symbol buf) strings;
+    with_out path (fun fd -> write_all fd (Buffer.to_bytes buf) 0 (Buffer.length buf))
+
+  (* The enumerations opened for writing, by real path. Writers of one
+     process share the [sym] of a file, whose mutex excludes each other:
+     the lock of the file only excludes other processes, and is dropped
+     when any descriptor of the file in the process is closed *)
+  let opened : (string, sym) Hashtbl.t = Hashtbl.create 8
+
+  let opened_lock = Mutex.create ()
+
+  (* An enumeration to which symbols can be added. It is created on first use *)
+  let open_sym path =
+    let dir = Filename.dirname path in
+    mkdir_p dir;
+    let key =
+      try Filename.concat (Unix.realpath dir) (Filename.basename path)
+      with Unix.Unix_error (e, _, _) -> fail path (Unix.error_message e) in
+    Mutex.lock opened_lock;
+    Fun.protect ~finally:(fun () -> Mutex.unlock opened_lock) (fun () ->
+        match Hashtbl.find_opt opened key with
+        | Some sym -> sym
+        | None ->
+          let sym =
+            if Sys.file_exists path then load_sym path
+            else { path; lock = Mutex.create (); strings = [||]; count = 0; size = 0;
+                   index = None; dict = None } in
+          Hashtbl.replace opened key sym;
+          sym)
+
+  let add_string sym s =
+    if sym.count = Array.length sym.strings then begin
+      let strings = Array.make (max 1024 (2 * sym.count)) "" in
+      Array.blit sym.strings 0 strings 0 sym.count;
+      sym.strings <- strings
+    end;
+    sym.strings.(sym.count) <- s;
+    Option.iter (fun index -> Hashtbl.replace index s sym.count) sym.index;
+    sym.count <- sym.count + 1
+
+  (* Loads the symbols that other processes appended to the file. Called with
+     the file locked *)
+  let sync sym fd =
+    let (ty, _, n, pos, size) = read_header sym.path fd in
+    if ty <> 11 then fail sym.path "not a list of symbols";
+    if n > sym.count then begin
+      let (strings, pos) = parse_symbols sym.path (map fd ~pos char size) sym.size (n - sym.count) in
+      Array.iter (add_string sym) strings;
+      sym.size <- pos
+    end
+
+  (* The indices of [strings] in [sym], to which new symbols are added and
+     appended to its file. The file is locked while it is updated, so that
+     processes writing partitions of one database can share it *)
+  let enumerate sym strings =
+    (* Checked first, not to add some of the symbols only *)
+    Array.iter (fun s ->
+        if String.contains s '\000' then invalid_arg "Q.Hdb: symbol with a NUL character")
+      strings;
+    locked sym (fun () ->
+        let fd =
+          try Unix.openfile sym.path [Unix.O_RDWR; Unix.O_CREAT] 0o644
+          with Unix.Unix_error (e, _, _) -> fail sym.path (Unix.error_message e) in
+        Fun.protect ~finally:(fun () -> Unix.close fd) (fun () ->
+            Unix.lockf fd Unix.F_LOCK 0;
+            if (Unix.fstat fd).Unix.st_size = 0 then
+              write_all fd (symbols_header sym.path 0) 0 serialized_header_size
+            else sync sym fd;
+            let index = match sym.index with
+              | Some index -> index
+              | None ->
+                let index = Hashtbl.create (max 1024 sym.count) in
+                for i = 0 to sym.count - 1 do Hashtbl.replace index sym.strings.(i) i done;
+                sym.index <- Some index;
+                index in
+            let fresh = Buffer.create 4096 in
+            let idx = Array1.create int64 c_layout (Array.length strings) in
+            Array.iteri (fun i s ->
+                let j = match Hashtbl.find_opt index s with
+                  | Some j -> j
+                  | None -> add_symbol fresh s; add_string sym s; sym.count - 1 in
+                idx.{i} <- Int64.of_int j)
+              strings;
+            if Buffer.length fresh > 0 then begin
+              let count = symbols_count sym.path sym.count in
+              ignore (Unix.lseek fd (serialized_header_size + sym.size) Unix.SEEK_SET);
+              write_all fd (Buffer.to_bytes fresh) 0 (Buffer.length fresh);
+              sym.size <- sym.size + Buffer.length fresh;
+              ignore (Unix.lseek fd 4 Unix.SEEK_SET);
+              write_all fd count 0 4
+            end;
+            idx))
+
+  (* Enumerated columns are written as kdb+ 3.x does, enumerated against the
+     name of the sym file *)
+  let rec write_column path ~sym v =
+    let enumerated strings attr =
+      match sym with
+      | Some sym ->
+        write_enumeration path ~domain:(Filename.basename sym.path) attr (enumerate sym strings)
+      | None -> fail path "no sym file to enumerate a symbol column" in
+    match v with
+    | V_bool (a, attr) -> write_vector path 1 attr a
+    | V_byte (a, attr) -> write_vector path 4 attr a
+    | V_short (a, attr) -> write_vector path 5 attr a
+    | V_int32 (a, attr) -> write_vector path 6 attr a
+    | V_int64 (a, attr) -> write_vector path 7 attr a
+    | V_float32 (a, attr) -> write_vector path 8 attr a
+    | V_float64 (a, attr) -> write_vector path 9 attr a
+    | V_char (a, attr) -> write_vector path 10 attr a
+    | V_timestamp (a, attr) -> write_vector path 12 attr a
+    | V_month (a, attr) -> write_vector path 13 attr a
+    | V_date (a, attr) -> write_vector path 14 attr a
+    | V_datetime (a, attr) -> write_vector path 15 attr a
+    | V_timespan (a, attr) -> write_vector path 16 attr a
+    | V_minute (a, attr) -> write_vector path 17 attr a
+    | V_second (a, attr) -> write_vector path 18 attr a
+    | V_time (a, attr) -> write_vector path 19 attr a
+    | V_symbol (strings, attr) -> enumerated strings attr
+    | V_symbol_enum (a, dict, attr) ->
+      enumerated (Array.init (Array1.dim a) (fun i -> Sym_dict.get dict a.{i})) attr
+    | V_valid (v, _) -> write_column path ~sym v
+    | V_guid (a, attr) ->
+      if Array1.dim a mod 16 <> 0 then invalid_arg "Q.Hdb: GUID vectors must hold 16 bytes per GUID";
+      write_vector ~width:16 path 2 attr a
+    | _ -> fail path "unsupported column type"
+
+  let splay dir ~sym v =
+    match v with
+    | Table { colnames = V_symbol (names, _); cols = V_mixed cols; _ }
+      when Array.length names = Array.length cols ->
+      mkdir_p dir;
+      Array.iteri (fun i name ->
+          if name = "" || String.contains name '/' || name.[0] = '.' then
+            invalid_arg ("Q.Hdb: invalid column name " ^ name);
+          write_column (Filename.concat dir name) ~sym cols.(i))
+        names;
+      (* Last, so that the table is complete once it is listed *)
+      write_symbols (Filename.concat dir ".d") names
+    | _ -> invalid_arg "Q.Hdb: not a table"
+
+  let write_splayed ?sym dir v =
+    let sym = match sym with
+      | Some sym -> sym
+      | None -> open_sym (Filename.concat (Filename.dirname dir) "sym") in
+    splay dir ~sym:(Some sym) v
+
+  let write_partition ?sym root ~partition:name ~table v =
+    if parse_partition name = None then invalid_arg ("Q.Hdb: not a partition: " ^ name);
+    let sym = match sym with
+      | Some sym -> sym
+      | None -> open_sym (Filename.concat root "sym") in
+    splay (Filename.concat (Filename.concat root name) table) ~sym:(Some sym) v
+
+end
+
+
+(* Parallel decoding *)
+
+module Parallel = struct
+
+  (* Tasks run by the pool's domains and the domain that submitted them *)
+  type batch = {
+    tasks : (unit -> unit) array;
+    next : int Atomic.t;     (* the next task to start *)
+    finished : int Atomic.t;
+    mutable error : (exn * Printexc.raw_backtrace) option;
+  }
+
+  type t = {
+    lock : Mutex.t;
+    changed : Condition.t;   (* a batch was submitted or finished *)
+    batches : batch Queue.t;
+    mutable closed : bool;
+    mutable domains : unit Domain.t list;
+  }
+
+  let work t b =
+    let n = Array.length b.tasks in
+    let rec loop () =
+      let i = Atomic.fetch_and_add b.next 1 in
+      if i < n then begin
+        (try b.tasks.(i) () with e ->
+           let bt = Printexc.get_raw_backtrace () in
+           Mutex.lock t.lock;
+           if b.error = None then b.error <- Some (e, bt);
+           Mutex.unlock t.lock);
+        if Atomic.fetch_and_add b.finished 1 = n - 1 then begin
+          Mutex.lock t.lock;
+          Condition.broadcast t.changed;
+          Mutex.unlock t.lock
+        end;
+        loop ()
+      end in
+    loop ()
+
+  let rec worker t =
+    Mutex.lock t.lock;
+    let rec next () =
+      match Queue.peek_opt t.batches with
+      | Some b when Atomic.get b.next >= Array.length b.tasks ->
+        ignore (Queue.pop t.batches);
+        next ()
+      | Some b -> Some b
+      | None when t.closed -> None
+      | None -> Condition.wait t.changed t.lock; next () in
+    let b = next () in
+    Mutex.unlock t.lock;
+    match b with
+    | Some b -> work t b; worker t
+    | None -> ()
+
+  let create ?(domains = Domain.recommended_domain_count () - 1) () =
+    let t = { lock = Mutex.create (); changed = Condition.create (); batches = Queue.create ();
+              closed = false; domains = [] } in
+    t.domains <- List.init (max 0 domains) (fun _ -> Domain.spawn (fun () -> worker t));
+    t
+
+  let close t =
+    Mutex.lock t.lock;
+    t.closed <- true;
+    Condition.broadcast t.changed;
+    Mutex.unlock t.lock;
+    List.iter Domain.join t.domains;
+    t.domains <- []
+
+  (* Runs [local] in the calling domain, and [tasks] on the pool with the
+     help of the calling domain. Raises the first exception raised, once all
+     tasks have finished *)
+  let run t ~local tasks =
+    let b = { tasks; next = Atomic.make 0; finished = Atomic.make 0; error = None } in
+    Mutex.lock t.lock;
+    let closed = t.closed in
+    if not closed && t.domains <> [] && Array.length tasks > 0 then begin
+      Queue.push b t.batches;
+      Condition.broadcast t.changed
+    end;
+    Mutex.unlock t.lock;
+    if closed then invalid_arg "Q.Parallel: the pool is closed";
+    let local_error =
+      try List.iter (fun f -> f ()) local; None
+      with e -> Some (e, Printexc.get_raw_backtrace ()) in
+    work t b;
+    Mutex.lock t.lock;
+    while Atomic.get b.finished < Array.length tasks do
+      Condition.wait t.changed t.lock
+    done;
+    Mutex.unlock t.lock;
+    match local_error, b.error with
+    | Some (e, bt), _ | None, Some (e, bt) -> Printexc.raise_with_backtrace e bt
+    | None, None -> ()
+
+  (* Elements per task of long symbol vectors and mixed lists *)
+  let chunk = 65536
+
+  let attrib_of_int = function
+    | 1 -> A_s
+    | 2 -> A_u
+    | 3 -> A_p
+    | 4 -> A_g
+    | _ -> A_none
+
+  external with_validity_ : q_val -> q_val = "q_with_validity"
+
+  (* Every vector of [v], at any depth, as V_valid, as decoded for a
+     connection opened with [~validity:true] *)
+  let rec with_validity = function
+    | V_mixed a -> V_mixed (Array.map with_validity a)
+    | Table tbl -> Table { tbl with cols = with_validity tbl.cols }
+    | Dict d -> Dict { d with keys = with_validity d.keys; vals = with_validity d.vals }
+    | v -> with_validity_ v
+
+  (* Plans the decoding of column [i] of [k] into [cols.(i')]: [tasks] may
+     run on any domain, [local] in the calling domain, and [finish] after
+     both. Symbols are interned in [sym_dict] by the calling domain only.
+     With [validity], the bitmaps are computed by the task decoding the
+     column, or by [finish] for columns decoded in chunks *)
+  let plan ~sym_dict ~packed_strings ~validity k i cols i' ~tasks ~local ~finish =
+    let valid v = if validity then with_validity v else v in
+    let whole () = cols.(i') <- valid (Kobj.decode_column sym_dict packed_strings k i) in
+    let chunks get assemble n =
+      let parts = Array.make ((n + chunk - 1) / chunk) [||] in
+      Array.iteri (fun j _ ->
+          let off = j * chunk in
+          tasks := (fun () -> parts.(j) <- get k i off (min chunk (n - off))) :: !tasks)
+        parts;
+      finish := (fun () -> cols.(i') <- valid (assemble (Array.concat (Array.to_list parts)))) :: !finish in
+    match Kobj.header k i with
+    | (11, _, _) | (0, _, _) when sym_dict <> None -> local := whole :: !local
+    | (11, n, attr) when n > chunk -> chunks Kobj.symbols (fun a -> V_symbol (a, attrib_of_int attr)) n
+    | (0, n, _) when n > chunk && not packed_strings -> chunks Kobj.mixed (fun a -> V_mixed a) n
+    | _ -> tasks := whole :: !tasks
+
+  let decode_table t ~sym_dict ~packed_strings ~validity k =
+    let names = Kobj.colnames k in
+    let (_, _, attr) = Kobj.header k (-1) in
+    let cols = Array.make (Array.length names) Unit in
+    let tasks = ref [] and local = ref [] and finish = ref [] in
+    Array.iteri (fun i _ -> plan ~sym_dict ~packed_strings ~validity k i cols i ~tasks ~local ~finish) names;
+    run t ~local:!local (Array.of_list (List.rev !tasks));
+    List.iter (fun f -> f ()) !finish;
+    Table { colnames = V_symbol (names, A_none); cols = V_mixed cols; attrib_t = attrib_of_int attr }
+
+  let decode t ?sym_dict ?(packed_strings = false) ?(validity = false) k =
+    match Kobj.header k (-1) with
+    | (98, _, _) -> decode_table t ~sym_dict ~packed_strings ~validity k
+    | (99, _, attr) ->
+      let keys = Kobj.part k 0 and vals = Kobj.part k 1 in
+      Fun.protect ~finally:(fun () -> Kobj.release keys; Kobj.release vals) (fun () ->
+          match Kobj.header keys (-1), Kobj.header vals (-1) with
+          | (98, _, _), (98, _, _) ->
+            let keys = decode_table t ~sym_dict ~packed_strings ~validity keys in
+            let vals = decode_table t ~sym_dict ~packed_strings ~validity vals in
+            Dict { keys; vals; attrib_d = attrib_of_int attr }
+          | _ ->
+            let v = Kobj.to_q_val ?sym_dict ~packed_strings k in
+            if validity then with_validity v else v)
+    | _ ->
+      let cols = [| Unit |] and tasks = ref [] and local = ref [] and finish = ref [] in
+      plan ~sym_dict ~packed_strings ~validity k (-1) cols 0 ~tasks ~local ~finish;
+      run t ~local:!local (Array.of_list (List.rev !tasks));
+      List.iter (fun f -> f ()) !finish;
+      cols.(0)
+
+  let decode_reply t (conn : q_conn) k =
+    Fun.protect ~finally:(fun () -> Kobj.release k) (fun () ->
+        decode t ?sym_dict:conn.sym_dict ~packed_strings:conn.packed_strings ~validity:conn.validity k)
+
+  let eval t conn str = decode_reply t conn (Kobj.eval conn str)
+
+  let rpc t conn str v = decode_reply t conn (Kobj.rpc conn str v)
+
+end
+
+
+(* Cursors *)
+
+module Cursor = struct
+
+  type t = {
+    conns : q_conn array;   (* window [k] is fetched on [conns.(k mod n)] *)
+    name : string;          (* the result, held by the server *)
+    rows : int;
+    chunk : int;
+    reuse : bool;
+    mutable requested : int; (* windows requested *)
+    mutable received : int;  (* windows received *)
+    mutable buffers : q_val array; (* columns of the first window *)
+    mutable closed : bool;
+  }
+
+  let ids = Atomic.make 0
+
+  let chars s = Array1.init char c_layout (String.length s) (String.get s)
+
+  (* Stores the unkeyed result of the query in a variable of the server
+     named after the handle of the connection, and returns its name and
+     length *)
+  let store =
+    "{n:`$\".ocamlq.c\",string[.z.w],\"_\",string x 0; n set 0!value x 1; (n;count get n)}"
+
+  let windows t = (t.rows + t.chunk - 1) / t.chunk
+
+  let request t =
+    let k = t.requested in
+    Ipc.send_request t.conns.(k mod Array.length t.conns) Ipc.Sync
+      (Printf.sprintf "(%d;%d) sublist %s" (k * t.chunk) t.chunk t.name) None;
+    t.requested <- k + 1
+
+  let create ?(chunk = 100_000) ?(reuse = false) ?prefetch conn query =
+    if chunk < 1 then invalid_arg "Q.Cursor.create";
+    let id = Atomic.fetch_and_add ids 1 in
+    match Ipc.rpc conn store (V_mixed [| Int64 (Int64.of_int id); V_char (chars query, A_none) |]) with
+    | V_mixed [| Symbol name; Int64 rows |] ->
+      let conns = match prefetch with Some c -> [| conn; c |] | None -> [| conn |] in
+      { conns; name; rows = Int64.to_int rows; chunk; reuse;
+        requested = 0; received = 0; buffers = [||]; closed = false }
+    | _ -> failwith "Q.Cursor.create: unexpected reply"
+
+  (* Waits for the windows in flight, and deletes the result on the server *)
+  let close t =
+    if not t.closed then begin
+      t.closed <- true;
+      while t.received < t.requested do
+        let conn = t.conns.(t.received mod Array.length t.conns) in
+        t.received <- t.received + 1;
+        (try ignore (Ipc.await_response conn) with Failure _ | Q_error _ -> ())
+      done;
+      let short = String.sub t.name 8 (String.length t.name - 8) in
+      ignore (Ipc.eval t.conns.(0) ("delete " ^ short ^ " from `.ocamlq"))
+    end
+
+  (* [v] in the buffer [buf] if it fits *)
+  let reuse_column buf v =
+    let into a b =
+      if Array1.dim b > Array1.dim a then None
+      else begin
+        let s = Array1.sub a 0 (Array1.dim b) in
+        Array1.blit b s;
+        Some s
+      end in
+    let col = match buf, v with
+      | V_bool (a, _), V_bool (b, at) -> Option.map (fun s -> V_bool (s, at)) (into a b)
+      | V_byte (a, _), V_byte (b, at) -> Option.map (fun s -> V_byte (s, at)) (into a b)
+      | V_short (a, _), V_short (b, at) -> Option.map (fun s -> V_short (s, at)) (into a b)
+      | V_int32 (a, _), V_int32 (b, at) -> Option.map (fun s -> V_int32 (s, at)) (into a b)
+      | V_int64 (a, _), V_int64 (b, at) -> Option.map (fun s -> V_int64 (s, at)) (into a b)
+      | V_float32 (a, _), V_float32 (b, at) -> Option.map (fun s -> V_float32 (s, at)) (into a b)
+      | V_float64 (a, _), V_float64 (b, at) -> Option.map (fun s -> V_float64 (s, at)) (into a b)
+      | V_char (a, _), V_char (b, at) -> Option.map (fun s -> V_char (s, at)) (into a b)
+      | V_month (a, _), V_month (b, at) -> Option.map (fun s -> V_month (s, at)) (into a b)
+      | V_date (a, _), V_date (b, at) -> Option.map (fun s -> V_date (s, at)) (into a b)
+      | V_datetime (a, _), V_datetime (b, at) -> Option.map (fun s -> V_datetime (s, at)) (into a b)
+      | V_minute (a, _), V_minute (b, at) -> Option.map (fun s -> V_minute (s, at)) (into a b)
+      | V_second (a, _), V_second (b, at) -> Option.map (fun s -> V_second (s, at)) (into a b)
+      | V_time (a, _), V_time (b, at) -> Option.map (fun s -> V_time (s, at)) (into a b)
+      | V_timestamp (a, _), V_timestamp (b, at) -> Option.map (fun s -> V_timestamp (s, at)) (into a b)
+      | V_timespan (a, _), V_timespan (b, at) -> Option.map (fun s -> V_timespan (s, at)) (into a b)
+      | V_guid (a, _), V_guid (b, at) -> Option.map (fun s -> V_guid (s, at)) (into a b)
+      | V_symbol_enum (a, _, _), V_symbol_enum (b, d, at) ->
+        Option.map (fun s -> V_symbol_enum (s, d, at)) (into a b)
+      | _ -> None in
+    Option.value col ~default:v
+
+  let reuse t = function
+    | Table ({ cols = V_mixed cols; _ } as tbl) when t.reuse ->
+      if Array.length t.buffers = 0 then begin
+        t.buffers <- cols;
+        Table tbl
+      end else
+        Table { tbl with cols = V_mixed (Array.mapi (fun i v ->
+            if i < Array.length t.buffers then reuse_column t.buffers.(i) v else v) cols) }
+    | v -> v
+
+  (* The result is deleted on the server as soon as there is nothing left
+     to return, including when it has no rows *)
+  let next t =
+    if t.closed || t.received >= windows t then (close t; None)
+    else begin
+      if t.requested = t.received then request t;
+      (* Prefetch: the next window is computed and sent while this one is
+         converted *)
+      if t.requested < windows t then request t;
+      let conn = t.conns.(t.received mod Array.length t.conns) in
+      t.received <- t.received + 1;
+      let v = Ipc.await_response conn in
+      if t.received = windows t then close t;
+      Some (reuse t v)
+    end
+
+  let rec to_seq t () =
+    match next t with
+    | Some v -> Seq.Cons (v, to_seq t)
+    | None -> Seq.Nil
+    | exception e -> close t; raise e
+
+  let length t = t.rows
+
+end
+
+
+(* Bulk uploads *)
 
+module Upload = struct
 
-external eval_async : q_conn -> string -> unit = "q_eval_async"
+  let rec rows = function
+    | V_bool (a, _) | V_byte (a, _) -> Array1.dim a
+    | V_short (a, _) -> Array1.dim a
+    | V_int32 (a, _) | V_month (a, _) | V_date (a, _) | V_minute (a, _) | V_second (a, _)
+    | V_time (a, _) | V_symbol_enum (a, _, _) -> Array1.dim a
+    | V_int64 (a, _) | V_timestamp (a, _) | V_timespan (a, _) -> Array1.dim a
+    | V_float32 (a, _) -> Array1.dim a
+    | V_float64 (a, _) | V_datetime (a, _) -> Array1.dim a
+    | V_char (a, _) -> Array1.dim a
+    | V_guid (a, _) -> Array1.dim a / 16
+    | V_symbol (a, _) -> Array.length a
+    | V_strings (_, offsets) -> max 0 (Array1.dim offsets - 1)
+    | V_valid (v, _) -> rows v
+    | V_mixed a -> Array.length a
+    | _ -> invalid_arg "Q.Upload: a column is not a vector"
 
-external eval : q_conn -> string -> q_val = "q_eval"
+  (* Rows [off, off + len) of a column. Bigarrays are shared, arrays of
+     symbols and mixed lists are copied *)
+  let rec slice off len = function
+    | V_bool (a, _) -> V_bool (Array1.sub a off len, A_none)
+    | V_byte (a, _) -> V_byte (Array1.sub a off len, A_none)
+    | V_short (a, _) -> V_short (Array1.sub a off len, A_none)
+    | V_int32 (a, _) -> V_int32 (Array1.sub a off len, A_none)
+    | V_int64 (a, _) -> V_int64 (Array1.sub a off len, A_none)
+    | V_float32 (a, _) -> V_float32 (Array1.sub a off len, A_none)
+    | V_float64 (a, _) -> V_float64 (Array1.sub a off len, A_none)
+    | V_char (a, _) -> V_char (Array1.sub a off len, A_none)
+    | V_month (a, _) -> V_month (Array1.sub a off len, A_none)
+    | V_date (a, _) -> V_date (Array1.sub a off len, A_none)
+    | V_datetime (a, _) -> V_datetime (Array1.sub a off len, A_none)
+    | V_minute (a, _) -> V_minute (Array1.sub a off len, A_none)
+    | V_second (a, _) -> V_second (Array1.sub a off len, A_none)
+    | V_time (a, _) -> V_time (Array1.sub a off len, A_none)
+    | V_timestamp (a, _) -> V_timestamp (Array1.sub a off len, A_none)
+    | V_timespan (a, _) -> V_timespan (Array1.sub a off len, A_none)
+    | V_guid (a, _) -> V_guid (Array1.sub a (16 * off) (16 * len), A_none)
+    | V_symbol_enum (a, d, _) -> V_symbol_enum (Array1.sub a off len, d, A_none)
+    (* Offsets index the whole chars *)
+    | V_strings (chars, offsets) -> V_strings (chars, Array1.sub offsets off (len + 1))
+    | V_valid (v, _) -> slice off len v
+    | V_symbol (a, _) -> V_symbol (Array.sub a off len, A_none)
+    | V_mixed a -> V_mixed (Array.sub a off len)
+    | _ -> invalid_arg "Q.Upload: a column is not a vector"
 
-external rpc_async : q_conn -> string -> q_val -> unit = "q_rpc_async"
+  (* Creates the list of [x 1] chunks that [put] fills, in a variable of the
+     server named after the handle of the connection *)
+  let stage =
+    "{n:`$\".ocamlq.u\",string[.z.w],\"_\",string x 0; n set x[1]#enlist (); n}"
 
-external rpc : q_conn -> string -> q_val -> q_val = "q_rpc"
+  let put = "{@[x 0;x 1;:;x 2];}"
 
+  let ids = Atomic.make 0
 
+  let table ?(chunk = 1_000_000) ?(window = 4) ?(commit = "upsert") conns ~table v =
+    if chunk < 1 || window < 1 || Array.length conns = 0 then invalid_arg "Q.Upload.table";
+    let (colnames, cols) = match v with
+      | Table { colnames; cols = V_mixed cols; _ } -> (colnames, cols)
+      | _ -> invalid_arg "Q.Upload.table: not a table" in
+    let n = if Array.length cols = 0 then 0 else rows cols.(0) in
+    if Array.exists (fun c -> rows c <> n) cols then
+      invalid_arg "Q.Upload.table: columns of different lengths";
+    (* An empty table is sent as one empty chunk *)
+    let chunks = max 1 ((n + chunk - 1) / chunk) in
+    let id = Atomic.fetch_and_add ids 1 in
+    let name = match Ipc.rpc conns.(0) stage
+                       (V_mixed [| Int64 (Int64.of_int id); Int64 (Int64.of_int chunks) |]) with
+      | Symbol name -> name
+      | _ -> failwith "Q.Upload.table: unexpected reply" in
+    let short = String.sub name 8 (String.length name - 8) in
+    let drop () =
+      try ignore (Ipc.eval conns.(0) ("delete " ^ short ^ " from `.ocamlq")) with Failure _ | Q_error _ -> () in
+    Fun.protect ~finally:drop (fun () ->
+      (* Each connection takes the next chunk, with at most [window]
+         chunks awaiting their response *)
+      let next = Atomic.make 0 and failed = Atomic.make false in
+      let send conn =
+        let pending = ref 0 in
+        let await () = decr pending; ignore (Ipc.await_response conn) in
+        try
+          let rec loop () =
+            let i = Atomic.fetch_and_add next 1 in
+            if i < chunks && not (Atomic.get failed) then begin
+              if !pending >= window then await ();
+              let off = i * chunk in
+              let len = min chunk (n - off) in
+              let part = Table { colnames; cols = V_mixed (Array.map (slice off len) cols);
+                                 attrib_t = A_none } in
+              Ipc.send_request conn Ipc.Sync put
+                (Some (V_mixed [| Symbol name; Int64 (Int64.of_int i); part |]));
+              incr pending;
+              loop ()
+            end in
+          loop ();
+          while !pending > 0 do await () done
+        with e ->
+          (* Leaves the connection with no response to read *)
+          Atomic.set failed true;
+          while !pending > 0 do try await () with Failure _ | Q_error _ -> () done;
+          raise e in
+      let domains = Array.map (fun conn -> Domain.spawn (fun () -> send conn))
+          (Array.sub conns 1 (Array.length conns - 1)) in
+      let local = try send conns.(0); None with e -> Some e in
+      let errors = Array.map (fun d -> try Domain.join d; None with e -> Some e) domains in
+      match local, Array.find_map Fun.id errors with
+      | Some e, _ | None, Some e -> raise e
+      | None, None ->
+        Ipc.rpc conns.(0) (Printf.sprintf "{%s[x 0;raze get x 1]}" commit)
+          (V_mixed [| Symbol table; Symbol name |]))
 
+end
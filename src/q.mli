@@ -18,9 +18,16 @@ type attrib =
   | A_g
 
 (** The type of Q values *)
+(* Note: vectors are not copied out of the kdb+ reply. Each bigarray references
+   the memory of its q vector and releases it when the bigarray and all the
+   views taken of it (Array1.sub, slice, reshape) have been collected. *)
 (* Note: there are no q enumerations. In the q-rpc protocol they are symbol vectors *)
 (* Note: lambdas, operators, partial applications (types 100, 102 and 104) are not supported in this version *)
 
+(** A symbol dictionary: a client-side intern table numbering the distinct
+    symbols it has seen, see [Sym_dict] *)
+type sym_dict
+
 type  q_val = 
   (* scalars *)
   | Bool of bool
@@ -40,7 +47,7 @@ type  q_val =
   | Time of int32
   | Timestamp of int64
   | Timespan of int64
-  | Guid of string
+  | Guid of string (* 16 bytes *)
   (* vectors of scalars *)
   | V_bool of uint8_bigarray * attrib
   | V_byte of uint8_bigarray * attrib
@@ -59,12 +66,19 @@ type  q_val =
   | V_time of int32_bigarray * attrib
   | V_timestamp of int64_bigarray * attrib
   | V_timespan of  int64_bigarray * attrib
-  | V_guid of string array * attrib
+  | V_guid of uint8_bigarray * attrib (* 16 bytes per GUID *)
   (* mixed lists *)
   | V_mixed of q_val array
   (* tables and dictionaries *)
   | Table of q_table
   | Dict of q_dict
+  (* symbol vector as indices into a symbol dictionary, see open_connection *)
+  | V_symbol_enum of int32_bigarray * sym_dict * attrib
+  (* list of strings: their chars one after the other, and the n + 1 offsets
+     at which they start and end. See open_connection *)
+  | V_strings of char_bigarray * int64_bigarray
+  (* a vector and its validity. See open_connection *)
+  | V_valid of q_val * validity
   (* result of Q functions that return void. In q, (::) of type 101 *)
   | Unit
 
@@ -78,21 +92,811 @@ and q_table = { colnames: q_val; (* Always a Q_v_symbol *)
                 cols: q_val;
 		attrib_t: attrib }
 
+(* Bit i of [bitmap] (least significant first, as in Arrow) is set when
+   element i is not null. The bitmap is empty when [null_count] is 0 *)
+and validity = { bitmap: uint8_bigarray; null_count: int }
+
+
+(** Symbol dictionaries. Indices are allocated in order of first appearance
+    and never change, so two indices from the same dictionary are equal
+    exactly when their symbols are. Strings are shared, not copied. *)
+module Sym_dict : sig
+  type t = sym_dict
+
+  val create : unit -> t
+
+  (** Number of symbols in the dictionary *)
+  val length : t -> int
+
+  (** The symbol of an index. Raises [Invalid_argument] if out of bounds *)
+  val get : t -> int32 -> string
+
+  (** The index of a symbol, adding it to the dictionary if needed *)
+  val intern : t -> string -> int32
+
+  (** The index of a symbol, if it is in the dictionary *)
+  val find : t -> string -> int32 option
+end
+
+
+(** {2 Instrumentation} *)
+
+(** Statistics of the calls made on connections opened with [~stats]. Each
+    call is timed in three phases: sending (encoding and writing the
+    request), waiting (until the reply arrives) and decoding (reading and
+    converting the reply). With the K object functions ([eval], [rpc]), the
+    C library sends and waits in one call, which is counted as waiting;
+    sending only counts the conversion of the argument. Byte counts are those
+    of the uncompressed messages for the K object functions, and of the
+    messages on the wire for [Ipc]. [Ipc.send_request] and [Ipc.recv], and so
+    [Pipeline], are not measured. Connections opened without [~stats] pay
+    one test per call. *)
+module Stats : sig
+  type t
+
+  (** A measured call. [name] is the function, such as ["eval"] or
+      ["Ipc.rpc"], and [query] its query. [objects] counts the q objects
+      decoded from the reply, by q type (as in [type] in q, [98] for tables
+      and [99] for dictionaries). [minor_words] is the allocation of the
+      call in the calling domain. For [recv], waiting is the time until the
+      server sends a message. *)
+  type call = {
+    name : string;
+    query : string;
+    wall_ns : int;
+    send_ns : int;
+    wait_ns : int;
+    decode_ns : int;
+    bytes_out : int;
+    bytes_in : int;
+    objects : (int * int) list;
+    minor_words : float;
+    failed : bool;
+  }
+
+  (** [counts.(i)] is the number of calls whose time was at most
+      [bounds.(i)] seconds and more than [bounds.(i-1)]. The last count is
+      of the calls longer than the last bound. [sum] is in seconds. *)
+  type histogram = {
+    bounds : float array;
+    counts : int array;
+    sum : float;
+  }
+
+  (** The totals since the statistics were created or reset *)
+  type snapshot = {
+    calls : int;
+    failures : int;
+    bytes_out : int;
+    bytes_in : int;
+    minor_words : float;
+    objects : (int * int) list;
+    wall : histogram;
+    send : histogram;
+    wait : histogram;
+    decode : histogram;
+  }
+
+  (** Statistics that may be shared by several connections. [hook] is called
+      after each call, in the thread that made it; it must not raise. *)
+  val create : ?hook:(call -> unit) -> unit -> t
+
+  val snapshot : t -> snapshot
+
+  val reset : t -> unit
+
+  (** The snapshot in the Prometheus text format, with metric names starting
+      with [prefix] (default ["q"]) *)
+  val to_prometheus : ?prefix:string -> t -> string
+end
+
 
 type q_conn (* abstract *)
 
 (**  an exception to signal connection errors, such as unknown host, connection refused, or connection timeout *)
 exception Q_connect of string
 
-val open_connection : string -> int -> q_conn
+(** An error returned by kdb+ for a request, with its message, such as
+    ["type"] or the text of a signal *)
+exception Q_error of string
+
+(** Thread safety: the functions below release the OCaml runtime while they
+    wait on the network, so other threads and domains keep running during a
+    query. A [q_conn] carries one request at a time: do not use the same
+    connection from two threads or domains concurrently (use one connection
+    per thread, or guard it with a mutex). Distinct connections can be used
+    concurrently. *)
+
+(** [open_connection ~symbol_enum ~packed_strings ~compression_threshold host
+    port]. With [symbol_enum] (default false), symbol vectors in replies are
+    decoded as [V_symbol_enum] against a symbol dictionary owned by the
+    connection, rather than as [V_symbol]. The dictionary persists across
+    replies, so each distinct symbol is allocated once for the lifetime of
+    the connection. Column names of tables are always decoded as [V_symbol].
+    With [packed_strings] (default false), non-empty lists of strings (char
+    vectors) are decoded as [V_strings] rather than as [V_mixed] of [V_char],
+    which takes two allocations per list instead of one per string. The
+    string [i] of [V_strings (chars, offsets)] is [Array1.sub chars o (o' -
+    o)], where [o = offsets.{i}] and [o' = offsets.{i+1}].
+    Messages sent with [Ipc] that are longer than [compression_threshold]
+    bytes (default: never) are compressed, if that halves their size. kdb+
+    itself compresses messages over 2000 bytes to remote hosts.
+    The calls [eval], [rpc], [recv], their async versions and those of
+    [Ipc] are added to [stats], if given.
+    With [validity] (default false), vectors of numbers, temporal values and
+    symbols in replies are decoded as [V_valid], with the validity bitmap
+    and the number of their nulls ([0N], [0n] and the empty symbol),
+    computed in C as they are decoded. Columns without nulls can then be
+    processed without testing their elements. [V_valid] values are sent
+    as their vector. *)
+val open_connection :
+  ?symbol_enum:bool -> ?packed_strings:bool -> ?compression_threshold:int ->
+  ?stats:Stats.t -> ?validity:bool -> string -> int -> q_conn
+
+(** The symbol dictionary of a connection opened with [~symbol_enum:true] *)
+val symbol_dict : q_conn -> sym_dict option
+
+(** The ["host:port"] a connection was opened to *)
+val endpoint : q_conn -> string
+
+val eval_async : q_conn -> string -> unit
+
+(** Raises [Q_error] if kdb+ returns an error, and [Failure "Network error"]
+    if the connection is lost. So do [rpc] and [recv]. *)
+val eval : q_conn -> string -> q_val
+
+val rpc_async : q_conn -> string -> q_val -> unit
+
+val rpc : q_conn -> string -> q_val -> q_val
+
+(** The next message sent by the server without a request, such as an update
+    published by a tickerplant. Blocks until one arrives *)
+val recv : q_conn -> q_val
+
+external close_connection : q_conn -> unit = "q_close"
+
+
+(** {2 K objects} *)
+
+(** Values of the kdb+ C library, as built by [rpc] to send its argument and
+    by [eval] from a reply. They are freed by the GC. Converting to and from
+    them measures the cost of [eval] and [rpc] without the network. *)
+module Kobj : sig
+  type t
+
+  (** The conversion done by [rpc] for its argument *)
+  val of_q_val : q_val -> t
+
+  (** The conversion done by [eval] for its reply. The options are those of
+      [open_connection]. Vectors share the memory of the K object. *)
+  val to_q_val : ?sym_dict:sym_dict -> ?packed_strings:bool -> t -> q_val
+
+  (** The reply to [Q.eval], not converted. Raises as [Q.eval] *)
+  val eval : q_conn -> string -> t
+
+  val rpc : q_conn -> string -> q_val -> t
+
+  (** Frees the K object before it is collected. Values converted from it
+      remain valid. Raises [Invalid_argument] if used afterwards. *)
+  val release : t -> unit
+end
+
+
+(** {2 Typed tables} *)
+
+(** Typed access to the columns of tables. A schema lists the columns to
+    extract and their types, and is checked once per table, instead of
+    matching [q_val]s on every access:
+    {[
+      let trades = Schema.(col "time" time @@ col "price" float64 @@ nil)
+      let (time, (price, ())) = Schema.decode trades (eval conn "select from t")
+    ]}
+    The columns are the bigarrays of the table, not copies. [eval] and
+    [decode_kobj] convert only the columns named in the schema, straight
+    from the K object of the reply: the other columns are not converted,
+    and no [q_val] is built for the table. *)
+module Schema : sig
+  type 'a col_type
+
+  (** A schema whose columns have the types of the components of ['a] *)
+  type 'a t
+
+  exception Mismatch of string
+
+  val bool : uint8_bigarray col_type
+  val byte : uint8_bigarray col_type
+  val short : uint16_bigarray col_type
+  val int32 : int32_bigarray col_type
+  val int64 : int64_bigarray col_type
+  val float32 : float32_bigarray col_type
+  val float64 : float64_bigarray col_type
+  val char : char_bigarray col_type
+  val symbol : string array col_type
+  (** A symbol column of a connection opened with [~symbol_enum:true] *)
+  val symbol_enum : (int32_bigarray * sym_dict) col_type
+  (** A string column of a connection opened with [~packed_strings:true] *)
+  val strings : (char_bigarray * int64_bigarray) col_type
+  val month : int32_bigarray col_type
+  val date : int32_bigarray col_type
+  val datetime : float64_bigarray col_type
+  val minute : int32_bigarray col_type
+  val second : int32_bigarray col_type
+  val time : int32_bigarray col_type
+  val timestamp : int64_bigarray col_type
+  val timespan : int64_bigarray col_type
+  (** 16 bytes per GUID *)
+  val guid : uint8_bigarray col_type
+  (** Any column, as a [q_val] *)
+  val q_val : q_val col_type
+
+  val nil : unit t
+
+  (** [col name ty rest] *)
+  val col : string -> 'a col_type -> 'b t -> ('a * 'b) t
+
+  (** The columns of a table, or of a keyed table, named in the schema.
+      Other columns are ignored. Raises [Mismatch] if a column is missing or
+      has another type *)
+  val decode : 'a t -> q_val -> 'a
+
+  (** The columns of a K object holding a table, or a keyed table, named in
+      the schema. The options are those of [open_connection]. Raises as
+      [decode] *)
+  val decode_kobj : ?sym_dict:sym_dict -> ?packed_strings:bool -> 'a t -> Kobj.t -> 'a
+
+  (** [eval schema conn str] is [decode schema (Q.eval conn str)], but
+      converts only the columns of the schema *)
+  val eval : 'a t -> q_conn -> string -> 'a
+
+  val rpc : 'a t -> q_conn -> string -> q_val -> 'a
+end
+
+
+(** {2 Arrow} *)
+
+(** Export through the Arrow C data interface. Exported arrays share the
+    memory of the bigarrays of the value, except for the columns whose
+    layout differs in Arrow, which are converted:
+    - booleans, as Arrow packs them in bits;
+    - symbols, which are not contiguous in OCaml. [V_symbol_enum]
+      columns are exported as dictionary-encoded arrays whose indices are
+      shared, and whose dictionary is copied;
+    - months, dates, minutes, timestamps and datetimes, whose epoch or unit
+      differs. Months become the dates of their first day.
+    Nulls of q, including the empty symbol, become validity bitmaps. Temporal infinities become the
+    largest and smallest values of the Arrow type: [0Wp] is [Int64.max_int]
+    nanoseconds, [0wz] is [Int64.max_int] milliseconds, and [0Wm], [0Wd] and
+    [0Wu] are [Int32.max_int] days or seconds (negated for [-0W]). Datetimes
+    out of the range of Arrow timestamps saturate likewise.
+    The value is kept alive until all of its arrays are released. *)
+module Arrow : sig
+  (** [export v ~schema ~array] fills the [ArrowSchema] and [ArrowArray]
+      structures at addresses [schema] and [array], allocated by the
+      consumer. A table is exported as a struct array with one child per
+      column; the key columns of a keyed table come first. Vectors are
+      exported as arrays. Raises [Invalid_argument] for other values. *)
+  val export : q_val -> schema:nativeint -> array:nativeint -> unit
+
+  (** Arrays may be released by any thread, so values are only freed by
+      the next [export] or [collect] *)
+  val collect : unit -> unit
+end
+
+
+(** {2 Temporal conversions} *)
+
+(** Conversions of whole temporal vectors between the epoch of q,
+    2000.01.01, and the Unix epoch, 1970.01.01. The result is written to
+    [dst], which must have the length of the source and may be the source
+    itself, or else to a new bigarray. Nulls and infinities of q are kept
+    as they are. The loops are vectorized by the C compiler. *)
+module Time : sig
+  (** Nanoseconds, of [V_timestamp], to and from Unix time in nanoseconds.
+      Values must be within the range of both *)
+  val timestamp_to_unix : ?dst:int64_bigarray -> int64_bigarray -> int64_bigarray
+  val timestamp_of_unix : ?dst:int64_bigarray -> int64_bigarray -> int64_bigarray
+
+  (** Days, of [V_date], to and from days since the Unix epoch *)
+  val date_to_unix : ?dst:int32_bigarray -> int32_bigarray -> int32_bigarray
+  val date_of_unix : ?dst:int32_bigarray -> int32_bigarray -> int32_bigarray
+
+  (** Fractional days, of [V_datetime], to and from Unix time in seconds *)
+  val datetime_to_unix : ?dst:float64_bigarray -> float64_bigarray -> float64_bigarray
+  val datetime_of_unix : ?dst:float64_bigarray -> float64_bigarray -> float64_bigarray
+
+  (** Months, of [V_month], to the days since the Unix epoch of their first
+      day, and days since the Unix epoch to the months holding them *)
+  val month_to_unix : ?dst:int32_bigarray -> int32_bigarray -> int32_bigarray
+  val month_of_unix : ?dst:int32_bigarray -> int32_bigarray -> int32_bigarray
+
+  (** Times of day, of [V_minute], [V_second] and [V_time] (milliseconds),
+      to and from nanoseconds, as in [V_timespan], which needs no
+      conversion. Nanoseconds are rounded down, and must be within the
+      range of the result *)
+  val minute_to_ns : ?dst:int64_bigarray -> int32_bigarray -> int64_bigarray
+  val minute_of_ns : ?dst:int32_bigarray -> int64_bigarray -> int32_bigarray
+  val second_to_ns : ?dst:int64_bigarray -> int32_bigarray -> int64_bigarray
+  val second_of_ns : ?dst:int32_bigarray -> int64_bigarray -> int32_bigarray
+  val time_to_ns : ?dst:int64_bigarray -> int32_bigarray -> int64_bigarray
+  val time_of_ns : ?dst:int32_bigarray -> int64_bigarray -> int32_bigarray
+end
+
+
+(** {2 Native IPC} *)
+
+(** A native implementation of the kdb+ IPC protocol, converting directly
+    between [q_val]s and the bytes of messages without building kdb+ K
+    objects. Received vectors are read from the socket straight into their
+    bigarrays, and sent vectors are written from theirs. Messages are
+    little-endian. Compressed messages are decompressed in memory before being
+    decoded, and sent messages are compressed according to the threshold of
+    the connection. The functions follow the thread-safety
+    contract of [open_connection], and honour its decoding options. *)
+module Ipc : sig
+  type msg_type = Async | Sync | Response
+
+  (** The bytes of a message holding a value, as [-8!] in q. Messages longer
+      than [compression_threshold] bytes (default: never) are compressed as
+      [send] compresses them. *)
+  val serialize : ?compression_threshold:int -> msg_type -> q_val -> bytes
+
+  (** The value held by the bytes of a message, compressed or not, as [-9!]
+      in q. With [sym_dict], symbol vectors are decoded as [V_symbol_enum],
+      and with [packed_strings], lists of strings as [V_strings]. Raises
+      [Failure] for malformed messages and [Q_error] for q errors. *)
+  val deserialize : ?sym_dict:sym_dict -> ?packed_strings:bool -> bytes -> msg_type * q_val
+
+  (** Sends a message holding a value. Unless the message is compressed,
+      vectors of 16 KB or more are sent from their bigarrays without being
+      copied *)
+  val send : q_conn -> msg_type -> q_val -> unit
+
+  (** [send_request conn ty query arg] sends [query], or the list
+      [(query; arg)] when [arg] is given, as [eval] and [rpc] do *)
+  val send_request : q_conn -> msg_type -> string -> q_val option -> unit
+
+  (** Receives the next message. Raises [Q_error] for q errors, and
+      [Failure] for malformed messages and network errors *)
+  val recv : q_conn -> msg_type * q_val
+
+  (** Receives messages until a response, which is returned. Other messages
+      are discarded *)
+  val await_response : q_conn -> q_val
+
+  val eval_async : q_conn -> string -> unit
+
+  val eval : q_conn -> string -> q_val
+
+  val rpc_async : q_conn -> string -> q_val -> unit
+
+  val rpc : q_conn -> string -> q_val -> q_val
+
+  (** {3 Event loops}
+
+      To share one thread between many connections, an event loop such as
+      Lwt or Eio can do the I/O of a connection itself: write the bytes of
+      [encode_request] to [fd conn] when it is writable, and [feed] what it
+      reads to a [Parser]. Requests sent this way must not be mixed with
+      the other functions on the same connection. *)
+
+  (** The bytes of the message [send_request] would send *)
+  val encode_request : msg_type -> string -> q_val option -> bytes
+
+  (** The socket of a connection. It is in blocking mode; an event loop
+      should make it non-blocking. *)
+  val fd : q_conn -> Unix.file_descr
+
+  (** An incremental parser of messages *)
+  module Parser : sig
+    type t
+
+    (** The options are those of [deserialize] *)
+    val create : ?sym_dict:sym_dict -> ?packed_strings:bool -> unit -> t
+
+    (** [feed p buf off len] adds [len] bytes of [buf] from [off] *)
+    val feed : t -> bytes -> int -> int -> unit
+
+    (** The next complete message, if any. Raises [Q_error] for q errors and
+        [Failure] for malformed messages; the message is consumed either
+        way. *)
+    val next : t -> (msg_type * q_val) option
+
+    (** Number of bytes fed but not yet parsed *)
+    val buffered : t -> int
+  end
+end
+
+
+(** {2 Pipelining} *)
+
+(** Pipelined requests over one connection, through [Ipc]. Requests are sent
+    without waiting for the replies of the previous ones, and each returns a
+    future of its reply. kdb+ replies in the order of the requests, so a loop
+    of small queries costs one round trip rather than one per query.
+    A pipeline owns its connection while requests are in flight: do not use
+    the connection directly until [flush]. The thread-safety contract of
+    [open_connection] applies to the pipeline as a whole. *)
+module Pipeline : sig
+  type t
+
+  type future
+
+  (** [create ~window conn]. At most [window] requests (default 128) are in
+      flight: submitting one more first reads the oldest reply. This bounds
+      the memory held by unread replies, which the server would otherwise
+      block on. *)
+  val create : ?window:int -> q_conn -> t
+
+  val eval : t -> string -> future
+
+  val rpc : t -> string -> q_val -> future
+
+  (** The reply to a request, reading replies until it arrives. Raises
+      [Q_error] if the request failed. Any other failure to read a reply,
+      such as ["Network error"] or a malformed message, leaves the replies
+      out of step with the requests: it fails all the requests in flight,
+      and the pipeline raises it for any further request. *)
+  val await : future -> q_val
+
+  (** Whether the reply to a request has been read. Does not block *)
+  val is_ready : future -> bool
+
+  (** Number of requests whose reply has not been read *)
+  val in_flight : t -> int
+
+  (** Reads the replies of all the requests in flight *)
+  val flush : t -> unit
+end
+
+
+(** {2 Tickerplant subscriptions} *)
+
+(** Subscriptions to a kdb+ tickerplant. Updates published by the tickerplant
+    are read and decoded by a domain owned by the subscription, coalesced into
+    batches, and handed to a callback run by a second domain. When the
+    callback falls behind, reading stops and updates queue up in the
+    tickerplant. *)
+module Subscriber : sig
+  (** An update published as [(`upd; table; data)] *)
+  type update = { table : string; data : q_val }
+
+  type t
+
+  (** [subscribe ~batch_size ~batch_delay ~max_batches ~on_message conn ~table
+      ~syms f] calls [.u.sub] for [table] ([""] for all tables) and [syms]
+      ([[]] for all symbols), then applies [f] to the batches of updates
+      received. A batch holds at most [batch_size] updates (default 64), and
+      is delivered at most [batch_delay] seconds (default 0.01) after its
+      first update arrived. At most [max_batches] batches (default 16) wait
+      for [f]. Other messages, such as [(`.u.end; date)], are passed to
+      [on_message] in order with the batches. [conn] must not be used while
+      the subscription runs. *)
+  val subscribe :
+    ?batch_size:int -> ?batch_delay:float -> ?max_batches:int ->
+    ?on_message:(q_val -> unit) ->
+    q_conn -> table:string -> syms:string list -> (update array -> unit) -> t
+
+  (** The reply to [.u.sub]: the name and empty schema of the table, or a
+      list of them *)
+  val schema : t -> q_val
+
+  (** Blocks until the subscription ends, and raises the exception that ended
+      it: a network error, or an exception raised by a callback *)
+  val wait : t -> unit
+
+  (** Stops reading updates, waits for the callbacks of the batches already
+      read, then behaves as [wait]. The tickerplant keeps publishing to the
+      connection until it is closed. *)
+  val stop : t -> unit
+end
+
+
+(** Batched publishing to a kdb+ tickerplant. Rows are accumulated in one
+    buffer per column, and sent as a single columnar [.u.upd] message
+    through [Ipc] when enough rows are buffered or the oldest is old enough.
+    The buffers are reused across messages. A publisher is not thread-safe. *)
+module Publisher : sig
+  type col_type =
+    | T_bool | T_byte | T_short | T_int32 | T_int64 | T_float32 | T_float64
+    | T_char | T_symbol | T_month | T_date | T_datetime | T_minute | T_second
+    | T_time | T_timestamp | T_timespan | T_guid
+
+  type t
+
+  (** [create ~func ~max_rows ~max_delay conn ~table schema] publishes rows of
+      [table], whose columns have the types in [schema], by calling [func]
+      (default [.u.upd]) with the table name and a list of columns. Buffered
+      rows are sent when there are [max_rows] of them (default 1000), or
+      when a row is added [max_delay] seconds (default 0.1) after the oldest. *)
+  val create :
+    ?func:string -> ?max_rows:int -> ?max_delay:float ->
+    q_conn -> table:string -> col_type array -> t
+
+  (** Adds a row of scalars, such as [Symbol] for a [T_symbol] column.
+      Raises [Invalid_argument] if the row does not match the schema *)
+  val add : t -> q_val array -> unit
+
+  (** Number of buffered rows *)
+  val pending : t -> int
+
+  (** Sends the buffered rows now *)
+  val flush : t -> unit
+
+  (** Sends the buffered rows if the oldest is [max_delay] seconds old. Call
+      it periodically when rows may stop arriving. *)
+  val flush_if_due : t -> unit
+end
+
+
+(** {2 Connection pools} *)
+
+(** A pool of connections to one or more kdb+ endpoints, such as gateways
+    started with secondary threads ([-s]). Each request goes to an idle
+    connection of the endpoint with the fewest requests in flight, preferring
+    the connection last used by the calling domain. A connection that fails
+    with a network error is closed and reopened in the background by a domain
+    owned by the pool. All functions can be called from any thread or domain. *)
+module Pool : sig
+  type t
+
+  (** [create ~size endpoints] opens [size] connections (default 1) to each
+      [(host, port)] endpoint. Unreachable endpoints are retried in the
+      background every [retry_delay] seconds (default 1.0). The calls on all
+      connections are added to [stats], if given.
+      Raises [Q_connect] if no connection could be opened. *)
+  val create : ?size:int -> ?retry_delay:float -> ?stats:Stats.t -> (string * int) list -> t
+
+  (** [with_conn pool f] checks out a connection, applies [f] to it and
+      returns the connection to the pool. Blocks while all connections are
+      busy. Raises [Q_connect] if all of them are broken, until one is
+      reopened in the background. *)
+  val with_conn : t -> (q_conn -> 'a) -> 'a
+
+  val eval_async : t -> string -> unit
+
+  val eval : t -> string -> q_val
+
+  val rpc_async : t -> string -> q_val -> unit
+
+  val rpc : t -> string -> q_val -> q_val
+
+  (** Closes all connections. Connections in use are closed when released *)
+  val close : t -> unit
+end
+
+
+(** {2 Result caches} *)
+
+(** Caches of the replies to repeated queries, such as reference data.
+    Entries are keyed on the server, the query text and a digest of the
+    argument's IPC encoding, expire after a time to live, and are evicted
+    least recently used first when their total size exceeds a byte budget.
+    Sizes count the bigarrays and strings of a reply. Replies are shared
+    between callers and must not be modified. Errors are not cached. All
+    functions can be called from any thread or domain. *)
+module Cache : sig
+  type t
+
+  (** [create ~ttl ~max_bytes ()]: entries live [ttl] seconds (default 60),
+      and take at most [max_bytes] in total (default 64MB) *)
+  val create : ?ttl:float -> ?max_bytes:int -> unit -> t
+
+  (** [eval cache ~ttl ~tags conn str] is [Q.eval conn str], or the cached
+      reply to [str] from the same server ([endpoint conn]). [ttl] overrides
+      that of the cache for a new entry; [tags] are the names, such as
+      tables, under which [invalidate_tag] finds it.
+      The reply, cached or not, is shared with the cache and with the other
+      callers: it is read-only. Copy a bigarray before modifying it, as a
+      change would be seen by every later hit. *)
+  val eval : t -> ?ttl:float -> ?tags:string list -> q_conn -> string -> q_val
+
+  val rpc : t -> ?ttl:float -> ?tags:string list -> q_conn -> string -> q_val -> q_val
+
+  (** [cached cache ~ttl ~tags ~server query arg f] is the cached reply of
+      [server] to [query] with argument [arg], or [f ()], for calls made by
+      other means, such as [Pool] or [Ipc]. [server] names the database
+      that [f] queries, such as the [endpoint] of its connection, or a name
+      shared by the replicas of a [Pool]. The reply is read-only, as that
+      of [eval]. *)
+  val cached :
+    t -> ?ttl:float -> ?tags:string list -> server:string -> string -> q_val option
+    -> (unit -> q_val) -> q_val
+
+  (** Removes the entries of a query, whatever their server and argument.
+      Replies to calls in progress are not cached. *)
+  val invalidate : t -> string -> unit
+
+  (** Removes the entries with a tag *)
+  val invalidate_tag : t -> string -> unit
+
+  val clear : t -> unit
+
+  (** [watch ~syms cache conn ~table] subscribes to [table] on the
+      tickerplant at [conn], as [Subscriber.subscribe], and invalidates the
+      tag of the table of each update received *)
+  val watch : ?syms:string list -> t -> q_conn -> table:string -> Subscriber.t
+
+  (** Number of entries *)
+  val length : t -> int
+
+  (** Total size of the entries *)
+  val bytes : t -> int
+
+  val hits : t -> int
+
+  val misses : t -> int
+end
+
+
+(** {2 Tables on disk} *)
+
+(** Reading and writing the splayed and partitioned tables of a kdb+
+    database directly from disk. Columns are mapped with [Unix.map_file] rather than read, so
+    scanning a column reads the file on demand, and a column is unmapped
+    when its bigarray is garbage collected. The mappings are private:
+    changes to the bigarrays are not written to the files.
+    Supported: uncompressed column files of the vector types, and symbol
+    columns enumerated against the [sym] file. Not supported: compressed
+    files and nested columns such as strings. Raises [Failure] on other
+    columns, and on files that are not kdb+ column files. *)
+module Hdb : sig
+  (** The symbols of an enumeration file, such as [sym]. Writers add the
+      symbols they enumerate to it and to its file. A [sym] can be shared by
+      the threads and domains writing to a database, and the file by
+      processes: it is locked while symbols are appended. *)
+  type sym
+
+  val load_sym : string -> sym
+
+  (** As [load_sym], or an empty enumeration if the file does not exist yet.
+      The file is created by the first write. The calls on one file return
+      the same [sym], which stays open for the life of the process. *)
+  val open_sym : string -> sym
+
+  (** [read_splayed ~sym ~symbol_enum dir] reads the splayed table in [dir],
+      with its columns in the order of [dir/.d]. Enumerated columns are
+      decoded against [sym], by default the [sym] file of the parent
+      directory of [dir]. With [symbol_enum] (default false), they are
+      mapped as [V_symbol_enum] against a dictionary of the symbols of
+      [sym], in which their indices are those of the file. Otherwise they are
+      converted to [V_symbol]. *)
+  val read_splayed : ?sym:sym -> ?symbol_enum:bool -> string -> q_val
+
+  (** The partitions of the database in a directory, in order: the
+      subdirectories named as dates ([2024.01.31]), months ([2024.01]) or
+      integers *)
+  val partitions : string -> string list
+
+  (** [read_partition root ~partition ~table] reads [table] in a partition
+      of the database in [root], as [read_splayed], with the partition
+      column ([date], [month] or [int]) first. [sym] defaults to the [sym]
+      file of [root]. *)
+  val read_partition :
+    ?sym:sym -> ?symbol_enum:bool -> string -> partition:string -> table:string -> q_val
+
+  (** [read_partitioned root ~table] is the concatenation of [table] in the
+      [partitions] (default: all) that have it. The columns are copied
+      into new bigarrays, without their attributes. *)
+  val read_partitioned :
+    ?sym:sym -> ?symbol_enum:bool -> ?partitions:string list -> string -> table:string -> q_val
+
+  (** [write_splayed ~sym dir table] writes [table] as a splayed table in
+      [dir], which is created if needed: a column file per column, with its
+      attribute, and [.d] last. Symbol columns ([V_symbol] or
+      [V_symbol_enum]) are enumerated against [sym], by default the [sym]
+      file of the parent directory of [dir], and written with int64 indices
+      as kdb+ 3.x writes them. Raises [Invalid_argument] if
+      [table] is not an unkeyed table, and [Failure] on columns [Hdb] cannot
+      read. *)
+  val write_splayed : ?sym:sym -> string -> q_val -> unit
+
+  (** [write_partition root ~partition ~table v] writes [v] as [table] in a
+      partition of the database in [root], as [write_splayed]. [v] must not
+      have the partition column. [sym] defaults to the [sym] file of
+      [root], opened with [open_sym]. Partitions can be written
+      concurrently, by the threads and domains of a process and by
+      processes. *)
+  val write_partition :
+    ?sym:sym -> string -> partition:string -> table:string -> q_val -> unit
+end
+
+
+(** {2 Parallel decoding} *)
+
+(** Converting large replies on several domains. The columns of a table (or
+    of both tables of a keyed table) are converted by the domains of a pool,
+    and symbol vectors and mixed lists longer than 65536 elements are split
+    into chunks converted in parallel. The calling domain takes part. On
+    connections opened with [~symbol_enum:true], symbol vectors and mixed
+    lists are converted by the calling domain, which alone adds symbols to
+    the dictionary. Numeric vectors are not copied, so the gain is on
+    symbols, strings and mixed lists. *)
+module Parallel : sig
+  type t
+
+  (** A pool of [domains] domains (default: one less than
+      [Domain.recommended_domain_count ()]). It can be shared by threads
+      and domains. *)
+  val create : ?domains:int -> unit -> t
+
+  (** Stops the domains of the pool, once the conversions in progress are
+      done *)
+  val close : t -> unit
+
+  (** As [Q.eval] and [Q.rpc], converting the reply on the pool with the
+      decoding options of the connection, including [validity] *)
+  val eval : t -> q_conn -> string -> q_val
+
+  val rpc : t -> q_conn -> string -> q_val -> q_val
+
+  (** As [Kobj.to_q_val], on the pool. With [validity] (default false),
+      vectors are decoded as [V_valid], as for a connection opened with
+      [~validity:true] *)
+  val decode :
+    t -> ?sym_dict:sym_dict -> ?packed_strings:bool -> ?validity:bool -> Kobj.t -> q_val
+end
+
+
+(** {2 Cursors} *)
+
+(** Paging through the result of a query too large to hold at once. The
+    result is stored by the server, and fetched in windows of [chunk] rows
+    with [Ipc], so that the memory used by the client depends on [chunk]
+    rather than on the length of the result. The next window is requested
+    before the current one is converted, on the [prefetch] connection if
+    given, so that the server computes and sends it meanwhile. *)
+module Cursor : sig
+  type t
+
+  (** [create conn query] evaluates [query], which must return a table or a
+      keyed table, and keeps its unkeyed result on the server until the
+      cursor is closed or exhausted. [chunk] defaults to 100000 rows.
+
+      [reuse] (off by default) copies each window into the bigarrays of the
+      first one, so that the memory of a window can be freed as soon as it
+      is decoded. The numeric columns of the tables returned by [next] then
+      alias each other: each window overwrites the previous ones, so copy
+      them to keep them. [prefetch] must be another connection to the same
+      server. *)
+  val create : ?chunk:int -> ?reuse:bool -> ?prefetch:q_conn -> q_conn -> string -> t
 
-external eval_async : q_conn -> string -> unit = "q_eval_async"
+  (** The number of rows of the result *)
+  val length : t -> int
 
-external eval : q_conn -> string -> q_val = "q_eval"
+  (** The next window of rows, as a [Table], or [None] once all rows have
+      been returned, when the cursor is closed. Raises [Q_error] for q
+      errors. *)
+  val next : t -> q_val option
 
-external rpc_async : q_conn -> string -> q_val -> unit = "q_rpc_async"
+  (** The remaining windows. The cursor is closed at the end of the
+      sequence, or when fetching a window raises. *)
+  val to_seq : t -> q_val Seq.t
 
-external rpc : q_conn -> string -> q_val -> q_val = "q_rpc"
+  (** Waits for the windows in flight, and deletes the result on the server.
+      Cursors are closed once their last window has been received. *)
+  val close : t -> unit
+end
 
 
+(** {2 Bulk uploads} *)
 
+(** Uploading a large table in chunks of rows, over several connections at
+    once. Chunks share the bigarrays of the table, and are sent with [Ipc]
+    from them, so the memory of the client does not grow with the table.
+    The server keeps the chunks until they have all arrived, then passes
+    the whole table to a single commit call. *)
+module Upload : sig
+  (** [table conns ~table v] sends the rows of table [v] in chunks of
+      [chunk] rows (default 1000000), each connection of [conns] taking the
+      next chunk with at most [window] (default 4) chunks awaiting the
+      server's acknowledgement. Once all chunks have arrived, it returns the
+      result of [commit[`table; v]] on the server, where [commit] (default
+      [upsert]) is q code for a function of two arguments. The connections
+      must all be to the same server; the first one is used from the
+      calling domain, the others from a domain each. The chunks do not have
+      the attributes of the columns of [v]. Raises [Invalid_argument] if
+      [v] is not an unkeyed table, and [Q_error] for q errors, in which
+      case nothing is committed. *)
+  val table :
+    ?chunk:int -> ?window:int -> ?commit:string -> q_conn array -> table:string -> q_val -> q_val
+end
@@ -0,0 +1,655 @@
+/*
+ * Copyright (c) 2022 Fermin Reig
+ *
+ * q_arrow.c
+ *
+ * Export of q values through the Arrow C data interface. The buffers of
+ * exported arrays point at the bigarrays of the q value where the layouts
+ * agree, and the q value is kept alive until the arrays are released.
+ */
+
+// Uncomment next line to disable assertions
+// #define NDEBUG
+
+#include <assert.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include "q_interface.h"
+
+// The structures of the Arrow C data interface, as specified in
+// https://arrow.apache.org/docs/format/CDataInterface.html
+
+#ifndef ARROW_C_DATA_INTERFACE
+#define ARROW_C_DATA_INTERFACE
+
+#define ARROW_FLAG_DICTIONARY_ORDERED 1
+#define ARROW_FLAG_NULLABLE 2
+#define ARROW_FLAG_MAP_KEYS_SORTED 4
+
+struct ArrowSchema {
+  const char * format;
+  const char * name;
+  const char * metadata;
+  int64_t flags;
+  int64_t n_children;
+  struct ArrowSchema ** children;
+  struct ArrowSchema * dictionary;
+  void (*release)(struct ArrowSchema *);
+  void * private_data;
+};
+
+struct ArrowArray {
+  int64_t length;
+  int64_t null_count;
+  int64_t offset;
+  int64_t n_buffers;
+  int64_t n_children;
+  const void ** buffers;
+  struct ArrowArray ** children;
+  struct ArrowArray * dictionary;
+  void (*release)(struct ArrowArray *);
+  void * private_data;
+};
+
+#endif // ARROW_C_DATA_INTERFACE
+
+#define NANOS_PER_DAY 86400000000000LL
+#define MILLIS_PER_DAY 86400000.0
+
+
+///////////////////////////////////////////////////
+// Lifetime of exported values
+///////////////////////////////////////////////////
+
+// An exported q value, kept alive by a global root while any of its arrays
+// is not released. Arrays may be released from any thread, without the
+// OCaml runtime: the root is then queued, and removed by the next call to
+// arrow_collect.
+
+struct arrow_export {
+  value root;
+  atomic_int refs;               // arrays not yet released
+  struct arrow_export * next;    // in the released queue
+};
+
+static pthread_mutex_t released_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct arrow_export * released = NULL;
+
+static struct arrow_export * arrow_export_create(const value v)
+{
+  struct arrow_export * e = caml_stat_alloc(sizeof(struct arrow_export));
+  e->root = v;
+  atomic_init(&e->refs, 0);
+  e->next = NULL;
+  caml_register_generational_global_root(&e->root);
+  return e;
+}
+
+static void arrow_export_unref(struct arrow_export * e)
+{
+  if(1 == atomic_fetch_sub(&e->refs, 1)) {
+    pthread_mutex_lock(&released_lock);
+    e->next = released;
+    released = e;
+    pthread_mutex_unlock(&released_lock);
+  }
+}
+
+// Free the exported values whose arrays have all been released. Called with
+// the OCaml runtime held.
+static void arrow_collect(void)
+{
+  struct arrow_export * e;
+
+  pthread_mutex_lock(&released_lock);
+  e = released;
+  released = NULL;
+  pthread_mutex_unlock(&released_lock);
+  while(e) {
+    struct arrow_export * next = e->next;
+    caml_remove_generational_global_root(&e->root);
+    caml_stat_free(e);
+    e = next;
+  }
+}
+
+
+///////////////////////////////////////////////////
+// Arrays and schemas
+///////////////////////////////////////////////////
+
+// Note: buffers, children and private data are allocated with malloc, as
+// they are freed by release callbacks that may run without the OCaml runtime.
+
+struct arrow_array_data {
+  struct arrow_export * export;
+  const void * buffers[3];
+  void * owned[3];        // buffers allocated for the export
+};
+
+struct arrow_schema_data {
+  char * name;
+};
+
+static void * arrow_malloc(const size_t size)
+{
+  void * p = calloc(1, size ? size : 1);
+  if(!p) {
+    caml_raise_out_of_memory();
+  }
+  return p;
+}
+
+static void arrow_release_children(struct ArrowArray ** children, const int64_t n)
+{
+  int64_t i;
+  for(i = 0; i < n; i++) {
+    // The consumer may have moved a child, leaving it released
+    if(children[i]->release) {
+      children[i]->release(children[i]);
+    }
+    free(children[i]);
+  }
+  free(children);
+}
+
+static void arrow_array_release(struct ArrowArray * a)
+{
+  struct arrow_array_data * d = a->private_data;
+  int i;
+
+  if(a->children) {
+    arrow_release_children(a->children, a->n_children);
+  }
+  if(a->dictionary) {
+    if(a->dictionary->release) {
+      a->dictionary->release(a->dictionary);
+    }
+    free(a->dictionary);
+  }
+  for(i = 0; i < 3; i++) {
+    free(d->owned[i]);
+  }
+  arrow_export_unref(d->export);
+  free(d);
+  a->release = NULL;
+}
+
+static void arrow_schema_release(struct ArrowSchema * s)
+{
+  struct arrow_schema_data * d = s->private_data;
+  int64_t i;
+
+  for(i = 0; i < s->n_children; i++) {
+    if(s->children[i]->release) {
+      s->children[i]->release(s->children[i]);
+    }
+    free(s->children[i]);
+  }
+  free(s->children);
+  if(s->dictionary) {
+    if(s->dictionary->release) {
+      s->dictionary->release(s->dictionary);
+    }
+    free(s->dictionary);
+  }
+  free(d->name);
+  free(d);
+  s->release = NULL;
+}
+
+static void arrow_schema_init(struct ArrowSchema * s, const char * format, const char * name, const int64_t flags)
+{
+  struct arrow_schema_data * d = arrow_malloc(sizeof(struct arrow_schema_data));
+  if(name) {
+    d->name = arrow_malloc(strlen(name) + 1);
+    strcpy(d->name, name);
+  }
+  s->format = format;
+  s->name = d->name;
+  s->metadata = NULL;
+  s->flags = flags;
+  s->n_children = 0;
+  s->children = NULL;
+  s->dictionary = NULL;
+  s->release = arrow_schema_release;
+  s->private_data = d;
+}
+
+static struct arrow_array_data * arrow_array_init(struct ArrowArray * a, struct arrow_export * e, const int64_t length, const int64_t n_buffers)
+{
+  struct arrow_array_data * d = arrow_malloc(sizeof(struct arrow_array_data));
+  d->export = e;
+  atomic_fetch_add(&e->refs, 1);
+  a->length = length;
+  a->null_count = 0;
+  a->offset = 0;
+  a->n_buffers = n_buffers;
+  a->n_children = 0;
+  a->buffers = d->buffers;
+  a->children = NULL;
+  a->dictionary = NULL;
+  a->release = arrow_array_release;
+  a->private_data = d;
+  return d;
+}
+
+
+///////////////////////////////////////////////////
+// Validity bitmaps
+///////////////////////////////////////////////////
+
+// The validity bitmap of the 'n' values of a vector of type 'ty', or NULL
+// if none is null
+static uint8_t * validity(const int ty, const void * x, const int64_t n, int64_t * null_count)
+{
+  *null_count = q_null_count(ty, x, n);
+  if(0 == *null_count) {
+    return NULL;
+  }
+  uint8_t * bits = arrow_malloc((n + 7) / 8);
+  q_validity_bits(ty, x, n, bits);
+  return bits;
+}
+
+// The null symbol is the empty one, as in q_with_validity
+static uint8_t * symbol_validity(const value strs, const int64_t n, int64_t * null_count)
+{
+  int64_t i;
+  *null_count = 0;
+  for(i = 0; i < n; i++) {
+    *null_count += 0 == caml_string_length(Field(strs, i));
+  }
+  if(0 == *null_count) {
+    return NULL;
+  }
+  uint8_t * bits = arrow_malloc((n + 7) / 8);
+  for(i = 0; i < n; i++) {
+    bits[i / 8] |= (0 != caml_string_length(Field(strs, i))) << (i % 8);
+  }
+  return bits;
+}
+
+// Indices of the empty symbol 'empty' (-1 when it is not in the dictionary)
+// are null
+static uint8_t * symbol_enum_validity(const int32_t * x, const int64_t n, const int32_t empty, int64_t * null_count)
+{
+  int64_t i;
+  *null_count = 0;
+  if(empty < 0) {
+    return NULL;
+  }
+  for(i = 0; i < n; i++) {
+    *null_count += x[i] == empty;
+  }
+  if(0 == *null_count) {
+    return NULL;
+  }
+  uint8_t * bits = arrow_malloc((n + 7) / 8);
+  for(i = 0; i < n; i++) {
+    bits[i / 8] |= (x[i] != empty) << (i % 8);
+  }
+  return bits;
+}
+
+
+///////////////////////////////////////////////////
+// Columns
+///////////////////////////////////////////////////
+
+static inline int64_t bigarray_length(const value arr)
+{
+  return Caml_ba_array_val(arr)->dim[0];
+}
+
+// A column of 'n' strings as a large utf8 array: int64 offsets and chars
+static void arrow_strings(struct arrow_array_data * d, const value strs, const int64_t n)
+{
+  int64_t i, total = 0;
+
+  for(i = 0; i < n; i++) {
+    total += caml_string_length(Field(strs, i));
+  }
+  int64_t * offsets = arrow_malloc((n + 1) * sizeof(int64_t));
+  char * chars = arrow_malloc(total);
+  offsets[0] = 0;
+  for(i = 0; i < n; i++) {
+    const value s = Field(strs, i);
+    memcpy(chars + offsets[i], String_val(s), caml_string_length(s));
+    offsets[i + 1] = offsets[i] + caml_string_length(s);
+  }
+  d->buffers[1] = d->owned[1] = offsets;
+  d->buffers[2] = d->owned[2] = chars;
+}
+
+// Raise Invalid_argument unless 'col' can be exported, before anything is
+// allocated. Returns its length.
+static int64_t arrow_check_column(const value col)
+{
+  if(!Is_block(col)) {
+    caml_invalid_argument("Q.Arrow.export: not a vector");
+  }
+  const value v = Field(col, 0);
+  switch(Tag_val(col)) {
+  case tag_v_valid:
+    return arrow_check_column(v);
+  case tag_v_bool:
+  case tag_v_byte:
+  case tag_v_int16:
+  case tag_v_int32:
+  case tag_v_int64:
+  case tag_v_float32:
+  case tag_v_float64:
+  case tag_v_char:
+  case tag_v_month:
+  case tag_v_date:
+  case tag_v_datetime:
+  case tag_v_minute:
+  case tag_v_second:
+  case tag_v_time:
+  case tag_v_timestamp:
+  case tag_v_timespan:
+    return bigarray_length(v);
+  case tag_v_guid: {
+    const int64_t bytes = bigarray_length(v);
+    if(0 != bytes % 16) {
+      caml_invalid_argument("Q.Arrow.export: GUID vectors must hold 16 bytes per GUID");
+    }
+    return bytes / 16;
+  }
+  case tag_v_symbol_enum: {
+    const struct q_symtab * tab = Symtab_val(Field(col, 1));
+    const int32_t * x = Caml_ba_data_val(v);
+    const int64_t n = bigarray_length(v);
+    int64_t i;
+    for(i = 0; i < n; i++) {
+      if(x[i] < 0 || (uint32_t)x[i] >= tab->count) {
+        caml_invalid_argument("Q.Arrow.export: symbol index out of the dictionary");
+      }
+    }
+    return n;
+  }
+  case tag_v_symbol:
+    return Wosize_val(v);
+  case tag_v_strings:
+    return strings_count(col);
+  default:
+    caml_invalid_argument("Q.Arrow.export: not a vector");
+  }
+}
+
+// Fill 'a' and 's' with vector 'col', of length 'n' as checked by
+// arrow_check_column. Only raises when out of memory.
+static void arrow_column(struct arrow_export * e, const value col, const int64_t n, const char * name, struct ArrowSchema * s, struct ArrowArray * a)
+{
+  static const int64_t no_offsets[1] = { 0 };
+  if(tag_v_valid == Tag_val(col)) {
+    // The validity is recomputed
+    arrow_column(e, Field(col, 0), n, name, s, a);
+    return;
+  }
+  const value v = Field(col, 0);
+  const void * data = Is_block(v) && Custom_tag == Tag_val(v) ? Caml_ba_data_val(v) : NULL;
+  const char * format;
+  int64_t i;
+
+  struct arrow_array_data * d = arrow_array_init(a, e, n, 2);
+  switch(Tag_val(col)) {
+
+  // Same layout: the buffers are the bigarrays
+
+  case tag_v_byte:
+  case tag_v_char:
+    format = "C";
+    d->buffers[1] = data;
+    break;
+  case tag_v_guid:
+    format = "w:16";
+    d->buffers[1] = data;
+    break;
+  case tag_v_int16:
+    format = "s";
+    d->buffers[0] = d->owned[0] = validity(-q_int16, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_int32:
+    format = "i";
+    d->buffers[0] = d->owned[0] = validity(-q_int32, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_int64:
+    format = "l";
+    d->buffers[0] = d->owned[0] = validity(-q_int64, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_float32:
+    format = "f";
+    d->buffers[0] = d->owned[0] = validity(-q_float32, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_float64:
+    format = "g";
+    d->buffers[0] = d->owned[0] = validity(-q_float64, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_second:
+    format = "tts";
+    d->buffers[0] = d->owned[0] = validity(-q_int32, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_time:
+    format = "ttm";
+    d->buffers[0] = d->owned[0] = validity(-q_int32, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_timespan:
+    format = "tDn";
+    d->buffers[0] = d->owned[0] = validity(-q_int64, data, n, &a->null_count);
+    d->buffers[1] = data;
+    break;
+  case tag_v_strings: {
+    const value offsets = Field(col, 1);
+    format = "U";
+    a->n_buffers = 3;
+    d->buffers[1] = bigarray_length(offsets) ? Caml_ba_data_val(offsets) : no_offsets;
+    d->buffers[2] = data;
+    break;
+  }
+
+  // Other layouts or epochs: the values are converted
+
+  case tag_v_bool: {
+    const uint8_t * x = data;
+    uint8_t * bits = arrow_malloc((n + 7) / 8);
+    for(i = 0; i < n; i++) {
+      bits[i / 8] |= (x[i] != 0) << (i % 8);
+    }
+    format = "b";
+    d->buffers[1] = d->owned[1] = bits;
+    break;
+  }
+  // Infinities are kept as the largest and smallest values of their type,
+  // as Q.Time does. The values under nulls are meaningless.
+
+  case tag_v_month:
+  case tag_v_date:
+  case tag_v_minute: {
+    const int32_t * x = data;
+    int32_t * y = arrow_malloc(n * sizeof(int32_t));
+    d->buffers[0] = d->owned[0] = validity(-q_int32, x, n, &a->null_count);
+    if(tag_v_month == Tag_val(col)) {
+      q_months_to_days(x, y, n);
+    } else if(tag_v_date == Tag_val(col)) {
+      q_shift_int32(x, y, n, Q_EPOCH_DAYS);
+    } else {
+      for(i = 0; i < n; i++) {
+        const int32_t v = x[i];
+        const int special = (v == INT32_MIN) | (v == INT32_MAX) | (v == -INT32_MAX);
+        y[i] = special ? v : (int32_t)((uint32_t)v * 60);
+      }
+    }
+    format = tag_v_minute == Tag_val(col) ? "tts" : "tdD";
+    d->buffers[1] = d->owned[1] = y;
+    break;
+  }
+  case tag_v_timestamp: {
+    const int64_t * x = data;
+    int64_t * y = arrow_malloc(n * sizeof(int64_t));
+    d->buffers[0] = d->owned[0] = validity(-q_int64, x, n, &a->null_count);
+    q_shift_int64(x, y, n, Q_EPOCH_DAYS * NANOS_PER_DAY);
+    format = "tsn:";
+    d->buffers[1] = d->owned[1] = y;
+    break;
+  }
+  case tag_v_datetime: {
+    const double * x = data;
+    int64_t * y = arrow_malloc(n * sizeof(int64_t));
+    d->buffers[0] = d->owned[0] = validity(-q_float64, x, n, &a->null_count);
+    for(i = 0; i < n; i++) {
+      // Infinities, and datetimes out of range, saturate
+      const double ms = (x[i] + Q_EPOCH_DAYS) * MILLIS_PER_DAY;
+      y[i] = isnan(ms) ? 0
+        : ms >= 0x1p63 ? INT64_MAX
+        : ms <= -0x1p63 ? -INT64_MAX
+        : llround(ms);
+    }
+    format = "tsm:";
+    d->buffers[1] = d->owned[1] = y;
+    break;
+  }
+  case tag_v_symbol: {
+    format = "U";
+    a->n_buffers = 3;
+    d->buffers[0] = d->owned[0] = symbol_validity(v, n, &a->null_count);
+    arrow_strings(d, v, n);
+    break;
+  }
+
+  // Dictionary encoded: the indices are the bigarray, the dictionary is
+  // copied from the symbol dictionary
+
+  case tag_v_symbol_enum: {
+    const struct q_symtab * tab = Symtab_val(Field(col, 1));
+    format = "i";
+    d->buffers[0] = d->owned[0] =
+      symbol_enum_validity(data, n, q_symtab_lookup(tab, ""), &a->null_count);
+    d->buffers[1] = data;
+    a->dictionary = arrow_malloc(sizeof(struct ArrowArray));
+    struct arrow_array_data * dict = arrow_array_init(a->dictionary, e, tab->count, 3);
+    arrow_strings(dict, tab->strings, tab->count);
+    arrow_schema_init(s, format, name, ARROW_FLAG_NULLABLE);
+    s->dictionary = arrow_malloc(sizeof(struct ArrowSchema));
+    arrow_schema_init(s->dictionary, "U", NULL, 0);
+    return;
+  }
+  default:
+    assert(0);
+  }
+  arrow_schema_init(s, format, name, ARROW_FLAG_NULLABLE);
+}
+
+// The names and columns of table 'tbl' (Val_unit for none), checked to have
+// columns of length 'length' (-1 if not known yet)
+static void arrow_check_table(const value tbl, value * names, value * cols, int64_t * n, int64_t * length)
+{
+  int64_t j;
+
+  if(Val_unit == tbl) {
+    *n = 0;
+    return;
+  }
+  const value t = Field(tbl, 0);
+  if(!Is_block(Field(t, 0)) || tag_v_symbol != Tag_val(Field(t, 0))
+     || !Is_block(Field(t, 1)) || tag_mixed_list != Tag_val(Field(t, 1))) {
+    caml_invalid_argument("Q.Arrow.export: invalid table");
+  }
+  *names = Field(Field(t, 0), 0);
+  *cols = Field(Field(t, 1), 0);
+  *n = Wosize_val(*cols);
+  if((int64_t)Wosize_val(*names) != *n) {
+    caml_invalid_argument("Q.Arrow.export: invalid table");
+  }
+  for(j = 0; j < *n; j++) {
+    const int64_t len = arrow_check_column(Field(*cols, j));
+    if(*length >= 0 && len != *length) {
+      caml_invalid_argument("Q.Arrow.export: columns of different lengths");
+    }
+    *length = len;
+  }
+}
+
+static int is_table(const value v)
+{
+  return Is_block(v) && tag_table == Tag_val(v);
+}
+
+
+///////////////////////////////////////////////////
+// Exported Caml functions
+///////////////////////////////////////////////////
+
+// Fill the ArrowSchema and ArrowArray at addresses 'schema' and 'array' with
+// a table, a keyed table or a vector. A table is exported as a struct array
+// with a child per column, the key columns of a keyed table first.
+CAMLprim value q_arrow_export(value v, value schema, value array)
+{
+  CAMLparam3(v, schema, array);
+  struct ArrowSchema * s = (struct ArrowSchema *)Nativeint_val(schema);
+  struct ArrowArray * a = (struct ArrowArray *)Nativeint_val(array);
+  value parts[2], names[2], cols[2];
+  int64_t n[2], length = -1, j, k = 0;
+  int p;
+
+  arrow_collect();
+  if(!s || !a) {
+    caml_invalid_argument("Q.Arrow.export: null pointer");
+  }
+  if(is_table(v)) {
+    parts[0] = v;
+    parts[1] = Val_unit;
+  } else if(Is_block(v) && tag_dict == Tag_val(v)
+            && is_table(Field(Field(v, 0), 0)) && is_table(Field(Field(v, 0), 1))) {
+    parts[0] = Field(Field(v, 0), 0);
+    parts[1] = Field(Field(v, 0), 1);
+  } else {
+    length = arrow_check_column(v);
+    struct arrow_export * e = arrow_export_create(v);
+    arrow_column(e, v, length, NULL, s, a);
+    CAMLreturn(Val_unit);
+  }
+  // Check everything first: below, only running out of memory raises.
+  // Nothing below allocates in the OCaml heap, so the columns do not move.
+  for(p = 0; p < 2; p++) {
+    arrow_check_table(parts[p], &names[p], &cols[p], &n[p], &length);
+  }
+  struct arrow_export * e = arrow_export_create(v);
+  arrow_schema_init(s, "+s", NULL, 0);
+  arrow_array_init(a, e, length < 0 ? 0 : length, 1);
+  s->n_children = a->n_children = n[0] + n[1];
+  s->children = arrow_malloc(s->n_children * sizeof(struct ArrowSchema *));
+  a->children = arrow_malloc(a->n_children * sizeof(struct ArrowArray *));
+  for(p = 0; p < 2; p++) {
+    for(j = 0; j < n[p]; j++, k++) {
+      s->children[k] = arrow_malloc(sizeof(struct ArrowSchema));
+      a->children[k] = arrow_malloc(sizeof(struct ArrowArray));
+      arrow_column(e, Field(cols[p], j), length, String_val(Field(names[p], j)), s->children[k], a->children[k]);
+    }
+  }
+  CAMLreturn(Val_unit);
+}
+
+// Free the q values of the arrays released since the last export
+CAMLprim value q_arrow_collect(value unit)
+{
+  arrow_collect();
+  return Val_unit;
+}
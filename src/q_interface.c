@@ -8,27 +8,181 @@
 // #define NDEBUG
 
 #include <assert.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <poll.h>
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
 #include <caml/custom.h>
 #include <caml/fail.h>
 #include <caml/bigarray.h>
+#include <caml/signals.h>
 #include "q_interface.h"
 
 // forward declarations
 
-static value q_to_ocaml(const K q_val);
+static value q_to_ocaml(const struct q_decode_ctx * ctx, const K q_val);
 static K ocaml_to_q(const value v);
 
 
+///////////////////////////////////////////////////
+// Symbol dictionaries
+///////////////////////////////////////////////////
+
+// A symbol dictionary interns every distinct symbol it is given once, and
+// numbers symbols in order of first appearance (see struct q_symtab).
+
+static inline uint32_t q_symtab_hash(const char * s) {
+  // FNV-1a
+  uint32_t h = 2166136261u;
+  for (; *s; s++) {
+    h = (h ^ (unsigned char)*s) * 16777619u;
+  }
+  return h;
+}
+
+// The slot holding 's', or the free slot where it would be inserted
+static uint32_t * q_symtab_slot(const struct q_symtab * tab, const char * s, const uint32_t h) {
+  uint32_t i = h & tab->mask;
+  while (tab->slots[i]) {
+    const uint32_t idx = tab->slots[i] - 1;
+    if (tab->hashes[idx] == h && 0 == strcmp(q_symtab_string(tab, idx), s)) {
+      break;
+    }
+    i = (i + 1) & tab->mask;
+  }
+  return &tab->slots[i];
+}
+
+// The index of symbol 's', or -1 if it is not in the dictionary
+int32_t q_symtab_lookup(const struct q_symtab * tab, const char * s) {
+  return (int32_t)*q_symtab_slot(tab, s, q_symtab_hash(s)) - 1;
+}
+
+static void q_symtab_grow(struct q_symtab * tab) {
+  CAMLparam0 ();
+  CAMLlocal1 (strings);
+
+  // Strings
+  const mlsize_t capacity = Wosize_val(tab->strings);
+  if (tab->count == capacity) {
+    strings = caml_alloc(2 * capacity, 0);
+    for (mlsize_t i = 0; i < capacity; i++) {
+      Store_field(strings, i, Field(tab->strings, i));
+    }
+    caml_modify_generational_global_root(&tab->strings, strings);
+    uint32_t * hashes = realloc(tab->hashes, 2 * capacity * sizeof(uint32_t));
+    if (!hashes) {
+      caml_raise_out_of_memory();
+    }
+    tab->hashes = hashes;
+  }
+  // Hash table, kept at most half full
+  if (2 * (tab->count + 1) > tab->mask + 1) {
+    const uint32_t size = 2 * (tab->mask + 1);
+    uint32_t * slots = calloc(size, sizeof(uint32_t));
+    if (!slots) {
+      caml_raise_out_of_memory();
+    }
+    free(tab->slots);
+    tab->slots = slots;
+    tab->mask = size - 1;
+    for (uint32_t idx = 0; idx < tab->count; idx++) {
+      uint32_t i = tab->hashes[idx] & tab->mask;
+      while (tab->slots[i]) {
+        i = (i + 1) & tab->mask;
+      }
+      tab->slots[i] = idx + 1;
+    }
+  }
+  CAMLreturn0;
+}
+
+// The index of symbol 's', which is added to the dictionary if needed.
+// 's' must not point into the OCaml heap, as this may trigger a GC.
+int32_t q_symtab_intern(struct q_symtab * tab, const char * s) {
+  const uint32_t h = q_symtab_hash(s);
+  uint32_t * slot = q_symtab_slot(tab, s, h);
+  if (*slot) {
+    return (int32_t)(*slot - 1);
+  }
+  if (tab->count == INT32_MAX) {
+    caml_failwith("symbol dictionary is full");
+  }
+  if (tab->count == Wosize_val(tab->strings) || 2 * (tab->count + 1) > tab->mask + 1) {
+    q_symtab_grow(tab);
+    slot = q_symtab_slot(tab, s, h);
+  }
+  const uint32_t idx = tab->count;
+  // Allocate first: caml_copy_string may trigger a GC
+  value str = caml_copy_string(s);
+  caml_modify(&Field(tab->strings, idx), str);
+  tab->hashes[idx] = h;
+  *slot = idx + 1;
+  tab->count++;
+  return (int32_t)idx;
+}
+
+static void q_symtab_finalize(value v) {
+  struct q_symtab * tab = Symtab_val(v);
+  caml_remove_generational_global_root(&tab->strings);
+  free(tab->hashes);
+  free(tab->slots);
+  free(tab);
+}
+
+// Dictionaries are compared by identity
+static int q_symtab_compare(value v1, value v2) {
+  const struct q_symtab * t1 = Symtab_val(v1);
+  const struct q_symtab * t2 = Symtab_val(v2);
+  return (t1 > t2) - (t1 < t2);
+}
+
+static intnat q_symtab_hash_custom(value v) {
+  return (intnat)(uintptr_t)Symtab_val(v);
+}
+
+static struct custom_operations q_symtab_ops = {
+  "q.sym_dict",
+  q_symtab_finalize,
+  q_symtab_compare,
+  q_symtab_hash_custom,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+// Set up decoding options from 'dict_opt', a sym_dict option. 'sym_dict'
+// must be a registered root of the caller, used to hold the dictionary.
+void decode_ctx_init(struct q_decode_ctx * ctx, const value dict_opt, const int packed_strings, value * sym_dict) {
+  ctx->packed_strings = packed_strings;
+  ctx->stats = NULL;
+  ctx->validity = 0;
+  *sym_dict = dict_opt;
+  if (Is_block(*sym_dict)) {
+    *sym_dict = Field(*sym_dict, 0); // Some dict
+    ctx->symtab = Symtab_val(*sym_dict);
+    ctx->sym_dict = sym_dict;
+  } else {
+    ctx->symtab = NULL;
+    ctx->sym_dict = NULL;
+  }
+}
+
+
 ///////////////////////////////////////////////////
 // Functions to convert kdb+ values to OCaml values
 ///////////////////////////////////////////////////
 
-static value mk_caml_value(const int tag, value v) {
+value mk_caml_value(const int tag, value v) {
   CAMLparam1(v);
   CAMLlocal1(result);
 
@@ -37,7 +191,7 @@ static value mk_caml_value(const int tag, value v) {
   CAMLreturn(result);
 }
 
-static value mk_caml_value_two(const int tag, value v, value attrib) {
+value mk_caml_value_two(const int tag, value v, value attrib) {
   CAMLparam2(v, attrib);
   CAMLlocal1(result);
 
@@ -51,55 +205,103 @@ static value mk_caml_value_two(const int tag, value v, value attrib) {
 }
 
 
-static value mk_caml_dict(const K q_val) {
+// Note: the fields are converted before the record is stored into, as
+// q_to_ocaml may cause a GC and move the record.
+
+static value mk_caml_dict(const struct q_decode_ctx * ctx, const K q_val) {
   CAMLparam0 ();
-  CAMLlocal1 (result);
+  CAMLlocal3 (result, keys, values);
 
+  keys = q_to_ocaml(ctx, kK(q_val)[0]);
+  values = q_to_ocaml(ctx, kK(q_val)[1]);
   result = caml_alloc(3, 0);
-  K keys = kK(q_val)[0];
-  K values = kK(q_val)[1];
-  Store_field(result, 0, q_to_ocaml(keys));
-  Store_field(result, 1, q_to_ocaml(values));
+  Store_field(result, 0, keys);
+  Store_field(result, 1, values);
   Store_field(result, 2, Val_int(q_val->u)); // Atribute
   CAMLreturn (mk_caml_value(tag_dict, result));
   }
 
-static value mk_caml_table(const K q_val) {
+static value mk_caml_table(const struct q_decode_ctx * ctx, const K q_val) {
   CAMLparam0 ();
-  CAMLlocal1 (tbl);
+  CAMLlocal3 (tbl, colnames, cols);
 
+  // Column names are always symbols, never enumerated
+  colnames = q_to_ocaml(NULL, kK(q_val->k)[0]);
+  cols = q_to_ocaml(ctx, kK(q_val->k)[1]);
   tbl = caml_alloc(3, 0);
-  Store_field(tbl, 0, q_to_ocaml(kK(q_val->k)[0]));
-  Store_field(tbl, 1, q_to_ocaml(kK(q_val->k)[1]));
+  Store_field(tbl, 0, colnames);
+  Store_field(tbl, 1, cols);
   Store_field(tbl, 2, Val_int(q_val->u)); // Attribute
   CAMLreturn (mk_caml_value(tag_table, tbl));
 }
 
+// Vectors are returned to OCaml without copying: the bigarray points at the
+// data of the K vector and holds a reference to it (r1), which is released
+// (r0) by the finalizer when the bigarray is collected. The K reply can then
+// be freed as soon as it has been converted.
+//
+// Owned bigarrays are ordinary bigarrays except for their finalizer.
+// They are flagged as managed, so that views of them (Array1.sub, slice,
+// reshape) share a reference counted proxy with the original, and inherit
+// its finalizer. The K vector is released with the last of them.
+
+static struct custom_operations q_ba_ops; // initialised by q_init
+
+static inline K q_vector_of_data(void * data) {
+  return (K)((char *)data - offsetof(struct k0, G0));
+}
+
+static void q_ba_finalize(value arr) {
+  struct caml_ba_array * ba = Caml_ba_array_val(arr);
+  if(NULL == ba->proxy) {
+    r0(q_vector_of_data(ba->data));
+  } else if(1 == atomic_fetch_sub(&ba->proxy->refcount, 1)) {
+    r0(q_vector_of_data(ba->proxy->data));
+    free(ba->proxy);
+  }
+}
+
+static value mk_owned_bigarray(const int arr_ty, const K q_val) {
+  CAMLparam0 ();
+  CAMLlocal1 (arr);
+
+  // GUID vectors are packed bytes, 16 per GUID
+  const intnat dim = (UU == q_val->t) ? 16 * q_val->n : q_val->n;
+  const uintnat bytes = dim * caml_ba_element_size[arr_ty];
+  arr = caml_alloc_custom_mem(&q_ba_ops,
+                              sizeof(struct caml_ba_array) + sizeof(intnat),
+                              bytes);
+  struct caml_ba_array * ba = Caml_ba_array_val(arr);
+  ba->data = kG(q_val);
+  ba->num_dims = 1;
+  ba->flags = arr_ty | CAML_BA_C_LAYOUT | CAML_BA_MANAGED;
+  ba->proxy = NULL;
+  ba->dim[0] = dim;
+  r1(q_val);
+  CAMLreturn (arr);
+}
+
 static value mk_caml_byte_array(const int caml_tag, const K q_val) {
   CAMLparam0 ();
   CAMLlocal2 (attrib, arr);
 
-  long dims[1];
-  dims[0] = q_val->n;
   attrib = Val_int(q_val->u);
-  arr = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, kG(q_val), dims);
+  arr = mk_owned_bigarray(CAML_BA_UINT8, q_val);
   CAMLreturn (mk_caml_value_two(caml_tag, arr, attrib));
 }
 
-static value mk_caml_scalar_array(const int caml_tag, const int arr_ty, void * data, const K q_val) {
+static value mk_caml_scalar_array(const int caml_tag, const int arr_ty, const K q_val) {
   CAMLparam0 ();
   CAMLlocal2 (attrib, arr);
 
-  long dims[1];
-  dims[0] = q_val->n;
   attrib = Val_int(q_val->u);
-  arr = caml_ba_alloc(arr_ty | CAML_BA_C_LAYOUT, 1, data, dims);
+  arr = mk_owned_bigarray(arr_ty, q_val);
   CAMLreturn (mk_caml_value_two(caml_tag, arr, attrib));
 }
 
 
 // See also mk_caml_string_array_helper
-static value mk_caml_array(const K q_val)
+static value mk_caml_array(const struct q_decode_ctx * ctx, const K q_val)
 {
   // Note: this is largely the same as the funcion caml_alloc_array in the caml
   // RTS (alloc.c)
@@ -118,26 +320,25 @@ static value mk_caml_array(const K q_val)
       /* The two statements below must be separate because of evaluation
          order (don't take the address &Field(result, i) before
          calling q_to_ocaml, which may cause a GC and move result). */
-      v = q_to_ocaml(q_elems[i]);
+      v = q_to_ocaml(ctx, q_elems[i]);
       caml_modify(&Field(result, i), v);
     }
     CAMLreturn (result);
   }
 }
 
-// See also mk_caml_array
-static value mk_caml_string_array_helper(const K q_val) {
+// The 'size' symbols of 'q_val' from 'start'. See also mk_caml_array
+static value mk_caml_string_range(const K q_val, const unsigned long start, const unsigned long size) {
   CAMLparam0 ();
   CAMLlocal2 (v, result);
 
   assert(q_val->t > 0);
 
-  const unsigned long size = q_val->n;
   if(0 == size) {
     CAMLreturn(Atom(0));
   } else {
     result = caml_alloc(size, 0);
-    char **q_arr = kS(q_val);
+    char **q_arr = kS(q_val) + start;
     unsigned long i;
     for (i = 0; i < size ; i++) {
       // The two statements below must be separate because of evaluation
@@ -150,6 +351,10 @@ static value mk_caml_string_array_helper(const K q_val) {
   }
 }
 
+static value mk_caml_string_array_helper(const K q_val) {
+  return mk_caml_string_range(q_val, 0, q_val->n);
+}
+
 static value mk_caml_string_array(const K q_val) {
   CAMLparam0 ();
   CAMLlocal2 (attrib, arr);
@@ -159,6 +364,71 @@ static value mk_caml_string_array(const K q_val) {
   CAMLreturn (mk_caml_value_two(tag_v_symbol, arr, attrib));
 }
 
+// Symbol vector as indices into the connection's symbol dictionary
+static value mk_caml_symbol_enum(const struct q_decode_ctx * ctx, const K q_val) {
+  CAMLparam0 ();
+  CAMLlocal2 (arr, result);
+
+  intnat dims[1];
+  dims[0] = q_val->n;
+  arr = caml_ba_alloc(CAML_BA_INT32 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  int32_t * indices = Caml_ba_data_val(arr);
+  S * syms = kS(q_val);
+  J i;
+  for (i = 0; i < q_val->n; i++) {
+    indices[i] = q_symtab_intern(ctx->symtab, syms[i]);
+  }
+  result = caml_alloc(3, tag_v_symbol_enum);
+  Store_field(result, 0, arr);
+  Store_field(result, 1, *ctx->sym_dict);
+  Store_field(result, 2, Val_int(q_val->u)); // Attribute
+  CAMLreturn (result);
+}
+
+// A list of strings as V_strings: one char bigarray holding the strings one
+// after the other, and an int64 bigarray of the n + 1 offsets at which they
+// start and end
+static int is_string_list(const K q_val) {
+  J i;
+  if (0 == q_val->n) {
+    return 0;
+  }
+  for (i = 0; i < q_val->n; i++) {
+    if (KC != kK(q_val)[i]->t) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static value mk_caml_strings(const K q_val) {
+  CAMLparam0 ();
+  CAMLlocal3 (chars, offsets, result);
+
+  K * strs = kK(q_val);
+  intnat dims[1];
+  J i, total = 0;
+
+  for (i = 0; i < q_val->n; i++) {
+    total += strs[i]->n;
+  }
+  dims[0] = total;
+  chars = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  dims[0] = q_val->n + 1;
+  offsets = caml_ba_alloc(CAML_BA_INT64 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  unsigned char * data = Caml_ba_data_val(chars);
+  int64_t * offs = Caml_ba_data_val(offsets);
+  offs[0] = 0;
+  for (i = 0; i < q_val->n; i++) {
+    memcpy(data + offs[i], kG(strs[i]), strs[i]->n);
+    offs[i + 1] = offs[i] + strs[i]->n;
+  }
+  result = caml_alloc(2, tag_v_strings);
+  Store_field(result, 0, chars);
+  Store_field(result, 1, offsets);
+  CAMLreturn (result);
+}
+
 
 static int tag_for_scalar(const int ty) {
   switch(ty){
@@ -185,7 +455,7 @@ static int tag_for_scalar64(const int ty) {
   }
 }
 
-static int tag_for_vector(const int ty) {
+int tag_for_vector(const int ty) {
   switch(ty){
   case (-q_bool):      return tag_v_bool;
   case (-q_byte):      return tag_v_byte;
@@ -211,9 +481,12 @@ static int tag_for_vector(const int ty) {
 }
 
 
-// Convert K->OCaml
-static value q_to_ocaml(const K q_val) {
+// Convert K->OCaml, without the validity of vectors
+static value q_to_ocaml_value(const struct q_decode_ctx * ctx, const K q_val) {
   const H q_type = q_val->t; 
+  if(ctx && ctx->stats) {
+    ctx->stats->objects[(unsigned char)q_type]++;
+  }
   switch(q_type) {
 
   // Scalars
@@ -256,7 +529,8 @@ static value q_to_ocaml(const K q_val) {
     return (mk_caml_value(tag_symbol, caml_copy_string(q_val->s)));
   }
   case q_guid: {
-    return (mk_caml_value(tag_guid, caml_copy_string((kU(q_val))->g)));
+    // Not caml_copy_string: GUIDs may contain NUL bytes
+    return (mk_caml_value(tag_guid, caml_alloc_initialized_string(16, (char *)kU(q_val)->g)));
   }
   case q_datetime: {
     return (mk_caml_value(tag_datetime, caml_copy_double(q_val->f)));
@@ -266,11 +540,12 @@ static value q_to_ocaml(const K q_val) {
 
   case (-q_bool): 
   case (-q_byte): 
-  case (-q_char): {
+  case (-q_char): 
+  case (-q_guid): {
     return (mk_caml_byte_array(tag_for_vector(q_type), q_val));
   }
   case (-q_int16): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_UINT16, kH(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_UINT16, q_val); 
   }
   case (-q_int32):
   case (-q_month): 
@@ -278,49 +553,52 @@ static value q_to_ocaml(const K q_val) {
   case (-q_minute):
   case (-q_second):
   case (-q_time): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_INT32, kI(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_INT32, q_val); 
   }
   case (-q_int64):
   case (-q_timestamp):  
   case (-q_timespan): 
   {
-    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_INT64, kJ(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_INT64, q_val); 
   }
   case (-q_float32): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_FLOAT32, kE(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_FLOAT32, q_val); 
   }
   case (-q_float64): 
   case (-q_datetime): {
-    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_FLOAT64, kF(q_val), q_val); 
+    return mk_caml_scalar_array(tag_for_vector(q_type), CAML_BA_FLOAT64, q_val); 
   }
   case (-q_symbol): {
+    if (ctx && ctx->symtab) {
+      return mk_caml_symbol_enum(ctx, q_val);
+    }
     return mk_caml_string_array(q_val);
   }
 
   // Mixed lists
 
   case q_mixed_list: {
-    return (mk_caml_value(tag_mixed_list, mk_caml_array(q_val)));;
+    if (ctx && ctx->packed_strings && is_string_list(q_val)) {
+      return mk_caml_strings(q_val);
+    }
+    return (mk_caml_value(tag_mixed_list, mk_caml_array(ctx, q_val)));;
   }
 
   // Tables
 
   case q_table:{
-    return (mk_caml_table(q_val));
+    return (mk_caml_table(ctx, q_val));
   }
 
   // Dictionaries
 
   case q_dict: {
-    return (mk_caml_dict(q_val));
+    return (mk_caml_dict(ctx, q_val));
   }
 
   case q_unit: {
     return (Val_int(tag_unit));
   }
-  case (-q_guid): {
-    caml_failwith("Not yet supported: guid vector");
-  }
   case q_lambda: {
     caml_failwith("Not supported: lambda (type 100)");
   }
@@ -331,7 +609,7 @@ static value q_to_ocaml(const K q_val) {
     caml_failwith("Not supported: partial application (type 104)");
   }
   case q_error: {
-      caml_failwith(q_val->s);
+      q_raise_error(caml_copy_string(q_val->s));
   }
   default: {
     fprintf(stderr, "internal error: q_to_ocaml impossible q type %i\n", q_type);
@@ -340,6 +618,13 @@ static value q_to_ocaml(const K q_val) {
   }
 }
 
+// Convert K->OCaml
+// 'ctx' may be NULL, for default decoding
+static value q_to_ocaml(const struct q_decode_ctx * ctx, const K q_val) {
+  const value v = q_to_ocaml_value(ctx, q_val);
+  return (ctx && ctx->validity) ? q_with_validity(v) : v;
+}
+
 ///////////////////////////////////////////////////
 // Functions to convert OCaml values to kdb+ values
 ///////////////////////////////////////////////////
@@ -369,11 +654,13 @@ static int tag_to_type(const int tag) {
   }
 }
 
-static int tag_to_v_type(const int tag) {
+int tag_to_v_type(const int tag) {
   switch(tag){
   case tag_v_bool:      return (-q_bool);
   case tag_v_byte:      return (-q_byte);
+  case tag_v_int16:     return (-q_int16);
   case tag_v_int32:     return (-q_int32);
+  case tag_v_int64:     return (-q_int64);
   case tag_v_float32:   return (-q_float32);
   case tag_v_float64:   return (-q_float64);
   case tag_v_char:      return (-q_char);
@@ -405,7 +692,7 @@ static K mk_scalar_vector(const unsigned elem_size, const int ty, const value v)
   const long size = Caml_ba_array_val(arr)->dim[0];
   K list = ktn(ty, size);
   list->u = (short)Int_val(Field(v,1)); // Attribute
-  memcpy(list->G0, Caml_ba_array_val(arr), size * elem_size);
+  memcpy(list->G0, Caml_ba_data_val(arr), size * elem_size);
   return list;
 }
 
@@ -442,11 +729,42 @@ static K mk_char_vector(const int ty, const value v) {
   assert (Is_block(arr));
   assert (1 == Caml_ba_array_val(arr)->num_dims);
 
-  K vec = kp((unsigned char *)Caml_ba_data_val(arr));
+  // Not kp: the bigarray is not NUL terminated, and may hold NULs
+  const long size = Caml_ba_array_val(arr)->dim[0];
+  K vec = ktn(ty, size);
   vec->u = (short)Int_val(Field(v,1)); // Attribute
+  memcpy(kG(vec), Caml_ba_data_val(arr), size);
   return vec;
 }
 
+static K mk_guid(const value v) {
+  if(16 != caml_string_length(v)) {
+    caml_invalid_argument("ocaml_to_q: a GUID must be 16 bytes");
+  }
+  U g;
+  memcpy(g.g, String_val(v), 16);
+  return ku(g);
+}
+
+// GUID vectors are packed bytes, 16 per GUID, copied with a single memcpy
+static K mk_guid_vector(const value v) {
+  assert (Is_block(v));
+
+  const value arr = Field(v,0);
+
+  assert (Is_block(arr));
+  assert (1 == Caml_ba_array_val(arr)->num_dims);
+
+  const long bytes = Caml_ba_array_val(arr)->dim[0];
+  if(0 != bytes % 16) {
+    caml_invalid_argument("ocaml_to_q: GUID vectors must hold 16 bytes per GUID");
+  }
+  K list = ktn(UU, bytes / 16);
+  list->u = (short)Int_val(Field(v,1)); // Attribute
+  memcpy(kG(list), Caml_ba_data_val(arr), bytes);
+  return list;
+}
+
 
 static K mk_symbol_vector(const value v) {
   assert (Is_block(v));
@@ -466,6 +784,235 @@ static K mk_symbol_vector(const value v) {
 }
 
 
+static K mk_symbol_enum_vector(const value v) {
+  assert (Is_block(v));
+
+  const value arr = Field(v, 0);
+  const struct q_symtab * tab = Symtab_val(Field(v, 1));
+
+  assert (1 == Caml_ba_array_val(arr)->num_dims);
+
+  const long count = Caml_ba_array_val(arr)->dim[0];
+  const int32_t * indices = Caml_ba_data_val(arr);
+  K list = ktn(KS, count);
+  long i;
+  for(i=0; i<count; i++) {
+    if(indices[i] < 0 || (uint32_t)indices[i] >= tab->count) {
+      r0(list);
+      caml_invalid_argument("ocaml_to_q: symbol index out of the dictionary");
+    }
+    kS(list)[i] = ss((S)q_symtab_string(tab, indices[i]));
+  }
+  list->u = (short)Int_val(Field(v, 2)); // Attribute
+  return list;
+}
+
+
+// Number of strings of V_strings 'v'. Raises Invalid_argument unless its
+// offsets are within the chars and ascending
+size_t strings_count(const value v) {
+  const value chars = Field(v, 0);
+  const value offsets = Field(v, 1);
+  const intnat len = Caml_ba_array_val(chars)->dim[0];
+  const intnat n = Caml_ba_array_val(offsets)->dim[0];
+  const int64_t * offs = Caml_ba_data_val(offsets);
+  intnat i;
+
+  if (0 == n) {
+    return 0;
+  }
+  if (offs[0] < 0 || offs[n - 1] > len) {
+    caml_invalid_argument("V_strings: offset out of the chars");
+  }
+  for (i = 1; i < n; i++) {
+    if (offs[i] < offs[i - 1]) {
+      caml_invalid_argument("V_strings: descending offsets");
+    }
+  }
+  return n - 1;
+}
+
+
+///////////////////////////////////////////////////
+// Nulls
+///////////////////////////////////////////////////
+
+// The loops below have no branches, so that the compiler vectorizes them.
+// Bitmaps are built a byte (eight elements) at a time.
+
+#define NULL_KERNELS(name, type, is_null)                                   \
+  static int64_t name##_count(const type * x, const int64_t n)              \
+  {                                                                         \
+    int64_t i, nulls = 0;                                                   \
+    for(i = 0; i < n; i++) {                                                \
+      nulls += is_null(x[i]);                                               \
+    }                                                                       \
+    return nulls;                                                           \
+  }                                                                         \
+  static void name##_bits(const type * x, const int64_t n, uint8_t * bits)  \
+  {                                                                         \
+    int64_t i, j;                                                           \
+    for(i = 0; i + 8 <= n; i += 8) {                                        \
+      uint8_t byte = 0;                                                     \
+      for(j = 0; j < 8; j++) {                                              \
+        byte |= (!is_null(x[i + j])) << j;                                  \
+      }                                                                     \
+      bits[i / 8] = byte;                                                   \
+    }                                                                       \
+    if(i < n) {                                                             \
+      uint8_t byte = 0;                                                     \
+      for(j = 0; i + j < n; j++) {                                          \
+        byte |= (!is_null(x[i + j])) << j;                                  \
+      }                                                                     \
+      bits[i / 8] = byte;                                                   \
+    }                                                                       \
+  }
+
+#define INT16_NULL(v) ((v) == INT16_MIN)
+#define INT32_NULL(v) ((v) == INT32_MIN)
+#define INT64_NULL(v) ((v) == INT64_MIN)
+#define FLOAT_NULL(v) isnan(v)
+
+NULL_KERNELS(nulls_int16, int16_t, INT16_NULL)
+NULL_KERNELS(nulls_int32, int32_t, INT32_NULL)
+NULL_KERNELS(nulls_int64, int64_t, INT64_NULL)
+NULL_KERNELS(nulls_float32, float, FLOAT_NULL)
+NULL_KERNELS(nulls_float64, double, FLOAT_NULL)
+
+int64_t q_null_count(const int ty, const void * x, const int64_t n) {
+  switch(ty) {
+  case (-q_int16):
+    return nulls_int16_count(x, n);
+  case (-q_int32): case (-q_month): case (-q_date):
+  case (-q_minute): case (-q_second): case (-q_time):
+    return nulls_int32_count(x, n);
+  case (-q_int64): case (-q_timestamp): case (-q_timespan):
+    return nulls_int64_count(x, n);
+  case (-q_float32):
+    return nulls_float32_count(x, n);
+  case (-q_float64): case (-q_datetime):
+    return nulls_float64_count(x, n);
+  default:
+    return 0;
+  }
+}
+
+void q_validity_bits(const int ty, const void * x, const int64_t n, uint8_t * bits) {
+  switch(ty) {
+  case (-q_int16):
+    nulls_int16_bits(x, n, bits);
+    break;
+  case (-q_int32): case (-q_month): case (-q_date):
+  case (-q_minute): case (-q_second): case (-q_time):
+    nulls_int32_bits(x, n, bits);
+    break;
+  case (-q_int64): case (-q_timestamp): case (-q_timespan):
+    nulls_int64_bits(x, n, bits);
+    break;
+  case (-q_float32):
+    nulls_float32_bits(x, n, bits);
+    break;
+  case (-q_float64): case (-q_datetime):
+    nulls_float64_bits(x, n, bits);
+    break;
+  default:
+    memset(bits, 0xff, (n + 7) / 8);
+  }
+}
+
+// V_valid of vector 'vec' and its validity { bitmap; null_count }. The
+// bitmap is empty when no element is null. Other values are returned as
+// they are.
+value q_with_validity(value vec) {
+  CAMLparam1 (vec);
+  CAMLlocal3 (bitmap, validity, result);
+  int64_t n, nulls = 0;
+  int64_t i;
+  int32_t empty = -1;
+
+  if(!Is_block(vec)) {
+    CAMLreturn (vec);
+  }
+  const int tag = Tag_val(vec);
+  switch(tag) {
+  case tag_v_int16: case tag_v_int32: case tag_v_int64:
+  case tag_v_float32: case tag_v_float64:
+  case tag_v_month: case tag_v_date: case tag_v_datetime:
+  case tag_v_minute: case tag_v_second: case tag_v_time:
+  case tag_v_timestamp: case tag_v_timespan:
+    n = Caml_ba_array_val(Field(vec, 0))->dim[0];
+    nulls = q_null_count(tag_to_v_type(tag), Caml_ba_data_val(Field(vec, 0)), n);
+    break;
+  case tag_v_symbol:
+    // The null symbol is the empty one
+    n = Wosize_val(Field(vec, 0));
+    for(i = 0; i < n; i++) {
+      nulls += 0 == caml_string_length(Field(Field(vec, 0), i));
+    }
+    break;
+  case tag_v_symbol_enum: {
+    // The null symbol is the index of the empty one, if it is in the
+    // dictionary at all
+    const int32_t * idx = Caml_ba_data_val(Field(vec, 0));
+    n = Caml_ba_array_val(Field(vec, 0))->dim[0];
+    empty = q_symtab_lookup(Symtab_val(Field(vec, 1)), "");
+    if(empty >= 0) {
+      for(i = 0; i < n; i++) {
+        nulls += idx[i] == empty;
+      }
+    }
+    break;
+  }
+  default:
+    CAMLreturn (vec);
+  }
+
+  intnat dims[1];
+  dims[0] = nulls ? (n + 7) / 8 : 0;
+  bitmap = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  if(nulls) {
+    uint8_t * bits = Caml_ba_data_val(bitmap);
+    if(tag_v_symbol == tag) {
+      memset(bits, 0, dims[0]);
+      for(i = 0; i < n; i++) {
+        bits[i / 8] |= (0 != caml_string_length(Field(Field(vec, 0), i))) << (i % 8);
+      }
+    } else if(tag_v_symbol_enum == tag) {
+      const int32_t * idx = Caml_ba_data_val(Field(vec, 0));
+      memset(bits, 0, dims[0]);
+      for(i = 0; i < n; i++) {
+        bits[i / 8] |= (idx[i] != empty) << (i % 8);
+      }
+    } else {
+      q_validity_bits(tag_to_v_type(tag), Caml_ba_data_val(Field(vec, 0)), n, bits);
+    }
+  }
+  validity = caml_alloc_tuple(2);
+  Store_field(validity, 0, bitmap);
+  Store_field(validity, 1, Val_long(nulls));
+  result = caml_alloc(2, tag_v_valid);
+  Store_field(result, 0, vec);
+  Store_field(result, 1, validity);
+  CAMLreturn (result);
+}
+
+static K mk_string_list(const value v) {
+  assert (Is_block(v));
+
+  const size_t count = strings_count(v);
+  const unsigned char * chars = Caml_ba_data_val(Field(v, 0));
+  const int64_t * offs = Caml_ba_data_val(Field(v, 1));
+  K list = ktn(0, count);
+  size_t i;
+  for(i=0; i<count; i++) {
+    K str = ktn(KC, offs[i + 1] - offs[i]);
+    memcpy(kG(str), chars + offs[i], str->n);
+    kK(list)[i] = str;
+  }
+  return list;
+}
+
+
 static K mk_mixed_list(const value v) {
   assert (Is_block(v));
 
@@ -524,6 +1071,9 @@ static K ocaml_to_q(const value val)
       // Note: intern the string to create the symbol
       return ks(ss((unsigned char *)String_val(v)));
     }
+    case tag_guid: {
+      return mk_guid(v);
+    }
     case tag_month: 
     case tag_minute:
     case tag_second: {
@@ -569,8 +1119,6 @@ static K ocaml_to_q(const value val)
     }
     case tag_v_char: {
       return mk_char_vector(tag_to_v_type(tag), val);
-      //K arr = kp((unsigned char *)Data_bigarray_val(v));
-      //return kp((unsigned char *)Data_bigarray_val(v));
     }
     case tag_v_float32: { 
       return mk_float32_vector(tag_to_v_type(tag), val);
@@ -582,6 +1130,18 @@ static K ocaml_to_q(const value val)
     case tag_v_symbol: {
       return mk_symbol_vector(val);
     }
+    case tag_v_guid: {
+      return mk_guid_vector(val);
+    }
+    case tag_v_symbol_enum: {
+      return mk_symbol_enum_vector(val);
+    }
+    case tag_v_strings: {
+      return mk_string_list(val);
+    }
+    case tag_v_valid: {
+      return ocaml_to_q(v);
+    }
 
     // Mixed lists
 
@@ -606,12 +1166,6 @@ static K ocaml_to_q(const value val)
       return(dict);
     }
 
-    case tag_guid: 
-    case tag_v_guid: {
-      fprintf(stderr, "ocaml_to_q: guids not yet supported\n");
-      caml_failwith("ocaml_to_q: guids not yet supported");
-    }
-
     default: {
       fprintf(stderr, "ocaml_to_q: invalid tag %i\n",  tag);
       caml_failwith("ocaml_to_q impossible caml tag");
@@ -624,63 +1178,625 @@ static K ocaml_to_q(const value val)
 // Exported Caml functions to talk to kdb processes
 ///////////////////////////////////////////////////
 
+// Size of the elements of vectors of type 'ty' in memory, 0 for other types
+static size_t k_elem_size(const int ty) {
+  switch(ty) {
+  case KB: case KG: case KC:
+    return 1;
+  case KH:
+    return 2;
+  case KI: case KE: case KM: case KD: case KU: case KV: case KT:
+    return 4;
+  case KJ: case KF: case KZ: case KP: case KN:
+    return 8;
+  case KS:
+    return sizeof(S);
+  case UU:
+    return 16;
+  default:
+    return 0;
+  }
+}
+
+// Size of the encoding of 'x' in an uncompressed IPC message
+static size_t k_ipc_size(const K x) {
+  size_t size;
+  J i;
+  switch(x->t) {
+  case -KS: case q_error:
+    return 2 + strlen(x->s);
+  case -UU:
+    return 1 + 16;
+  case KS:
+    size = 6;
+    for(i = 0; i < x->n; i++) {
+      size += strlen(kS(x)[i]) + 1;
+    }
+    return size;
+  case 0:
+    size = 6;
+    for(i = 0; i < x->n; i++) {
+      size += k_ipc_size(kK(x)[i]);
+    }
+    return size;
+  case XT:
+    return 2 + k_ipc_size(x->k);
+  case XD:
+    return 1 + k_ipc_size(kK(x)[0]) + k_ipc_size(kK(x)[1]);
+  case q_unit:
+    return 2;
+  default:
+    if(x->t < 0) {
+      return 1 + k_elem_size(-x->t);
+    }
+    return x->t < XT ? 6 + x->n * k_elem_size(x->t) : 0;
+  }
+}
+
+// Convert the argument of a call, counting the time as sending time
+static K k_encode_arg(const value val, struct q_call_stats * stats)
+{
+  const int64_t start = stats ? q_clock_ns() : 0;
+  K arg = ocaml_to_q(val);
+  if(stats) {
+    stats->send_ns += q_clock_ns() - start;
+  }
+  return arg;
+}
+
+// Calls k() on 'handle' with the OCaml runtime released, so that other
+// threads and domains run while we wait on the network. The query is copied
+// out of the OCaml heap beforehand; 'arg', if any, is a K object and is
+// consumed by k(). A negative handle sends an async message.
+// k() sends and waits in one call: its time is counted in 'stats' as
+// waiting time, or as sending time for async messages.
+static K k_blocking(const int handle, const value str, const K arg, struct q_call_stats * stats)
+{
+  char * query = caml_stat_strdup(String_val(str));
+  int64_t start = 0;
+  K reply;
+
+  if(stats) {
+    stats->bytes_out += 8 + 6 + strlen(query) + (arg ? 6 + k_ipc_size(arg) : 0);
+    start = q_clock_ns();
+  }
+  caml_enter_blocking_section();
+  if(arg) {
+    reply = k(handle, query, arg, (K)0);
+  } else {
+    reply = k(handle, query, (K)0);
+  }
+  caml_leave_blocking_section();
+  caml_stat_free(query);
+  if(stats) {
+    if(handle < 0) {
+      stats->send_ns += q_clock_ns() - start;
+    } else {
+      stats->wait_ns += q_clock_ns() - start;
+      stats->bytes_in += reply ? 8 + k_ipc_size(reply) : 0;
+    }
+  }
+  return reply;
+}
+
+// Convert a reply to OCaml and free it. Raises Failure on network errors and
+// Q_error on q errors
+static value reply_to_ocaml(const struct q_decode_ctx * ctx, const K reply)
+{
+  CAMLparam0();
+  CAMLlocal1(result);
+
+  if(!reply) {
+    caml_failwith("Network error");
+  }
+  if(q_error == reply->t) {
+    result = caml_copy_string(reply->s);
+    r0(reply);
+    q_raise_error(result);
+  }
+  const int64_t start = ctx->stats ? q_clock_ns() : 0;
+  result = q_to_ocaml(ctx, reply);
+  // Free the memory for 'reply'. Vectors in 'result' hold their own reference
+  r0(reply);
+  if(ctx->stats) {
+    ctx->stats->decode_ns += q_clock_ns() - start;
+  }
+  CAMLreturn(result);
+}
+
+void q_raise_error(value msg)
+{
+  static const value * exn = NULL;
+  if(!exn) {
+    exn = caml_named_value("Q.Q_error");
+  }
+  caml_raise_with_arg(*exn, msg);
+}
+
+CAMLprim value q_init(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(arr);
+
+  // Copy the custom operations of ordinary bigarrays, so that owned
+  // bigarrays compare, hash and serialize like any other bigarray
+  static unsigned char data;
+  intnat dims[1] = { 1 };
+  arr = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, &data, dims);
+  q_ba_ops = *Custom_ops_val(arr);
+  q_ba_ops.finalize = q_ba_finalize;
+  // Connections may be used from several threads: intern symbols under a lock
+  setm(1);
+  CAMLreturn(Val_unit);
+}
+
 CAMLprim value q_connect(value host, value port)
 {
   CAMLparam2(host, port);
-  const int handle = khp(String_val(host), Int_val(port));
+
+  char * host_name = caml_stat_strdup(String_val(host));
+  const int port_num = Int_val(port);
+  int handle;
+
+  caml_enter_blocking_section();
+  handle = khp(host_name, port_num);
+  caml_leave_blocking_section();
+  caml_stat_free(host_name);
   CAMLreturn(caml_copy_int32(handle));
 }
 
-CAMLprim value q_eval_async(value handle, value str)
+CAMLprim value q_close(value conn)
 {
-  CAMLparam2(handle, str);
+  CAMLparam1(conn);
+  kclose(Handle_val(conn));
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value q_eval_async(value conn, value str)
+{
+  CAMLparam2(conn, str);
 
   assert(Is_block(str));
 
-  k(-Int32_val(handle), String_val(str), (K)0);
+  k_blocking(-Handle_val(conn), str, (K)0, conn_call_stats(conn));
   CAMLreturn(Val_unit);
 }
 
-CAMLprim value q_eval(value handle, value str)
+CAMLprim value q_eval(value conn, value str)
 {
-  CAMLparam2(handle, str);
-  CAMLlocal1(result);
+  CAMLparam2(conn, str);
+  CAMLlocal1(sym_dict);
+  struct q_decode_ctx ctx;
 
   assert(Is_block(str));
 
-  K reply = k(Int32_val(handle), String_val(str), (K)0);
-  if(!reply) {
+  K reply = k_blocking(Handle_val(conn), str, (K)0, conn_call_stats(conn));
+  decode_ctx_init_conn(&ctx, conn, &sym_dict);
+  CAMLreturn(reply_to_ocaml(&ctx, reply));
+}
+
+
+CAMLprim value q_rpc_async(value conn, value str, value val)
+{
+  CAMLparam3(conn, str, val);
+
+  assert(Is_block(str));
+
+  // Build the argument before releasing the runtime: ocaml_to_q reads 'val'
+  struct q_call_stats * stats = conn_call_stats(conn);
+  k_blocking(-Handle_val(conn), str, k_encode_arg(val, stats), stats);
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value q_rpc(value conn, value str, value val)
+{
+  CAMLparam3(conn, str, val);
+  CAMLlocal1(sym_dict);
+  struct q_decode_ctx ctx;
+
+  assert(Is_block(str));
+
+  struct q_call_stats * stats = conn_call_stats(conn);
+  K reply = k_blocking(Handle_val(conn), str, k_encode_arg(val, stats), stats);
+  decode_ctx_init_conn(&ctx, conn, &sym_dict);
+  CAMLreturn(reply_to_ocaml(&ctx, reply));
+}
+
+// Read the next message sent by the server, such as an update published by
+// a tickerplant
+CAMLprim value q_recv(value conn)
+{
+  CAMLparam1(conn);
+  CAMLlocal1(sym_dict);
+  struct q_decode_ctx ctx;
+  const int handle = Handle_val(conn);
+  struct q_call_stats * stats = conn_call_stats(conn);
+  const int64_t start = stats ? q_clock_ns() : 0;
+  K msg;
+
+  caml_enter_blocking_section();
+  msg = k(handle, (S)0);
+  caml_leave_blocking_section();
+  if(stats) {
+    stats->wait_ns += q_clock_ns() - start;
+    stats->bytes_in += msg ? 8 + k_ipc_size(msg) : 0;
+  }
+  decode_ctx_init_conn(&ctx, conn, &sym_dict);
+  CAMLreturn(reply_to_ocaml(&ctx, msg));
+}
+
+// Wait at most 'timeout' seconds (forever if negative) for the connection to
+// have data to read. Returns false on timeout
+CAMLprim value q_wait_readable(value conn, value timeout)
+{
+  CAMLparam2(conn, timeout);
+  const double seconds = Double_val(timeout);
+  struct pollfd fd = { .fd = Handle_val(conn), .events = POLLIN, .revents = 0 };
+  int ms, ready;
+
+  if(seconds < 0) {
+    ms = -1;
+  } else if(seconds >= INT32_MAX / 1000) {
+    ms = INT32_MAX;
+  } else {
+    ms = (int)(seconds * 1000.0 + 0.5);
+  }
+  caml_enter_blocking_section();
+  ready = poll(&fd, 1, ms);
+  caml_leave_blocking_section();
+  if(ready < 0 && EINTR != errno) {
     caml_failwith("Network error");
   }
-  result = q_to_ocaml(reply);
-  // Free the memory for 'reply'
-  r0(reply);
+  // Errors and hang-ups are reported by the next read
+  CAMLreturn(Val_bool(ready > 0));
+}
+
+
+CAMLprim value q_sym_dict_create(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+
+  struct q_symtab * tab = calloc(1, sizeof(struct q_symtab));
+  if(!tab) {
+    caml_raise_out_of_memory();
+  }
+  tab->strings = caml_alloc(64, 0);
+  caml_register_generational_global_root(&tab->strings);
+  tab->hashes = malloc(64 * sizeof(uint32_t));
+  tab->slots = calloc(128, sizeof(uint32_t));
+  tab->mask = 127;
+  result = caml_alloc_custom(&q_symtab_ops, sizeof(struct q_symtab *), 0, 1);
+  // Set after allocating, so that the finalizer always sees a complete table
+  Symtab_val(result) = tab;
+  if(!tab->hashes || !tab->slots) {
+    caml_raise_out_of_memory();
+  }
   CAMLreturn(result);
 }
 
+CAMLprim value q_sym_dict_length(value dict)
+{
+  CAMLparam1(dict);
+  CAMLreturn(Val_long(Symtab_val(dict)->count));
+}
 
-CAMLprim value q_rpc_async(value handle, value str, value val)
+CAMLprim value q_sym_dict_get(value dict, value index)
 {
-  CAMLparam3(handle, str, val);
+  CAMLparam2(dict, index);
 
-  assert(Is_block(str));
+  const struct q_symtab * tab = Symtab_val(dict);
+  const int32_t i = Int32_val(index);
+  if(i < 0 || (uint32_t)i >= tab->count) {
+    caml_invalid_argument("Q.Sym_dict.get: index out of bounds");
+  }
+  CAMLreturn(Field(tab->strings, i));
+}
 
-  k(-Int32_val(handle), String_val(str), ocaml_to_q(val), (K)0);
-  CAMLreturn(Val_unit);
+CAMLprim value q_sym_dict_find(value dict, value str)
+{
+  CAMLparam2(dict, str);
+  CAMLreturn(caml_copy_int32(q_symtab_lookup(Symtab_val(dict), String_val(str))));
+}
+
+CAMLprim value q_sym_dict_intern(value dict, value str)
+{
+  CAMLparam2(dict, str);
+
+  // Copy out of the OCaml heap: interning may trigger a GC
+  char * sym = caml_stat_strdup(String_val(str));
+  const int32_t i = q_symtab_intern(Symtab_val(dict), sym);
+  caml_stat_free(sym);
+  CAMLreturn(caml_copy_int32(i));
+}
+
+
+///////////////////////////////////////////////////
+// K objects held by OCaml
+///////////////////////////////////////////////////
+
+#define Kobj_val(v) (*((K *) Data_custom_val(v)))
+
+// Approximate size of the memory held by 'x', for the GC to account for it
+static uintnat k_size(const K x) {
+  J i;
+  uintnat size = sizeof(struct k0);
+  switch(x->t) {
+  case 0:
+    for(i = 0; i < x->n; i++) {
+      size += sizeof(K) + k_size(kK(x)[i]);
+    }
+    return size;
+  case XT:
+    return size + k_size(x->k);
+  case XD:
+    return size + k_size(kK(x)[0]) + k_size(kK(x)[1]);
+  default:
+    return x->t > 0 ? size + x->n * k_elem_size(x->t) : size;
+  }
+}
+
+static void q_kobj_finalize(value v) {
+  if(Kobj_val(v)) {
+    r0(Kobj_val(v));
+  }
+}
+
+static struct custom_operations q_kobj_ops = {
+  "q.kobj",
+  q_kobj_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+static value mk_kobj(const K x) {
+  value result = caml_alloc_custom_mem(&q_kobj_ops, sizeof(K), k_size(x));
+  Kobj_val(result) = x;
+  return result;
+}
+
+static K kobj_get(const value kobj) {
+  if(!Kobj_val(kobj)) {
+    caml_invalid_argument("Q.Kobj: released");
+  }
+  return Kobj_val(kobj);
+}
+
+CAMLprim value q_kobj_of_q_val(value v)
+{
+  CAMLparam1(v);
+  CAMLreturn(mk_kobj(ocaml_to_q(v)));
+}
+
+CAMLprim value q_kobj_to_q_val(value dict_opt, value packed_strings, value kobj)
+{
+  CAMLparam3(dict_opt, packed_strings, kobj);
+  CAMLlocal1(sym_dict);
+  struct q_decode_ctx ctx;
+
+  decode_ctx_init(&ctx, dict_opt, Bool_val(packed_strings), &sym_dict);
+  CAMLreturn(q_to_ocaml(&ctx, kobj_get(kobj)));
+}
+
+// A reply as a K object. Raises Failure on network errors and Q_error on q
+// errors
+static value reply_to_kobj(const K reply)
+{
+  CAMLparam0();
+  CAMLlocal1(msg);
+
+  if(!reply) {
+    caml_failwith("Network error");
+  }
+  if(q_error == reply->t) {
+    msg = caml_copy_string(reply->s);
+    r0(reply);
+    q_raise_error(msg);
+  }
+  CAMLreturn(mk_kobj(reply));
+}
+
+CAMLprim value q_kobj_eval(value conn, value str)
+{
+  CAMLparam2(conn, str);
+  CAMLreturn(reply_to_kobj(k_blocking(Handle_val(conn), str, (K)0, conn_call_stats(conn))));
+}
+
+CAMLprim value q_kobj_rpc(value conn, value str, value val)
+{
+  CAMLparam3(conn, str, val);
+  struct q_call_stats * stats = conn_call_stats(conn);
+  CAMLreturn(reply_to_kobj(k_blocking(Handle_val(conn), str, k_encode_arg(val, stats), stats)));
+}
+
+// Frees the K object now rather than when 'kobj' is collected
+CAMLprim value q_kobj_release(value kobj)
+{
+  if(Kobj_val(kobj)) {
+    r0(Kobj_val(kobj));
+    Kobj_val(kobj) = NULL;
+  }
+  return Val_unit;
+}
+
+// Parts of K objects, for decoding them in parallel. Several domains may
+// decode distinct parts of one object at the same time: they only read it.
+
+// Column 'i' of a table, or the object itself when 'i' is negative
+static K kobj_column(const value kobj, const value i) {
+  const K x = kobj_get(kobj);
+  if(Long_val(i) < 0) {
+    return x;
+  }
+  if(XT != x->t) {
+    caml_invalid_argument("Q.Kobj: not a table");
+  }
+  const K cols = kK(x->k)[1];
+  if(Long_val(i) >= cols->n) {
+    caml_invalid_argument("Q.Kobj: no such column");
+  }
+  return kK(cols)[Long_val(i)];
+}
+
+static void check_range(const K x, const value off, const value len) {
+  if(Long_val(off) < 0 || Long_val(len) < 0 || Long_val(off) > x->n - Long_val(len)) {
+    caml_invalid_argument("Q.Kobj: invalid range");
+  }
 }
 
-CAMLprim value q_rpc(value handle, value str, value val)
+// (type, length, attribute) of column 'i', see kobj_column. The length of
+// atoms, tables and dictionaries is 0
+CAMLprim value q_kobj_header(value kobj, value i)
 {
-  CAMLparam3(handle, str, val);
+  CAMLparam2(kobj, i);
   CAMLlocal1(result);
 
-  assert(Is_block(str));
+  const K x = kobj_column(kobj, i);
+  result = caml_alloc_tuple(3);
+  Store_field(result, 0, Val_int(x->t));
+  Store_field(result, 1, Val_long(x->t >= 0 && x->t < XT ? x->n : 0));
+  Store_field(result, 2, Val_int(x->u));
+  CAMLreturn(result);
+}
 
-  K reply = k(Int32_val(handle), String_val(str), ocaml_to_q(val), (K)0);
-  result = q_to_ocaml(reply);
-  // Free the memory for 'reply'
-  r0(reply);
+CAMLprim value q_kobj_colnames(value kobj)
+{
+  CAMLparam1(kobj);
+  const K x = kobj_column(kobj, Val_int(-1));
+  if(XT != x->t) {
+    caml_invalid_argument("Q.Kobj: not a table");
+  }
+  CAMLreturn(mk_caml_string_array_helper(kK(x->k)[0]));
+}
+
+// The keys (0) or values (1) of a dictionary, as a K object of their own
+CAMLprim value q_kobj_part(value kobj, value i)
+{
+  CAMLparam2(kobj, i);
+  const K x = kobj_get(kobj);
+  if(XD != x->t || Long_val(i) < 0 || Long_val(i) > 1) {
+    caml_invalid_argument("Q.Kobj: not a dictionary");
+  }
+  CAMLreturn(mk_kobj(r1(kK(x)[Long_val(i)])));
+}
+
+CAMLprim value q_kobj_decode_column(value dict_opt, value packed_strings, value kobj, value i)
+{
+  CAMLparam4(dict_opt, packed_strings, kobj, i);
+  CAMLlocal1(sym_dict);
+  struct q_decode_ctx ctx;
+
+  decode_ctx_init(&ctx, dict_opt, Bool_val(packed_strings), &sym_dict);
+  CAMLreturn(q_to_ocaml(&ctx, kobj_column(kobj, i)));
+}
+
+// Symbols [off, off + len) of the symbol vector in column 'i'
+CAMLprim value q_kobj_symbols(value kobj, value i, value off, value len)
+{
+  CAMLparam4(kobj, i, off, len);
+  const K x = kobj_column(kobj, i);
+  if(KS != x->t) {
+    caml_invalid_argument("Q.Kobj: not a symbol vector");
+  }
+  check_range(x, off, len);
+  CAMLreturn(mk_caml_string_range(x, Long_val(off), Long_val(len)));
+}
+
+// Elements [off, off + len) of the mixed list in column 'i', decoded with
+// the default options
+CAMLprim value q_kobj_mixed(value kobj, value i, value off, value len)
+{
+  CAMLparam4(kobj, i, off, len);
+  CAMLlocal2(v, result);
+
+  const K x = kobj_column(kobj, i);
+  if(0 != x->t) {
+    caml_invalid_argument("Q.Kobj: not a mixed list");
+  }
+  check_range(x, off, len);
+  const unsigned long n = Long_val(len);
+  if(0 == n) {
+    CAMLreturn(Atom(0));
+  }
+  result = caml_alloc(n, 0);
+  K * elems = kK(x) + Long_val(off);
+  unsigned long j;
+  for(j = 0; j < n; j++) {
+    v = q_to_ocaml(NULL, elems[j]);
+    caml_modify(&Field(result, j), v);
+  }
+  CAMLreturn(result);
+}
+
+
+///////////////////////////////////////////////////
+// Call statistics
+///////////////////////////////////////////////////
+
+static void q_stats_finalize(value v) {
+  free(Call_stats_val(v));
+}
+
+static struct custom_operations q_stats_ops = {
+  "q.stats",
+  q_stats_finalize,
+  custom_compare_default,
+  custom_hash_default,
+  custom_serialize_default,
+  custom_deserialize_default,
+  custom_compare_ext_default,
+  custom_fixed_length_default
+};
+
+CAMLprim value q_stats_create(value unit)
+{
+  CAMLparam1(unit);
+  CAMLlocal1(result);
+
+  struct q_call_stats * stats = calloc(1, sizeof(struct q_call_stats));
+  if(!stats) {
+    caml_raise_out_of_memory();
+  }
+  result = caml_alloc_custom(&q_stats_ops, sizeof(struct q_call_stats *), 0, 1);
+  Call_stats_val(result) = stats;
   CAMLreturn(result);
 }
 
+// The statistics gathered since the last call, which are reset:
+// [| send_ns; wait_ns; decode_ns; bytes_out; bytes_in; type; count; ... |]
+// with a (type, count) pair for each q type decoded
+CAMLprim value q_stats_take(value raw)
+{
+  CAMLparam1(raw);
+  CAMLlocal1(result);
 
+  struct q_call_stats * stats = Call_stats_val(raw);
+  int i, n = 0;
+  for(i = 0; i < 256; i++) {
+    n += stats->objects[i] != 0;
+  }
+  result = caml_alloc(5 + 2 * n, 0);
+  Store_field(result, 0, Val_long(stats->send_ns));
+  Store_field(result, 1, Val_long(stats->wait_ns));
+  Store_field(result, 2, Val_long(stats->decode_ns));
+  Store_field(result, 3, Val_long(stats->bytes_out));
+  Store_field(result, 4, Val_long(stats->bytes_in));
+  n = 5;
+  for(i = 0; i < 256; i++) {
+    if(stats->objects[i]) {
+      Store_field(result, n++, Val_long((signed char)i));
+      Store_field(result, n++, Val_long(stats->objects[i]));
+    }
+  }
+  memset(stats, 0, sizeof(struct q_call_stats));
+  CAMLreturn(result);
+}
+
+CAMLprim value q_stats_clock(value unit)
+{
+  return Val_long(q_clock_ns());
+}
@@ -10,9 +10,12 @@
 #define KXVER 3
 
 #include "k.h"
+#include <stdint.h>
+#include <time.h>
 #include <caml/mlvalues.h>
 #include <caml/alloc.h>
 #include <caml/memory.h>
+#include <caml/custom.h>
 
 enum q_type {
   // scalars
@@ -93,11 +96,147 @@ enum caml_tag {
   // tables and dictionaries
   tag_table,       
   tag_dict,
+  // symbol vectors decoded against a symbol dictionary
+  tag_v_symbol_enum,
+  // lists of strings as one char buffer and offsets
+  tag_v_strings,
+  // a vector and its validity bitmap
+  tag_v_valid,
   // result of Q functions that return void
   // Implementation note: caml constant constructors are numbered separately
   // from non-constant ones
   tag_unit = 0
 };
 
+// Fields of the OCaml record q_conn
+enum q_conn_field {
+  conn_handle,
+  conn_sym_dict,
+  conn_compression,
+  conn_packed_strings,
+  conn_stats,
+  conn_validity,
+  conn_endpoint
+};
+
+#define Handle_val(conn) Int32_val(Field(conn, conn_handle))
+
+
+// Symbol dictionaries. The OCaml string of symbol i is allocated once and
+// kept in the OCaml array 'strings'.
+
+struct q_symtab {
+  value strings;       // OCaml array of capacity >= count, a global root
+  uint32_t * hashes;   // hash of each symbol
+  uint32_t * slots;    // open addressing table of index + 1, 0 when free
+  uint32_t mask;       // number of slots - 1
+  uint32_t count;
+};
+
+#define Symtab_val(v) (*((struct q_symtab **) Data_custom_val(v)))
+
+static inline const char * q_symtab_string(const struct q_symtab * tab, const uint32_t i) {
+  return String_val(Field(tab->strings, i));
+}
+
+// The index of symbol 's', which is added to the dictionary if needed.
+// 's' must not point into the OCaml heap, as this may trigger a GC.
+int32_t q_symtab_intern(struct q_symtab * tab, const char * s);
+
+// The index of symbol 's', or -1 if it is not in the dictionary
+int32_t q_symtab_lookup(const struct q_symtab * tab, const char * s);
+
+
+// Statistics of the calls on a connection, added to by the stubs and taken
+// by Q.Stats after each call. Times are in nanoseconds.
+
+struct q_call_stats {
+  int64_t send_ns;      // encoding and sending requests
+  int64_t wait_ns;      // waiting for replies
+  int64_t decode_ns;    // receiving and decoding replies
+  int64_t bytes_out;
+  int64_t bytes_in;
+  int64_t objects[256]; // decoded objects, by q type cast to unsigned char
+};
+
+#define Call_stats_val(v) (*((struct q_call_stats **) Data_custom_val(v)))
+
+// The statistics of 'conn', NULL when it is not instrumented. The field is
+// an option of the record { raw; sink } of Q.Stats.
+static inline struct q_call_stats * conn_call_stats(const value conn) {
+  const value opt = Field(conn, conn_stats);
+  return Is_block(opt) ? Call_stats_val(Field(Field(opt, 0), 0)) : NULL;
+}
+
+static inline int64_t q_clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (int64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+
+// Decoding options of a connection
+
+struct q_decode_ctx {
+  // When not NULL, symbol vectors are decoded as V_symbol_enum against this
+  // dictionary. 'sym_dict' points at a registered root holding it.
+  struct q_symtab * symtab;
+  const value * sym_dict;
+  // Lists of strings are decoded as V_strings
+  int packed_strings;
+  // When not NULL, decoded objects are counted here
+  struct q_call_stats * stats;
+  // Vectors are decoded as V_valid, with their validity bitmap
+  int validity;
+};
+
+void decode_ctx_init(struct q_decode_ctx * ctx, const value dict_opt, const int packed_strings, value * sym_dict);
+
+// Set up the decoding options of connection 'conn'
+static inline void decode_ctx_init_conn(struct q_decode_ctx * ctx, const value conn, value * sym_dict) {
+  decode_ctx_init(ctx, Field(conn, conn_sym_dict), Bool_val(Field(conn, conn_packed_strings)), sym_dict);
+  ctx->stats = conn_call_stats(conn);
+  ctx->validity = Bool_val(Field(conn, conn_validity));
+}
+
+
+// Shared by the K object and the native IPC conversions
+
+value mk_caml_value(const int tag, value v);
+value mk_caml_value_two(const int tag, value v, value attrib);
+int tag_for_vector(const int ty);
+int tag_to_v_type(const int tag);
+size_t strings_count(const value v);
+value q_with_validity(value vec);
+
+// Raise Q_error with the message 'msg' of a q error
+CAMLnoreturn_start
+void q_raise_error(value msg)
+CAMLnoreturn_end;
+
+
+// Nulls: q has no separate nulls, each type reserves a value for them.
+// 'ty' is the type of a vector (a negated q_type); vectors of other types
+// have no nulls. Bit i of a validity bitmap (least significant bit first,
+// as in Arrow) is set when element i is not null.
+
+int64_t q_null_count(const int ty, const void * x, const int64_t n);
+void q_validity_bits(const int ty, const void * x, const int64_t n, uint8_t * bits);
+
+
+// Dates
+
+// Days from 1970.01.01 to 2000.01.01, the epoch of q
+#define Q_EPOCH_DAYS 10957
+
+// Days since 1970.01.01 of the first day of month 'm', counted from 2000.01
+int32_t q_month_to_days(const int32_t m);
+
+// Kernels of Q.Time, see q_time.c. 'x' and 'y' may be the same array.
+// Nulls and infinities are kept; other values wrap rather than overflow.
+void q_shift_int64(const int64_t * x, int64_t * y, const intnat n, const int64_t off);
+void q_shift_int32(const int32_t * x, int32_t * y, const intnat n, const int32_t off);
+void q_months_to_days(const int32_t * x, int32_t * y, const intnat n);
+
 
 #endif /* _Q_INTERFACE_H_ */
@@ -0,0 +1,1692 @@
+/*
+ * Copyright (c) 2022 Fermin Reig
+ *
+ * q_ipc.c
+ *
+ * Native encoder and decoder for the kdb+ IPC wire format. Values are
+ * converted directly between OCaml q_vals and bytes, without going through
+ * K objects.
+ */
+
+// Uncomment next line to disable assertions
+// #define NDEBUG
+
+#include <assert.h>
+#include <errno.h>
+#include <limits.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/custom.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include <caml/signals.h>
+#include "q_interface.h"
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ != __ORDER_LITTLE_ENDIAN__
+#error "q_ipc.c assumes a little-endian host"
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef IOV_MAX
+#define IOV_MAX 1024
+#endif
+
+// Message header: endianness (1 for little endian), message type,
+// compression flag, unused byte, and the length of the whole message
+#define IPC_HEADER_SIZE 8
+
+enum ipc_msg_type {
+  ipc_async,
+  ipc_sync,
+  ipc_response
+};
+
+// Dictionary with the sorted attribute. Not in enum q_type, as K objects
+// represent it as a dictionary
+#define IPC_SORTED_DICT 127
+
+// Size of the elements of a vector type (a negated q_type), 0 if unknown
+static size_t ipc_elem_size(const int ty) {
+  switch(ty){
+  case (-q_bool):
+  case (-q_byte):
+  case (-q_char):      return 1;
+  case (-q_int16):     return 2;
+  case (-q_int32):
+  case (-q_float32):
+  case (-q_month):
+  case (-q_date):
+  case (-q_minute):
+  case (-q_second):
+  case (-q_time):      return 4;
+  case (-q_int64):
+  case (-q_float64):
+  case (-q_datetime):
+  case (-q_timestamp):
+  case (-q_timespan):  return 8;
+  case (-q_guid):      return 16;
+  default:             return 0;
+  }
+}
+
+
+///////////////////////////////////////////////////
+// Socket I/O
+///////////////////////////////////////////////////
+
+// The functions below run with the runtime released, so the buffers must
+// not be in the OCaml heap. They return 0 on network errors.
+
+// Receive between 'min' (> 0) and 'max' bytes. Returns the number of bytes
+// received.
+static size_t ipc_recv(const int fd, void * dst, const size_t min, const size_t max)
+{
+  unsigned char * p = dst;
+  size_t got = 0;
+
+  caml_enter_blocking_section();
+  while(got < min) {
+    const ssize_t n = recv(fd, p + got, max - got, 0);
+    if(n > 0) {
+      got += n;
+    } else if(n < 0 && EINTR == errno) {
+      continue;
+    } else {
+      got = 0;
+      break;
+    }
+  }
+  caml_leave_blocking_section();
+  return got;
+}
+
+static int ipc_send(const int fd, const void * src, const size_t len)
+{
+  const unsigned char * p = src;
+  size_t sent = 0;
+
+  caml_enter_blocking_section();
+  while(sent < len) {
+    const ssize_t n = send(fd, p + sent, len - sent, MSG_NOSIGNAL);
+    if(n >= 0) {
+      sent += n;
+    } else if(EINTR != errno) {
+      break;
+    }
+  }
+  caml_leave_blocking_section();
+  return sent == len;
+}
+
+// Send the 'n' buffers of 'iov' in order, at most IOV_MAX per system call.
+// Updates 'iov' as buffers are sent.
+static int ipc_sendv(const int fd, struct iovec * iov, size_t n)
+{
+  caml_enter_blocking_section();
+  while(n > 0) {
+    struct msghdr m;
+    memset(&m, 0, sizeof(m));
+    m.msg_iov = iov;
+    m.msg_iovlen = n < IOV_MAX ? n : IOV_MAX;
+    const ssize_t sent = sendmsg(fd, &m, MSG_NOSIGNAL);
+    if(sent < 0) {
+      if(EINTR == errno) {
+        continue;
+      }
+      break;
+    }
+    size_t left = sent;
+    while(n > 0 && left >= iov->iov_len) {
+      left -= iov->iov_len;
+      iov++;
+      n--;
+    }
+    if(n > 0) {
+      iov->iov_base = (unsigned char *)iov->iov_base + left;
+      iov->iov_len -= left;
+    }
+  }
+  caml_leave_blocking_section();
+  return 0 == n;
+}
+
+
+///////////////////////////////////////////////////
+// Compression
+///////////////////////////////////////////////////
+
+// The compression scheme of kdb+ IPC. A compressed message has the header
+// of the original message with the compression flag set and the compressed
+// length, followed by the length of the original message and the compressed
+// data. The data is a sequence of groups of eight items, each group preceded
+// by a byte flagging which of its items are back-references. An item is a
+// literal byte, or a back-reference: the byte of a hash table index followed
+// by the number of bytes to copy after the first two. The hash table maps
+// the xor of two consecutive bytes to their last position in the output;
+// compressor and decompressor update it identically.
+
+// Compress message 'src' of length 'len' into 'dst', of size len / 2.
+// Returns the compressed length, or 0 if that would exceed len / 2.
+static size_t ipc_compress(const unsigned char * src, const size_t len, unsigned char * dst)
+{
+  size_t positions[256] = { 0 };
+  const size_t limit = len / 2;
+  size_t flags_at = IPC_HEADER_SIZE + 4; // position of the current flags byte
+  size_t d = flags_at;                    // next position in dst
+  size_t s = IPC_HEADER_SIZE;             // next position in src
+  size_t pending = 0;                     // literal waiting to enter the table
+  unsigned int bit = 0, flags = 0, h = 0, pending_h = 0;
+  int32_t n;
+
+  memcpy(dst, src, 4);
+  dst[2] = 1;
+  n = (int32_t)len;
+  memcpy(dst + IPC_HEADER_SIZE, &n, sizeof(n));
+  for(; s < len; bit = (bit << 1) & 0xff) {
+    if(0 == bit) {
+      // Room for a whole group: a flags byte and eight 2-byte items
+      if(d + 17 > limit) {
+        return 0;
+      }
+      dst[flags_at] = flags;
+      flags_at = d++;
+      flags = 0;
+      bit = 1;
+    }
+    int literal = s + 3 > len;
+    size_t p = 0;
+    if(!literal) {
+      h = src[s] ^ src[s + 1];
+      p = positions[h];
+      literal = (0 == p) || (src[s] != src[p]);
+    }
+    if(pending > 0) {
+      positions[pending_h] = pending;
+      pending = 0;
+    }
+    if(literal) {
+      pending_h = h;
+      pending = s;
+      dst[d++] = src[s++];
+    } else {
+      positions[h] = s;
+      flags |= bit;
+      p += 2;
+      s += 2;
+      const size_t start = s;
+      const size_t end = s + 255 < len ? s + 255 : len;
+      while(src[p] == src[s] && ++s < end) {
+        ++p;
+      }
+      dst[d++] = h;
+      dst[d++] = s - start;
+    }
+  }
+  dst[flags_at] = flags;
+  n = (int32_t)d;
+  memcpy(dst + 4, &n, sizeof(n));
+  return d;
+}
+
+// Decompress message 'src' of length 'len' into 'dst', of the original
+// length 'dst_len'. The header is not copied. Returns 0 if 'src' is malformed.
+static int ipc_decompress(const unsigned char * src, const size_t len, unsigned char * dst, const size_t dst_len)
+{
+  size_t positions[256] = { 0 };
+  size_t s = IPC_HEADER_SIZE;     // next position in dst
+  size_t p = IPC_HEADER_SIZE;     // next position to enter the table
+  size_t d = IPC_HEADER_SIZE + 4; // next position in src
+  unsigned int bit = 0, flags = 0;
+
+  while(s < dst_len) {
+    size_t n = 0;
+    if(0 == bit) {
+      if(d >= len) {
+        return 0;
+      }
+      flags = src[d++];
+      bit = 1;
+    }
+    if(flags & bit) {
+      if(d + 2 > len) {
+        return 0;
+      }
+      size_t r = positions[src[d++]];
+      n = src[d++];
+      if(r < IPC_HEADER_SIZE || r + 1 >= s || s + 2 + n > dst_len) {
+        return 0;
+      }
+      dst[s++] = dst[r++];
+      dst[s++] = dst[r++];
+      // Byte by byte: the source and destination may overlap
+      size_t m;
+      for(m = 0; m < n; m++) {
+        dst[s + m] = dst[r + m];
+      }
+    } else {
+      if(d >= len) {
+        return 0;
+      }
+      dst[s++] = src[d++];
+    }
+    while(p + 1 < s) {
+      positions[dst[p] ^ dst[p + 1]] = p;
+      p++;
+    }
+    if(flags & bit) {
+      s += n;
+      p = s;
+    }
+    bit = (bit << 1) & 0xff;
+  }
+  return 1;
+}
+
+
+///////////////////////////////////////////////////
+// Reading messages
+///////////////////////////////////////////////////
+
+// Reads the body of a message, either from memory or incrementally from a
+// socket. Atoms and headers go through a buffer; vectors are copied straight
+// from the socket into their bigarrays.
+
+#define IPC_READ_BUFFER 65536
+
+struct ipc_reader {
+  unsigned char * buf;  // buffered bytes, allocated with malloc
+  size_t pos;           // next byte to read in buf
+  size_t len;           // end of the buffered bytes
+  size_t cap;           // size of buf
+  int fd;               // socket holding the rest of the message, or -1
+  size_t unread;        // bytes of the message still on the socket
+};
+
+static void reader_free(struct ipc_reader * r)
+{
+  free(r->buf);
+  r->buf = NULL;
+}
+
+static size_t reader_recv(struct ipc_reader * r, void * dst, const size_t min, const size_t max)
+{
+  const size_t got = ipc_recv(r->fd, dst, min, max);
+  if(!got) {
+    reader_free(r);
+    caml_failwith("Network error");
+  }
+  return got;
+}
+
+// Abandon the message. The rest of the message is discarded, so that the
+// connection remains usable.
+static void reader_discard(struct ipc_reader * r)
+{
+  if(r->fd >= 0) {
+    while(r->unread > 0) {
+      const size_t n = r->unread < r->cap ? r->unread : r->cap;
+      r->unread -= reader_recv(r, r->buf, n, n);
+    }
+  }
+  reader_free(r);
+}
+
+// Abandon the message and raise Failure. 'msg' must not be in the OCaml heap.
+static void reader_fail(struct ipc_reader * r, const char * msg)
+{
+  CAMLparam0();
+  CAMLlocal1(exn_msg);
+
+  exn_msg = caml_copy_string(msg);
+  reader_discard(r);
+  caml_failwith_value(exn_msg);
+  CAMLreturn0;
+}
+
+// Abandon the message and raise Q_error, for the q error 'msg'. 'msg' may
+// point into the buffer of 'r'.
+static void reader_q_error(struct ipc_reader * r, const char * msg)
+{
+  CAMLparam0();
+  CAMLlocal1(exn_msg);
+
+  exn_msg = caml_copy_string(msg);
+  reader_discard(r);
+  q_raise_error(exn_msg);
+  CAMLreturn0;
+}
+
+// Make at least 'n' bytes available in the buffer
+static void reader_fill(struct ipc_reader * r, const size_t n)
+{
+  const size_t avail = r->len - r->pos;
+
+  if(avail >= n) {
+    return;
+  }
+  if(r->fd < 0 || n - avail > r->unread) {
+    reader_fail(r, "q IPC: truncated message");
+  }
+  memmove(r->buf, r->buf + r->pos, avail);
+  r->pos = 0;
+  r->len = avail;
+  if(n > r->cap) {
+    const size_t cap = n > 2 * r->cap ? n : 2 * r->cap;
+    unsigned char * buf = realloc(r->buf, cap);
+    if(!buf) {
+      reader_free(r);
+      caml_raise_out_of_memory();
+    }
+    r->buf = buf;
+    r->cap = cap;
+  }
+  const size_t room = r->cap - r->len;
+  const size_t max = room < r->unread ? room : r->unread;
+  const size_t got = reader_recv(r, r->buf + r->len, n - avail, max);
+  r->len += got;
+  r->unread -= got;
+}
+
+// The next 'n' bytes. The pointer is valid until the next read.
+static const unsigned char * reader_take(struct ipc_reader * r, const size_t n)
+{
+  reader_fill(r, n);
+  const unsigned char * p = r->buf + r->pos;
+  r->pos += n;
+  return p;
+}
+
+// Copy the next 'n' bytes to 'dst', which must not be in the OCaml heap
+static void reader_copy(struct ipc_reader * r, void * dst, const size_t n)
+{
+  const size_t avail = r->len - r->pos;
+  const size_t buffered = avail < n ? avail : n;
+
+  memcpy(dst, r->buf + r->pos, buffered);
+  r->pos += buffered;
+  if(buffered < n) {
+    const size_t rest = n - buffered;
+    if(r->fd < 0 || rest > r->unread) {
+      reader_fail(r, "q IPC: truncated message");
+    }
+    reader_recv(r, (unsigned char *)dst + buffered, rest, rest);
+    r->unread -= rest;
+  }
+}
+
+// The next NUL-terminated string. The pointer is valid until the next read.
+static const char * reader_cstring(struct ipc_reader * r)
+{
+  size_t n = 1; // bytes needed, including the NUL
+  for(;;) {
+    reader_fill(r, n);
+    const unsigned char * start = r->buf + r->pos;
+    const unsigned char * nul = memchr(start + n - 1, 0, r->len - r->pos - (n - 1));
+    if(nul) {
+      r->pos += nul - start + 1;
+      return (const char *)start;
+    }
+    n = r->len - r->pos + 1;
+  }
+}
+
+static inline int reader_byte(struct ipc_reader * r)
+{
+  return *reader_take(r, 1);
+}
+
+static inline int32_t reader_i32(struct ipc_reader * r)
+{
+  int32_t x;
+  memcpy(&x, reader_take(r, sizeof(x)), sizeof(x));
+  return x;
+}
+
+static inline int64_t reader_i64(struct ipc_reader * r)
+{
+  int64_t x;
+  memcpy(&x, reader_take(r, sizeof(x)), sizeof(x));
+  return x;
+}
+
+static inline double reader_f64(struct ipc_reader * r)
+{
+  double x;
+  memcpy(&x, reader_take(r, sizeof(x)), sizeof(x));
+  return x;
+}
+
+static inline float reader_f32(struct ipc_reader * r)
+{
+  float x;
+  memcpy(&x, reader_take(r, sizeof(x)), sizeof(x));
+  return x;
+}
+
+// Length of a vector or list
+static size_t reader_count(struct ipc_reader * r)
+{
+  const int32_t n = reader_i32(r);
+  if(n < 0) {
+    reader_fail(r, "q IPC: negative vector length");
+  }
+  return (size_t)n;
+}
+
+
+static value ipc_decode(struct ipc_reader * r, const struct q_decode_ctx * ctx);
+
+static value ipc_decode_bigarray(struct ipc_reader * r, const int ty, const int arr_ty)
+{
+  CAMLparam0 ();
+  CAMLlocal2 (attrib, arr);
+
+  attrib = Val_int(reader_byte(r));
+  intnat dims[1];
+  dims[0] = reader_count(r);
+  arr = caml_ba_alloc(arr_ty | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  reader_copy(r, Caml_ba_data_val(arr), dims[0] * ipc_elem_size(ty));
+  CAMLreturn (mk_caml_value_two(tag_for_vector(ty), arr, attrib));
+}
+
+static value ipc_decode_symbols(struct ipc_reader * r, const struct q_decode_ctx * ctx)
+{
+  CAMLparam0 ();
+  CAMLlocal3 (attrib, arr, v);
+
+  attrib = Val_int(reader_byte(r));
+  const size_t n = reader_count(r);
+  size_t i;
+
+  if(ctx && ctx->symtab) {
+    intnat dims[1];
+    dims[0] = n;
+    arr = caml_ba_alloc(CAML_BA_INT32 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+    int32_t * indices = Caml_ba_data_val(arr);
+    for(i = 0; i < n; i++) {
+      indices[i] = q_symtab_intern(ctx->symtab, reader_cstring(r));
+    }
+    v = caml_alloc(3, tag_v_symbol_enum);
+    Store_field(v, 0, arr);
+    Store_field(v, 1, *ctx->sym_dict);
+    Store_field(v, 2, attrib);
+    CAMLreturn (v);
+  }
+  arr = (0 == n) ? Atom(0) : caml_alloc(n, 0);
+  for(i = 0; i < n; i++) {
+    // caml_copy_string may cause a GC and move arr: see mk_caml_array
+    v = caml_copy_string(reader_cstring(r));
+    caml_modify(&Field(arr, i), v);
+  }
+  CAMLreturn (mk_caml_value_two(tag_v_symbol, arr, attrib));
+}
+
+// GUID vectors are packed bytes, 16 per GUID
+static value ipc_decode_guids(struct ipc_reader * r)
+{
+  CAMLparam0 ();
+  CAMLlocal2 (attrib, arr);
+
+  attrib = Val_int(reader_byte(r));
+  intnat dims[1];
+  dims[0] = 16 * reader_count(r);
+  arr = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  reader_copy(r, Caml_ba_data_val(arr), dims[0]);
+  CAMLreturn (mk_caml_value_two(tag_v_guid, arr, attrib));
+}
+
+// Decode the 'n' elements of a mixed list as V_strings, see mk_caml_strings.
+// The list is decoded as V_mixed if an element is not a string.
+static value ipc_decode_strings(struct ipc_reader * r, const struct q_decode_ctx * ctx, const size_t n)
+{
+  CAMLparam0 ();
+  CAMLlocal5 (chars, offsets, grown, arr, v);
+
+  intnat dims[1];
+  size_t i, j, total = 0;
+  size_t cap = n < IPC_READ_BUFFER / 64 ? 64 * n : IPC_READ_BUFFER; // grown as needed
+
+  dims[0] = n + 1;
+  offsets = caml_ba_alloc(CAML_BA_INT64 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  dims[0] = cap;
+  chars = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+  // Bigarray data is not moved by the GC
+  int64_t * offs = Caml_ba_data_val(offsets);
+  offs[0] = 0;
+  for(i = 0; i < n; i++) {
+    reader_fill(r, 1);
+    if(-q_char != r->buf[r->pos]) {
+      break;
+    }
+    r->pos++;
+    reader_byte(r); // Attribute: not represented
+    const size_t len = reader_count(r);
+    if(total + len > cap) {
+      cap = total + len > 2 * cap ? total + len : 2 * cap;
+      dims[0] = cap;
+      grown = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+      memcpy(Caml_ba_data_val(grown), Caml_ba_data_val(chars), total);
+      chars = grown;
+    }
+    reader_copy(r, (unsigned char *)Caml_ba_data_val(chars) + total, len);
+    total += len;
+    offs[i + 1] = total;
+  }
+  if(i == n) {
+    if(total < cap) {
+      dims[0] = total;
+      grown = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+      memcpy(Caml_ba_data_val(grown), Caml_ba_data_val(chars), total);
+      chars = grown;
+    }
+    v = caml_alloc(2, tag_v_strings);
+    Store_field(v, 0, chars);
+    Store_field(v, 1, offsets);
+    CAMLreturn (v);
+  }
+  // Not a list of strings: the strings read so far become V_char
+  arr = caml_alloc(n, 0);
+  for(j = 0; j < i; j++) {
+    dims[0] = offs[j + 1] - offs[j];
+    v = caml_ba_alloc(CAML_BA_UINT8 | CAML_BA_C_LAYOUT, 1, NULL, dims);
+    memcpy(Caml_ba_data_val(v), (unsigned char *)Caml_ba_data_val(chars) + offs[j], dims[0]);
+    v = mk_caml_value_two(tag_v_char, v, Val_int(0));
+    caml_modify(&Field(arr, j), v);
+  }
+  for(; i < n; i++) {
+    v = ipc_decode(r, ctx);
+    caml_modify(&Field(arr, i), v);
+  }
+  CAMLreturn (mk_caml_value(tag_mixed_list, arr));
+}
+
+static value ipc_decode_mixed(struct ipc_reader * r, const struct q_decode_ctx * ctx)
+{
+  CAMLparam0 ();
+  CAMLlocal2 (arr, v);
+
+  reader_byte(r); // Attribute: not represented for mixed lists
+  const size_t n = reader_count(r);
+  size_t i;
+
+  if(n > 0 && ctx && ctx->packed_strings) {
+    CAMLreturn (ipc_decode_strings(r, ctx, n));
+  }
+  arr = (0 == n) ? Atom(0) : caml_alloc(n, 0);
+  for(i = 0; i < n; i++) {
+    v = ipc_decode(r, ctx);
+    caml_modify(&Field(arr, i), v);
+  }
+  CAMLreturn (mk_caml_value(tag_mixed_list, arr));
+}
+
+static value ipc_decode_dict(struct ipc_reader * r, const struct q_decode_ctx * ctx, const int attrib)
+{
+  CAMLparam0 ();
+  CAMLlocal3 (result, keys, values);
+
+  keys = ipc_decode(r, ctx);
+  values = ipc_decode(r, ctx);
+  result = caml_alloc(3, 0);
+  Store_field(result, 0, keys);
+  Store_field(result, 1, values);
+  Store_field(result, 2, Val_int(attrib));
+  CAMLreturn (mk_caml_value(tag_dict, result));
+}
+
+static value ipc_decode_table(struct ipc_reader * r, const struct q_decode_ctx * ctx)
+{
+  CAMLparam0 ();
+  CAMLlocal4 (tbl, attrib, colnames, cols);
+
+  attrib = Val_int(reader_byte(r));
+  if(q_dict != reader_byte(r)) {
+    reader_fail(r, "q IPC: malformed table");
+  }
+  // Column names are always symbols, never enumerated
+  colnames = ipc_decode(r, NULL);
+  cols = ipc_decode(r, ctx);
+  tbl = caml_alloc(3, 0);
+  Store_field(tbl, 0, colnames);
+  Store_field(tbl, 1, cols);
+  Store_field(tbl, 2, attrib);
+  CAMLreturn (mk_caml_value(tag_table, tbl));
+}
+
+// Decode the next object, without the validity of vectors
+static value ipc_decode_value(struct ipc_reader * r, const struct q_decode_ctx * ctx)
+{
+  CAMLparam0 ();
+  CAMLlocal1 (v);
+
+  const int ty = (signed char)reader_byte(r);
+  if(ctx && ctx->stats) {
+    ctx->stats->objects[(unsigned char)ty]++;
+  }
+  switch(ty) {
+
+  // Scalars
+
+  case q_bool: {
+    CAMLreturn (mk_caml_value(tag_bool, Val_bool(reader_byte(r))));
+  }
+  case q_byte: {
+    CAMLreturn (mk_caml_value(tag_byte, Val_int(reader_byte(r))));
+  }
+  case q_int16: {
+    int16_t h;
+    memcpy(&h, reader_take(r, sizeof(h)), sizeof(h));
+    CAMLreturn (mk_caml_value(tag_int16, Val_int(h)));
+  }
+  case q_int32:   { v = caml_copy_int32(reader_i32(r)); CAMLreturn (mk_caml_value(tag_int32, v)); }
+  case q_month:   { v = caml_copy_int32(reader_i32(r)); CAMLreturn (mk_caml_value(tag_month, v)); }
+  case q_date:    { v = caml_copy_int32(reader_i32(r)); CAMLreturn (mk_caml_value(tag_date, v)); }
+  case q_minute:  { v = caml_copy_int32(reader_i32(r)); CAMLreturn (mk_caml_value(tag_minute, v)); }
+  case q_second:  { v = caml_copy_int32(reader_i32(r)); CAMLreturn (mk_caml_value(tag_second, v)); }
+  case q_time:    { v = caml_copy_int32(reader_i32(r)); CAMLreturn (mk_caml_value(tag_time, v)); }
+  case q_int64:     { v = caml_copy_int64(reader_i64(r)); CAMLreturn (mk_caml_value(tag_int64, v)); }
+  case q_timestamp: { v = caml_copy_int64(reader_i64(r)); CAMLreturn (mk_caml_value(tag_timestamp, v)); }
+  case q_timespan:  { v = caml_copy_int64(reader_i64(r)); CAMLreturn (mk_caml_value(tag_timespan, v)); }
+  case q_float32:  { v = caml_copy_double(reader_f32(r)); CAMLreturn (mk_caml_value(tag_float32, v)); }
+  case q_float64:  { v = caml_copy_double(reader_f64(r)); CAMLreturn (mk_caml_value(tag_float64, v)); }
+  case q_datetime: { v = caml_copy_double(reader_f64(r)); CAMLreturn (mk_caml_value(tag_datetime, v)); }
+  case q_char: {
+    CAMLreturn (mk_caml_value(tag_char, Val_int(reader_byte(r))));
+  }
+  case q_symbol: {
+    v = caml_copy_string(reader_cstring(r));
+    CAMLreturn (mk_caml_value(tag_symbol, v));
+  }
+  case q_guid: {
+    v = caml_alloc_string(16);
+    memcpy(Bytes_val(v), reader_take(r, 16), 16);
+    CAMLreturn (mk_caml_value(tag_guid, v));
+  }
+
+  // Vectors of scalars
+
+  case (-q_bool):
+  case (-q_byte):
+  case (-q_char): {
+    CAMLreturn (ipc_decode_bigarray(r, ty, CAML_BA_UINT8));
+  }
+  case (-q_int16): {
+    CAMLreturn (ipc_decode_bigarray(r, ty, CAML_BA_UINT16));
+  }
+  case (-q_int32):
+  case (-q_month):
+  case (-q_date):
+  case (-q_minute):
+  case (-q_second):
+  case (-q_time): {
+    CAMLreturn (ipc_decode_bigarray(r, ty, CAML_BA_INT32));
+  }
+  case (-q_int64):
+  case (-q_timestamp):
+  case (-q_timespan): {
+    CAMLreturn (ipc_decode_bigarray(r, ty, CAML_BA_INT64));
+  }
+  case (-q_float32): {
+    CAMLreturn (ipc_decode_bigarray(r, ty, CAML_BA_FLOAT32));
+  }
+  case (-q_float64):
+  case (-q_datetime): {
+    CAMLreturn (ipc_decode_bigarray(r, ty, CAML_BA_FLOAT64));
+  }
+  case (-q_symbol): {
+    CAMLreturn (ipc_decode_symbols(r, ctx));
+  }
+  case (-q_guid): {
+    CAMLreturn (ipc_decode_guids(r));
+  }
+
+  // Mixed lists, tables and dictionaries
+
+  case q_mixed_list: {
+    CAMLreturn (ipc_decode_mixed(r, ctx));
+  }
+  case q_table: {
+    CAMLreturn (ipc_decode_table(r, ctx));
+  }
+  case q_dict: {
+    CAMLreturn (ipc_decode_dict(r, ctx, 0));
+  }
+  case IPC_SORTED_DICT: {
+    CAMLreturn (ipc_decode_dict(r, ctx, 1)); // A_s
+  }
+
+  case q_unit: {
+    reader_byte(r);
+    CAMLreturn (Val_int(tag_unit));
+  }
+  case q_error: {
+    reader_q_error(r, reader_cstring(r));
+  }
+  case q_lambda: {
+    reader_fail(r, "Not supported: lambda (type 100)");
+  }
+  case q_operator: {
+    reader_fail(r, "Not supported: q operator (type 102)");
+  }
+  case q_partial_app: {
+    reader_fail(r, "Not supported: partial application (type 104)");
+  }
+  default: {
+    fprintf(stderr, "ipc_decode: unsupported q type %i\n", ty);
+    reader_fail(r, "q IPC: unsupported q type");
+  }
+  }
+  CAMLreturn (Val_unit); // not reached
+}
+
+// Decode the next object. 'ctx' may be NULL, for default decoding
+static value ipc_decode(struct ipc_reader * r, const struct q_decode_ctx * ctx)
+{
+  const value v = ipc_decode_value(r, ctx);
+  return (ctx && ctx->validity) ? q_with_validity(v) : v;
+}
+
+// Decode the body of a message. Frees the reader.
+static value ipc_decode_message(struct ipc_reader * r, const struct q_decode_ctx * ctx)
+{
+  CAMLparam0 ();
+  CAMLlocal1 (result);
+
+  result = ipc_decode(r, ctx);
+  if(r->pos != r->len || r->unread > 0) {
+    reader_fail(r, "q IPC: trailing bytes after message");
+  }
+  reader_free(r);
+  CAMLreturn (result);
+}
+
+// Parse a message header. Returns the length of the body
+static size_t ipc_parse_header(const unsigned char * header, int * msg_type, int * compressed)
+{
+  int32_t len;
+
+  if(1 != header[0]) {
+    caml_failwith("q IPC: big-endian messages are not supported");
+  }
+  if(header[1] > ipc_response) {
+    caml_failwith("q IPC: invalid message type");
+  }
+  memcpy(&len, header + 4, sizeof(len));
+  if(len <= IPC_HEADER_SIZE) {
+    caml_failwith("q IPC: invalid message length");
+  }
+  *msg_type = header[1];
+  *compressed = header[2];
+  return len - IPC_HEADER_SIZE;
+}
+
+// Set up 'r' to read the body of the compressed message 'msg' of length
+// 'len'. Returns an error message, or NULL on success.
+static const char * reader_init_compressed(struct ipc_reader * r, const unsigned char * msg, const size_t len)
+{
+  int32_t original;
+
+  if(len < IPC_HEADER_SIZE + 4) {
+    return "q IPC: truncated message";
+  }
+  memcpy(&original, msg + IPC_HEADER_SIZE, sizeof(original));
+  if(original <= IPC_HEADER_SIZE) {
+    return "q IPC: invalid message length";
+  }
+  r->buf = malloc(original);
+  if(!r->buf) {
+    return "q IPC: out of memory";
+  }
+  if(!ipc_decompress(msg, len, r->buf, original)) {
+    reader_free(r);
+    return "q IPC: malformed compressed message";
+  }
+  r->pos = IPC_HEADER_SIZE;
+  r->len = r->cap = original;
+  r->fd = -1;
+  r->unread = 0;
+  return NULL;
+}
+
+// Receive a compressed message whose header has been read. The whole
+// message is needed to decompress it.
+static value ipc_recv_compressed(const int fd, const unsigned char * header, const size_t body, const struct q_decode_ctx * ctx)
+{
+  struct ipc_reader r;
+  const char * error;
+
+  unsigned char * msg = malloc(IPC_HEADER_SIZE + body);
+  if(!msg) {
+    caml_raise_out_of_memory();
+  }
+  memcpy(msg, header, IPC_HEADER_SIZE);
+  if(!ipc_recv(fd, msg + IPC_HEADER_SIZE, body, body)) {
+    free(msg);
+    caml_failwith("Network error");
+  }
+  error = reader_init_compressed(&r, msg, IPC_HEADER_SIZE + body);
+  free(msg);
+  if(error) {
+    caml_failwith(error);
+  }
+  return ipc_decode_message(&r, ctx);
+}
+
+// Receive the next message on 'fd'. Waiting counts until the header is
+// received; the body is received while it is decoded.
+static value ipc_recv_message(const int fd, const struct q_decode_ctx * ctx, int * msg_type)
+{
+  unsigned char header[IPC_HEADER_SIZE];
+  int compressed;
+  const int64_t start = ctx->stats ? q_clock_ns() : 0;
+
+  if(!ipc_recv(fd, header, IPC_HEADER_SIZE, IPC_HEADER_SIZE)) {
+    caml_failwith("Network error");
+  }
+  const size_t body = ipc_parse_header(header, msg_type, &compressed);
+  if(ctx->stats) {
+    ctx->stats->wait_ns += q_clock_ns() - start;
+    ctx->stats->bytes_in += IPC_HEADER_SIZE + body;
+  }
+  if(compressed) {
+    return ipc_recv_compressed(fd, header, body, ctx);
+  }
+  struct ipc_reader r;
+  r.cap = body < IPC_READ_BUFFER ? body : IPC_READ_BUFFER;
+  r.buf = malloc(r.cap);
+  if(!r.buf) {
+    caml_raise_out_of_memory();
+  }
+  r.pos = r.len = 0;
+  r.fd = fd;
+  r.unread = body;
+  return ipc_decode_message(&r, ctx);
+}
+
+
+///////////////////////////////////////////////////
+// Writing messages
+///////////////////////////////////////////////////
+
+// Messages are encoded in two passes: ipc_size computes the size of the
+// encoding of a value, so that ipc_write can fill a buffer allocated once.
+
+static inline unsigned char * put_bytes(unsigned char * p, const void * x, const size_t n)
+{
+  memcpy(p, x, n);
+  return p + n;
+}
+
+static inline unsigned char * put_byte(unsigned char * p, const int x)
+{
+  *p = (unsigned char)x;
+  return p + 1;
+}
+
+static inline unsigned char * put_i32(unsigned char * p, const int32_t x)
+{
+  return put_bytes(p, &x, sizeof(x));
+}
+
+// Type, attribute and length of a vector
+static inline unsigned char * put_vector_header(unsigned char * p, const int ty, const int attrib, const size_t n)
+{
+  p = put_byte(p, ty);
+  p = put_byte(p, attrib);
+  return put_i32(p, (int32_t)n);
+}
+
+#define IPC_VECTOR_HEADER 6
+
+static size_t check_count(const size_t n)
+{
+  if(n > INT32_MAX) {
+    caml_invalid_argument("q IPC: vector too long");
+  }
+  return n;
+}
+
+static size_t bigarray_count(const value arr)
+{
+  assert(1 == Caml_ba_array_val(arr)->num_dims);
+  return check_count(Caml_ba_array_val(arr)->dim[0]);
+}
+
+// Number of GUIDs in a packed GUID vector
+static size_t guid_count(const value arr)
+{
+  assert(1 == Caml_ba_array_val(arr)->num_dims);
+  const size_t bytes = Caml_ba_array_val(arr)->dim[0];
+  if(0 != bytes % 16) {
+    caml_invalid_argument("q IPC: GUID vectors must hold 16 bytes per GUID");
+  }
+  return check_count(bytes / 16);
+}
+
+static size_t symbol_size(const value s)
+{
+  const size_t len = caml_string_length(s);
+  if(memchr(String_val(s), 0, len)) {
+    caml_invalid_argument("q IPC: symbols cannot contain NUL");
+  }
+  return len + 1;
+}
+
+static size_t ipc_size(const value val)
+{
+  if(!Is_block(val)) {
+    // Unit: type and a zero byte
+    return 2;
+  }
+  const value v = Field(val, 0);
+  const int tag = Tag_val(val);
+  switch(tag) {
+
+  // Scalars
+
+  case tag_bool:
+  case tag_byte:
+  case tag_char:      return 2;
+  case tag_int16:     return 3;
+  case tag_int32:
+  case tag_float32:
+  case tag_month:
+  case tag_date:
+  case tag_minute:
+  case tag_second:
+  case tag_time:      return 5;
+  case tag_int64:
+  case tag_float64:
+  case tag_datetime:
+  case tag_timestamp:
+  case tag_timespan:  return 9;
+  case tag_symbol:    return 1 + symbol_size(v);
+  case tag_guid: {
+    if(16 != caml_string_length(v)) {
+      caml_invalid_argument("q IPC: guids must be 16 bytes long");
+    }
+    return 17;
+  }
+
+  // Vectors
+
+  case tag_v_bool:
+  case tag_v_byte:
+  case tag_v_int16:
+  case tag_v_int32:
+  case tag_v_int64:
+  case tag_v_float32:
+  case tag_v_float64:
+  case tag_v_char:
+  case tag_v_month:
+  case tag_v_date:
+  case tag_v_datetime:
+  case tag_v_minute:
+  case tag_v_second:
+  case tag_v_time:
+  case tag_v_timestamp:
+  case tag_v_timespan: {
+    return IPC_VECTOR_HEADER + bigarray_count(v) * ipc_elem_size(tag_to_v_type(tag));
+  }
+  case tag_v_symbol: {
+    const size_t n = check_count(Wosize_val(v));
+    size_t size = IPC_VECTOR_HEADER;
+    size_t i;
+    for(i = 0; i < n; i++) {
+      size += symbol_size(Field(v, i));
+    }
+    return size;
+  }
+  case tag_v_guid: {
+    return IPC_VECTOR_HEADER + 16 * guid_count(v);
+  }
+  case tag_v_symbol_enum: {
+    const struct q_symtab * tab = Symtab_val(Field(val, 1));
+    const int32_t * indices = Caml_ba_data_val(v);
+    const size_t n = bigarray_count(v);
+    size_t size = IPC_VECTOR_HEADER;
+    size_t i;
+    for(i = 0; i < n; i++) {
+      if(indices[i] < 0 || (uint32_t)indices[i] >= tab->count) {
+        caml_invalid_argument("q IPC: symbol index out of the dictionary");
+      }
+      size += caml_string_length(Field(tab->strings, indices[i])) + 1;
+    }
+    return size;
+  }
+  case tag_v_strings: {
+    // A mixed list of char vectors
+    const size_t n = check_count(strings_count(val));
+    const int64_t * offs = Caml_ba_data_val(Field(val, 1));
+    return IPC_VECTOR_HEADER + n * IPC_VECTOR_HEADER + (n ? offs[n] - offs[0] : 0);
+  }
+
+  // Mixed lists, tables and dictionaries
+
+  case tag_mixed_list: {
+    const size_t n = check_count(Wosize_val(v));
+    size_t size = IPC_VECTOR_HEADER;
+    size_t i;
+    for(i = 0; i < n; i++) {
+      size += ipc_size(Field(v, i));
+    }
+    return size;
+  }
+  case tag_table: {
+    // Type, attribute, then a dictionary
+    return 3 + ipc_size(Field(v, 0)) + ipc_size(Field(v, 1));
+  }
+  case tag_dict: {
+    return 1 + ipc_size(Field(v, 0)) + ipc_size(Field(v, 1));
+  }
+  case tag_v_valid: {
+    return ipc_size(v);
+  }
+
+  default: {
+    fprintf(stderr, "ipc_size: invalid tag %i\n", tag);
+    caml_failwith("q IPC: impossible caml tag");
+  }
+  }
+}
+
+// Write the encoding of 'val' at 'p', which has room for ipc_size(val)
+// bytes. Does not allocate on the OCaml heap. Returns the end of the encoding
+static unsigned char * ipc_write(unsigned char * p, const value val)
+{
+  if(!Is_block(val)) {
+    p = put_byte(p, q_unit);
+    return put_byte(p, 0);
+  }
+  const value v = Field(val, 0);
+  const int tag = Tag_val(val);
+  switch(tag) {
+
+  // Scalars
+
+  case tag_bool:   p = put_byte(p, q_bool);  return put_byte(p, Bool_val(v));
+  case tag_byte:   p = put_byte(p, q_byte);  return put_byte(p, Int_val(v));
+  case tag_char:   p = put_byte(p, q_char);  return put_byte(p, Int_val(v));
+  case tag_int16: {
+    const int16_t h = Int_val(v);
+    p = put_byte(p, q_int16);
+    return put_bytes(p, &h, sizeof(h));
+  }
+  case tag_int32:  p = put_byte(p, q_int32);  return put_i32(p, Int32_val(v));
+  case tag_month:  p = put_byte(p, q_month);  return put_i32(p, Int32_val(v));
+  case tag_date:   p = put_byte(p, q_date);   return put_i32(p, Int32_val(v));
+  case tag_minute: p = put_byte(p, q_minute); return put_i32(p, Int32_val(v));
+  case tag_second: p = put_byte(p, q_second); return put_i32(p, Int32_val(v));
+  case tag_time:   p = put_byte(p, q_time);   return put_i32(p, Int32_val(v));
+  case tag_int64:
+  case tag_timestamp:
+  case tag_timespan: {
+    const int64_t j = Int64_val(v);
+    p = put_byte(p, tag == tag_int64 ? q_int64 : tag == tag_timestamp ? q_timestamp : q_timespan);
+    return put_bytes(p, &j, sizeof(j));
+  }
+  case tag_float32: {
+    const float e = Double_val(v);
+    p = put_byte(p, q_float32);
+    return put_bytes(p, &e, sizeof(e));
+  }
+  case tag_float64:
+  case tag_datetime: {
+    const double f = Double_val(v);
+    p = put_byte(p, tag == tag_float64 ? q_float64 : q_datetime);
+    return put_bytes(p, &f, sizeof(f));
+  }
+  case tag_symbol: {
+    p = put_byte(p, q_symbol);
+    return put_bytes(p, String_val(v), caml_string_length(v) + 1);
+  }
+  case tag_guid: {
+    p = put_byte(p, q_guid);
+    return put_bytes(p, String_val(v), 16);
+  }
+
+  // Vectors
+
+  case tag_v_bool:
+  case tag_v_byte:
+  case tag_v_int16:
+  case tag_v_int32:
+  case tag_v_int64:
+  case tag_v_float32:
+  case tag_v_float64:
+  case tag_v_char:
+  case tag_v_month:
+  case tag_v_date:
+  case tag_v_datetime:
+  case tag_v_minute:
+  case tag_v_second:
+  case tag_v_time:
+  case tag_v_timestamp:
+  case tag_v_timespan: {
+    const int ty = tag_to_v_type(tag);
+    const size_t n = Caml_ba_array_val(v)->dim[0];
+    p = put_vector_header(p, ty, Int_val(Field(val, 1)), n);
+    return put_bytes(p, Caml_ba_data_val(v), n * ipc_elem_size(ty));
+  }
+  case tag_v_symbol: {
+    const size_t n = Wosize_val(v);
+    size_t i;
+    p = put_vector_header(p, -q_symbol, Int_val(Field(val, 1)), n);
+    for(i = 0; i < n; i++) {
+      p = put_bytes(p, String_val(Field(v, i)), caml_string_length(Field(v, i)) + 1);
+    }
+    return p;
+  }
+  case tag_v_guid: {
+    const size_t n = Caml_ba_array_val(v)->dim[0] / 16;
+    p = put_vector_header(p, -q_guid, Int_val(Field(val, 1)), n);
+    return put_bytes(p, Caml_ba_data_val(v), 16 * n);
+  }
+  case tag_v_symbol_enum: {
+    const struct q_symtab * tab = Symtab_val(Field(val, 1));
+    const int32_t * indices = Caml_ba_data_val(v);
+    const size_t n = Caml_ba_array_val(v)->dim[0];
+    size_t i;
+    p = put_vector_header(p, -q_symbol, Int_val(Field(val, 2)), n);
+    for(i = 0; i < n; i++) {
+      const value s = Field(tab->strings, indices[i]);
+      p = put_bytes(p, String_val(s), caml_string_length(s) + 1);
+    }
+    return p;
+  }
+  case tag_v_strings: {
+    const unsigned char * chars = Caml_ba_data_val(v);
+    const int64_t * offs = Caml_ba_data_val(Field(val, 1));
+    const size_t n = strings_count(val);
+    size_t i;
+    p = put_vector_header(p, q_mixed_list, 0, n);
+    for(i = 0; i < n; i++) {
+      const size_t len = offs[i + 1] - offs[i];
+      p = put_vector_header(p, -q_char, 0, len);
+      p = put_bytes(p, chars + offs[i], len);
+    }
+    return p;
+  }
+
+  // Mixed lists, tables and dictionaries
+
+  case tag_mixed_list: {
+    const size_t n = Wosize_val(v);
+    size_t i;
+    p = put_vector_header(p, q_mixed_list, 0, n);
+    for(i = 0; i < n; i++) {
+      p = ipc_write(p, Field(v, i));
+    }
+    return p;
+  }
+  case tag_table: {
+    p = put_byte(p, q_table);
+    p = put_byte(p, Int_val(Field(v, 2))); // Attribute
+    p = put_byte(p, q_dict);
+    p = ipc_write(p, Field(v, 0));
+    return ipc_write(p, Field(v, 1));
+  }
+  case tag_dict: {
+    // q represents sorted dictionaries with their own type
+    p = put_byte(p, 1 == Int_val(Field(v, 2)) ? IPC_SORTED_DICT : q_dict);
+    p = ipc_write(p, Field(v, 0));
+    return ipc_write(p, Field(v, 1));
+  }
+  case tag_v_valid: {
+    return ipc_write(p, v);
+  }
+
+  default: {
+    fprintf(stderr, "ipc_write: invalid tag %i\n", tag);
+    caml_failwith("q IPC: impossible caml tag");
+  }
+  }
+}
+
+static unsigned char * put_header(unsigned char * p, const int msg_type, const size_t len)
+{
+  p = put_byte(p, 1); // little endian
+  p = put_byte(p, msg_type);
+  p = put_byte(p, 0); // not compressed
+  p = put_byte(p, 0);
+  return put_i32(p, (int32_t)len);
+}
+
+static size_t check_message_size(const size_t len)
+{
+  if(len > INT32_MAX) {
+    caml_invalid_argument("q IPC: message larger than 2GB");
+  }
+  return len;
+}
+
+// Scatter-gather encoding. Large bigarray payloads are not copied: the
+// message is sent with sendmsg from a buffer holding the headers and the
+// small values, interleaved with the data of the bigarrays. The bigarrays
+// must stay alive until the message is sent, which they do as long as the
+// value sent is a root of the caller.
+
+// Payloads of at least this many bytes are sent from their bigarray
+#define IPC_GATHER_MIN 16384
+
+struct ipc_gather {
+  unsigned char * buf;   // headers and small values
+  unsigned char * p;     // end of the encoding in buf
+  unsigned char * seg;   // start of the part of buf not yet in iov
+  struct iovec * iov;
+  size_t n_iov;
+};
+
+// The size of the payload of vector 'val' if it is sent from its bigarray,
+// 0 otherwise
+static size_t gathered_payload(const value val)
+{
+  switch(Tag_val(val)) {
+  case tag_v_bool:
+  case tag_v_byte:
+  case tag_v_int16:
+  case tag_v_int32:
+  case tag_v_int64:
+  case tag_v_float32:
+  case tag_v_float64:
+  case tag_v_char:
+  case tag_v_month:
+  case tag_v_date:
+  case tag_v_datetime:
+  case tag_v_minute:
+  case tag_v_second:
+  case tag_v_time:
+  case tag_v_timestamp:
+  case tag_v_timespan:
+  case tag_v_guid: {
+    const size_t bytes = caml_ba_byte_size(Caml_ba_array_val(Field(val, 0)));
+    return bytes >= IPC_GATHER_MIN ? bytes : 0;
+  }
+  default:
+    return 0;
+  }
+}
+
+// The total size of the payloads of 'val' sent from their bigarrays. Their
+// number is added to 'count'
+static size_t ipc_gathered_size(const value val, size_t * count)
+{
+  if(!Is_block(val)) {
+    return 0;
+  }
+  const value v = Field(val, 0);
+  size_t size = 0;
+  size_t i;
+  switch(Tag_val(val)) {
+  case tag_mixed_list:
+    for(i = 0; i < Wosize_val(v); i++) {
+      size += ipc_gathered_size(Field(v, i), count);
+    }
+    return size;
+  case tag_table:
+  case tag_dict:
+    return ipc_gathered_size(Field(v, 0), count) + ipc_gathered_size(Field(v, 1), count);
+  case tag_v_valid:
+    return ipc_gathered_size(v, count);
+  default:
+    size = gathered_payload(val);
+    if(size) {
+      (*count)++;
+    }
+    return size;
+  }
+}
+
+// Room for 'len' bytes of headers and small values, and for 'count'
+// payloads sent from their bigarrays
+static void ipc_gather_init(struct ipc_gather * g, const size_t len, const size_t count)
+{
+  g->iov = caml_stat_alloc((2 * count + 1) * sizeof(struct iovec));
+  g->buf = g->p = g->seg = caml_stat_alloc_noexc(len);
+  g->n_iov = 0;
+  if(!g->buf) {
+    caml_stat_free(g->iov);
+    caml_raise_out_of_memory();
+  }
+}
+
+static void ipc_gather_flush(struct ipc_gather * g)
+{
+  if(g->p > g->seg) {
+    g->iov[g->n_iov].iov_base = g->seg;
+    g->iov[g->n_iov].iov_len = g->p - g->seg;
+    g->n_iov++;
+    g->seg = g->p;
+  }
+}
+
+static void ipc_gather_add(struct ipc_gather * g, void * data, const size_t len)
+{
+  ipc_gather_flush(g);
+  g->iov[g->n_iov].iov_base = data;
+  g->iov[g->n_iov].iov_len = len;
+  g->n_iov++;
+}
+
+// As ipc_write, with the payloads counted by ipc_gathered_size added to
+// 'g' rather than copied
+static void ipc_write_gather(struct ipc_gather * g, const value val)
+{
+  if(Is_block(val)) {
+    const value v = Field(val, 0);
+    const int tag = Tag_val(val);
+    size_t i;
+    switch(tag) {
+    case tag_mixed_list:
+      g->p = put_vector_header(g->p, q_mixed_list, 0, Wosize_val(v));
+      for(i = 0; i < Wosize_val(v); i++) {
+        ipc_write_gather(g, Field(v, i));
+      }
+      return;
+    case tag_table:
+      g->p = put_byte(g->p, q_table);
+      g->p = put_byte(g->p, Int_val(Field(v, 2))); // Attribute
+      g->p = put_byte(g->p, q_dict);
+      ipc_write_gather(g, Field(v, 0));
+      ipc_write_gather(g, Field(v, 1));
+      return;
+    case tag_dict:
+      g->p = put_byte(g->p, 1 == Int_val(Field(v, 2)) ? IPC_SORTED_DICT : q_dict);
+      ipc_write_gather(g, Field(v, 0));
+      ipc_write_gather(g, Field(v, 1));
+      return;
+    case tag_v_valid:
+      ipc_write_gather(g, v);
+      return;
+    default: {
+      const size_t bytes = gathered_payload(val);
+      if(bytes) {
+        const int ty = tag_to_v_type(tag);
+        g->p = put_vector_header(g->p, ty, Int_val(Field(val, 1)), bytes / ipc_elem_size(ty));
+        ipc_gather_add(g, Caml_ba_data_val(v), bytes);
+        return;
+      }
+    }
+    }
+  }
+  g->p = ipc_write(g->p, val);
+}
+
+// Messages longer than this are compressed when sent on connection 'conn'
+#define Compression_threshold_val(conn) ((size_t)Long_val(Field(conn, conn_compression)))
+
+// Send message 'msg' of length 'len', compressed if it is longer than
+// 'threshold' bytes and compression halves it. Returns the number of bytes
+// sent, or 0 on network errors.
+static size_t ipc_send_message(const int fd, const unsigned char * msg, const size_t len, const size_t threshold)
+{
+  if(len > threshold) {
+    unsigned char * compressed = malloc(len / 2);
+    if(compressed) {
+      const size_t compressed_len = ipc_compress(msg, len, compressed);
+      if(compressed_len) {
+        const int sent = ipc_send(fd, compressed, compressed_len);
+        free(compressed);
+        return sent ? compressed_len : 0;
+      }
+      free(compressed);
+    }
+  }
+  return ipc_send(fd, msg, len) ? len : 0;
+}
+
+// Count 'sent' bytes (0 on network errors) and the time taken since 'start'
+// as sending on connection 'conn'. Raises Failure on network errors.
+static void ipc_sent(const value conn, const size_t sent, const int64_t start)
+{
+  struct q_call_stats * stats = conn_call_stats(conn);
+  if(stats) {
+    stats->send_ns += q_clock_ns() - start;
+    stats->bytes_out += sent;
+  }
+  if(!sent) {
+    caml_failwith("Network error");
+  }
+}
+
+// Send the message 'msg' on connection 'conn', and free it
+static void ipc_send_request(const value conn, unsigned char * msg, const size_t len, const int64_t start)
+{
+  const size_t sent = ipc_send_message(Handle_val(conn), msg, len, Compression_threshold_val(conn));
+  caml_stat_free(msg);
+  ipc_sent(conn, sent, start);
+}
+
+// Send the message of length 'len' encoded in 'g' on connection 'conn', and
+// free 'g'
+static void ipc_send_gathered(const value conn, struct ipc_gather * g, const size_t len, const int64_t start)
+{
+  ipc_gather_flush(g);
+  const int ok = ipc_sendv(Handle_val(conn), g->iov, g->n_iov);
+  caml_stat_free(g->iov);
+  caml_stat_free(g->buf);
+  ipc_sent(conn, ok ? len : 0, start);
+}
+
+// Whether a message of length 'len' with large payloads ('count' > 0) is
+// sent scatter-gather: compressed messages are encoded contiguously
+static inline int ipc_gathers(const value conn, const size_t len, const size_t count)
+{
+  return count > 0 && len <= Compression_threshold_val(conn);
+}
+
+// A request is the query alone, or the list (query; arg) when 'args' is
+// Some arg, as the C function k() does. The size of the request without the
+// arg
+static size_t request_prefix_size(const value query, const value args)
+{
+  const size_t query_size = IPC_VECTOR_HEADER + check_count(caml_string_length(query));
+  return Is_block(args) ? IPC_VECTOR_HEADER + query_size : query_size;
+}
+
+// Write the request without the arg at 'p'
+static unsigned char * put_request_prefix(unsigned char * p, const value query, const value args)
+{
+  const size_t query_len = caml_string_length(query);
+  if(Is_block(args)) {
+    p = put_vector_header(p, q_mixed_list, 0, 2);
+  }
+  p = put_vector_header(p, -q_char, 0, query_len);
+  return put_bytes(p, String_val(query), query_len);
+}
+
+// Encode a request. Returns a buffer allocated with caml_stat_alloc holding
+// the message, whose length is stored in 'len'.
+static unsigned char * ipc_encode_request(const int msg_type, const value query, const value args, size_t * len)
+{
+  const int has_arg = Is_block(args);
+  const size_t body = request_prefix_size(query, args) + (has_arg ? ipc_size(Field(args, 0)) : 0);
+
+  *len = check_message_size(IPC_HEADER_SIZE + body);
+  unsigned char * msg = caml_stat_alloc(*len);
+  unsigned char * p = put_header(msg, msg_type, *len);
+  p = put_request_prefix(p, query, args);
+  if(has_arg) {
+    p = ipc_write(p, Field(args, 0));
+  }
+  assert(p == msg + *len);
+  return msg;
+}
+
+
+///////////////////////////////////////////////////
+// Exported Caml functions
+///////////////////////////////////////////////////
+
+// Compressed, as sent, if it is longer than 'threshold' bytes and
+// compression halves it
+CAMLprim value q_ipc_serialize(value msg_type, value threshold, value v)
+{
+  CAMLparam3(msg_type, threshold, v);
+  CAMLlocal2(result, compressed);
+
+  const size_t len = check_message_size(IPC_HEADER_SIZE + ipc_size(v));
+  result = caml_alloc_string(len);
+  unsigned char * p = put_header(Bytes_val(result), Int_val(msg_type), len);
+  p = ipc_write(p, v);
+  assert(p == Bytes_val(result) + len);
+  if(len > (size_t)Long_val(threshold)) {
+    unsigned char * buf = malloc(len / 2);
+    if(buf) {
+      const size_t compressed_len = ipc_compress(Bytes_val(result), len, buf);
+      if(compressed_len) {
+        compressed = caml_alloc_string(compressed_len);
+        memcpy(Bytes_val(compressed), buf, compressed_len);
+        free(buf);
+        CAMLreturn(compressed);
+      }
+      free(buf);
+    }
+  }
+  CAMLreturn(result);
+}
+
+// Decode the message held by 'len' bytes of 'bytes' from offset 'off'
+CAMLprim value q_ipc_deserialize(value dict_opt, value packed_strings, value bytes, value off, value len_val)
+{
+  CAMLparam5(dict_opt, packed_strings, bytes, off, len_val);
+  CAMLlocal3(sym_dict, v, result);
+  struct q_decode_ctx ctx;
+  struct ipc_reader r;
+  int msg_type, compressed;
+
+  const size_t len = Long_val(len_val);
+  if(len < IPC_HEADER_SIZE) {
+    caml_failwith("q IPC: truncated message");
+  }
+  const unsigned char * msg = Bytes_val(bytes) + Long_val(off);
+  const size_t body = ipc_parse_header(msg, &msg_type, &compressed);
+  if(body != len - IPC_HEADER_SIZE) {
+    caml_failwith("q IPC: message length does not match its header");
+  }
+  // Decode from a copy: the bytes may move during decoding
+  if(compressed) {
+    const char * error = reader_init_compressed(&r, msg, len);
+    if(error) {
+      caml_failwith(error);
+    }
+  } else {
+    r.buf = malloc(body);
+    if(!r.buf) {
+      caml_raise_out_of_memory();
+    }
+    memcpy(r.buf, msg + IPC_HEADER_SIZE, body);
+    r.pos = 0;
+    r.len = r.cap = body;
+    r.fd = -1;
+    r.unread = 0;
+  }
+  decode_ctx_init(&ctx, dict_opt, Bool_val(packed_strings), &sym_dict);
+  v = ipc_decode_message(&r, &ctx);
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, Val_int(msg_type));
+  Store_field(result, 1, v);
+  CAMLreturn(result);
+}
+
+// The bytes of a request message, for callers doing their own I/O
+CAMLprim value q_ipc_encode_request(value msg_type, value str, value args)
+{
+  CAMLparam3(msg_type, str, args);
+  CAMLlocal1(result);
+
+  size_t len;
+  unsigned char * msg = ipc_encode_request(Int_val(msg_type), str, args, &len);
+  result = caml_alloc_initialized_string(len, (const char *)msg);
+  caml_stat_free(msg);
+  CAMLreturn(result);
+}
+
+CAMLprim value q_ipc_fd(value conn)
+{
+  return Val_int(Handle_val(conn));
+}
+
+CAMLprim value q_ipc_send(value conn, value msg_type, value v)
+{
+  CAMLparam3(conn, msg_type, v);
+
+  const int64_t start = conn_call_stats(conn) ? q_clock_ns() : 0;
+  const size_t len = check_message_size(IPC_HEADER_SIZE + ipc_size(v));
+  size_t count = 0;
+  const size_t gathered = ipc_gathered_size(v, &count);
+  if(ipc_gathers(conn, len, count)) {
+    struct ipc_gather g;
+    ipc_gather_init(&g, len - gathered, count);
+    g.p = put_header(g.p, Int_val(msg_type), len);
+    ipc_write_gather(&g, v);
+    assert(g.p == g.buf + len - gathered);
+    ipc_send_gathered(conn, &g, len, start);
+  } else {
+    unsigned char * msg = caml_stat_alloc(len);
+    unsigned char * p = put_header(msg, Int_val(msg_type), len);
+    p = ipc_write(p, v);
+    assert(p == msg + len);
+    ipc_send_request(conn, msg, len, start);
+  }
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value q_ipc_send_request(value conn, value msg_type, value str, value args)
+{
+  CAMLparam4(conn, msg_type, str, args);
+
+  const int64_t start = conn_call_stats(conn) ? q_clock_ns() : 0;
+  size_t count = 0;
+  const size_t gathered = Is_block(args) ? ipc_gathered_size(Field(args, 0), &count) : 0;
+  if(count > 0) {
+    const value arg = Field(args, 0);
+    const size_t len = check_message_size(IPC_HEADER_SIZE + request_prefix_size(str, args) + ipc_size(arg));
+    if(ipc_gathers(conn, len, count)) {
+      struct ipc_gather g;
+      ipc_gather_init(&g, len - gathered, count);
+      g.p = put_header(g.p, Int_val(msg_type), len);
+      g.p = put_request_prefix(g.p, str, args);
+      ipc_write_gather(&g, arg);
+      assert(g.p == g.buf + len - gathered);
+      ipc_send_gathered(conn, &g, len, start);
+      CAMLreturn(Val_unit);
+    }
+  }
+  size_t len;
+  unsigned char * msg = ipc_encode_request(Int_val(msg_type), str, args, &len);
+  ipc_send_request(conn, msg, len, start);
+  CAMLreturn(Val_unit);
+}
+
+CAMLprim value q_ipc_recv(value conn)
+{
+  CAMLparam1(conn);
+  CAMLlocal3(sym_dict, v, result);
+  struct q_decode_ctx ctx;
+  int msg_type;
+
+  decode_ctx_init_conn(&ctx, conn, &sym_dict);
+  struct q_call_stats * stats = ctx.stats;
+  const int64_t start = stats ? q_clock_ns() : 0;
+  const int64_t wait = stats ? stats->wait_ns : 0;
+  v = ipc_recv_message(Handle_val(conn), &ctx, &msg_type);
+  if(stats) {
+    stats->decode_ns += q_clock_ns() - start - (stats->wait_ns - wait);
+  }
+  result = caml_alloc_tuple(2);
+  Store_field(result, 0, Val_int(msg_type));
+  Store_field(result, 1, v);
+  CAMLreturn(result);
+}
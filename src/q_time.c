@@ -0,0 +1,206 @@
+/*
+ * Copyright (c) 2022 Fermin Reig
+ *
+ * q_time.c
+ *
+ * Bulk conversions of temporal vectors between the epoch of q (2000.01.01)
+ * and Unix time, and of times of day to and from nanoseconds. The loops
+ * have no branches and no calls, so that the compiler vectorizes them.
+ * Nulls and infinities of q are kept.
+ */
+
+// Uncomment next line to disable assertions
+// #define NDEBUG
+
+#include <assert.h>
+#include <stdint.h>
+#include <caml/mlvalues.h>
+#include <caml/alloc.h>
+#include <caml/memory.h>
+#include <caml/fail.h>
+#include <caml/bigarray.h>
+#include "q_interface.h"
+
+
+///////////////////////////////////////////////////
+// Kernels
+///////////////////////////////////////////////////
+
+// 'x' and 'y' are the same array for conversions in place
+
+// y = x + off, except for nulls (INT64_MIN) and infinities (+/-INT64_MAX).
+// The sum wraps rather than overflows.
+void q_shift_int64(const int64_t * x, int64_t * y, const intnat n, const int64_t off)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    const int64_t v = x[i];
+    const int special = (v == INT64_MIN) | (v == INT64_MAX) | (v == -INT64_MAX);
+    y[i] = special ? v : (int64_t)((uint64_t)v + (uint64_t)off);
+  }
+}
+
+void q_shift_int32(const int32_t * x, int32_t * y, const intnat n, const int32_t off)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    const int32_t v = x[i];
+    const int special = (v == INT32_MIN) | (v == INT32_MAX) | (v == -INT32_MAX);
+    y[i] = special ? v : (int32_t)((uint32_t)v + (uint32_t)off);
+  }
+}
+
+// y = (x + add) * mul. Nulls (NaN) and infinities are kept by the arithmetic
+static void affine_float64(const double * x, double * y, const intnat n, const double add, const double mul)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    y[i] = (x[i] + add) * mul;
+  }
+}
+
+int32_t q_month_to_days(const int32_t m)
+{
+  // H. Hinnant's days_from_civil, with March as the first month of the year
+  int32_t y = 2000 + (m >= 0 ? m / 12 : (m - 11) / 12);
+  const int32_t month = m - (y - 2000) * 12 + 1;
+  y -= month <= 2;
+  const int32_t era = (y >= 0 ? y : y - 399) / 400;
+  const int32_t yoe = y - era * 400;
+  const int32_t doy = (153 * (month > 2 ? month - 3 : month + 9) + 2) / 5;
+  const int32_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+  return era * 146097 + doe - 719468;
+}
+
+void q_months_to_days(const int32_t * x, int32_t * y, const intnat n)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    const int32_t v = x[i];
+    const int special = (v == INT32_MIN) | (v == INT32_MAX) | (v == -INT32_MAX);
+    y[i] = special ? v : q_month_to_days(v);
+  }
+}
+
+// The month, since 2000.01, of the day 'd' since the Unix epoch
+static int32_t day_to_month(const int32_t d)
+{
+  // H. Hinnant's civil_from_days, in 64 bits so that no day overflows
+  const int64_t z = (int64_t)d + 719468;
+  const int64_t era = (z >= 0 ? z : z - 146096) / 146097;
+  const int64_t doe = z - era * 146097;
+  const int64_t yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+  const int64_t doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+  const int64_t mp = (5 * doy + 2) / 153;
+  const int64_t month = mp < 10 ? mp + 3 : mp - 9;
+  const int64_t y = yoe + era * 400 + (month <= 2);
+  return (int32_t)((y - 2000) * 12 + month - 1);
+}
+
+static void days_to_months(const int32_t * x, int32_t * y, const intnat n)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    const int32_t v = x[i];
+    const int special = (v == INT32_MIN) | (v == INT32_MAX) | (v == -INT32_MAX);
+    y[i] = special ? v : day_to_month(v);
+  }
+}
+
+// y = x * mul, from int32 to int64. Nulls and infinities are mapped to
+// those of int64
+static void widen_int32(const int32_t * x, int64_t * y, const intnat n, const int64_t mul)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    const int32_t v = x[i];
+    const int special = (v == INT32_MIN) | (v == INT32_MAX) | (v == -INT32_MAX);
+    const int64_t s = v == INT32_MIN ? INT64_MIN : (v > 0 ? INT64_MAX : -INT64_MAX);
+    y[i] = special ? s : (int64_t)v * mul;
+  }
+}
+
+// y = floor(x / div), from int64 to int32. Nulls and infinities are mapped
+// to those of int32. The quotient wraps rather than overflows
+static void narrow_int64(const int64_t * x, int32_t * y, const intnat n, const int64_t div)
+{
+  intnat i;
+  for(i = 0; i < n; i++) {
+    const int64_t v = x[i];
+    const int special = (v == INT64_MIN) | (v == INT64_MAX) | (v == -INT64_MAX);
+    const int32_t s = v == INT64_MIN ? INT32_MIN : (v > 0 ? INT32_MAX : -INT32_MAX);
+    const int64_t q = v / div - ((v % div != 0) & (v < 0));
+    y[i] = special ? s : (int32_t)(uint32_t)(uint64_t)q;
+  }
+}
+
+
+///////////////////////////////////////////////////
+// Exported Caml functions
+///////////////////////////////////////////////////
+
+CAMLprim value q_time_epoch_days(value unit)
+{
+  return caml_copy_int32(Q_EPOCH_DAYS);
+}
+
+// The length of 'src', which 'dst' must share
+static intnat check_dims(const value src, const value dst)
+{
+  assert(1 == Caml_ba_array_val(src)->num_dims);
+  assert(1 == Caml_ba_array_val(dst)->num_dims);
+  const intnat n = Caml_ba_array_val(src)->dim[0];
+  if(n != Caml_ba_array_val(dst)->dim[0]) {
+    caml_invalid_argument("Q.Time: arrays of different lengths");
+  }
+  return n;
+}
+
+CAMLprim value q_time_shift_int64(value src, value dst, value off)
+{
+  const intnat n = check_dims(src, dst);
+  q_shift_int64(Caml_ba_data_val(src), Caml_ba_data_val(dst), n, Int64_val(off));
+  return Val_unit;
+}
+
+CAMLprim value q_time_shift_int32(value src, value dst, value off)
+{
+  const intnat n = check_dims(src, dst);
+  q_shift_int32(Caml_ba_data_val(src), Caml_ba_data_val(dst), n, Int32_val(off));
+  return Val_unit;
+}
+
+CAMLprim value q_time_affine_float64(value src, value dst, value add, value mul)
+{
+  const intnat n = check_dims(src, dst);
+  affine_float64(Caml_ba_data_val(src), Caml_ba_data_val(dst), n, Double_val(add), Double_val(mul));
+  return Val_unit;
+}
+
+CAMLprim value q_time_months_to_days(value src, value dst)
+{
+  const intnat n = check_dims(src, dst);
+  q_months_to_days(Caml_ba_data_val(src), Caml_ba_data_val(dst), n);
+  return Val_unit;
+}
+
+CAMLprim value q_time_days_to_months(value src, value dst)
+{
+  const intnat n = check_dims(src, dst);
+  days_to_months(Caml_ba_data_val(src), Caml_ba_data_val(dst), n);
+  return Val_unit;
+}
+
+CAMLprim value q_time_widen_int32(value src, value dst, value mul)
+{
+  const intnat n = check_dims(src, dst);
+  widen_int32(Caml_ba_data_val(src), Caml_ba_data_val(dst), n, Int64_val(mul));
+  return Val_unit;
+}
+
+CAMLprim value q_time_narrow_int64(value src, value dst, value div)
+{
+  const intnat n = check_dims(src, dst);
+  narrow_int64(Caml_ba_data_val(src), Caml_ba_data_val(dst), n, Int64_val(div));
+  return Val_unit;
+}
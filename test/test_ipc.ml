@@ -0,0 +1,282 @@
+(* Round trip tests of the native IPC codec. Values of every q type are
+   serialized and deserialized, and eval and rpc through Q.Ipc are compared
+   with the same calls through the kdb+ C library, against a stand-in for a
+   kdb+ server on the loopback interface.
+
+   Usage: q_test. Prints the failed tests, and exits with status 1 if any *)
+
+open Bigarray
+open Q
+
+let failures = ref 0
+
+let check name ok =
+  if not ok then begin
+    incr failures;
+    Printf.printf "FAIL %s\n%!" name
+  end
+
+(* Structural equality, under which nans are equal *)
+let same a b = compare a b = 0
+
+let ba kind l = Array1.of_array kind c_layout (Array.of_list l)
+
+let chars s = Array1.init char c_layout (String.length s) (String.get s)
+
+let string_of_chars a = String.init (Array1.dim a) (fun i -> a.{i})
+
+let guids n = Array1.init int8_unsigned c_layout (16 * n) (fun i -> (i * 37) land 0xff)
+
+
+(* Fixtures: a value of each q type, with nulls and attributes *)
+
+let scalars = [
+  ("bool", Bool true);
+  ("byte", Byte 0xab);
+  ("short", Short 1234);
+  ("int32", Int32 (-7l));
+  ("int32_null", Int32 Int32.min_int);
+  ("int64", Int64 1_234_567_890_123L);
+  ("int64_null", Int64 Int64.min_int);
+  ("float32", Float32 1.5);
+  ("float64", Float64 (-2.25));
+  ("float64_null", Float64 Float.nan);
+  ("char", Char 'x');
+  ("symbol", Symbol "abc");
+  ("symbol_null", Symbol "");
+  ("month", Month 288l);
+  ("date", Date 8766l);
+  ("datetime", Datetime 8766.5);
+  ("minute", Minute 600l);
+  ("second", Second 36_000l);
+  ("time", Time 36_000_000l);
+  ("timestamp", Timestamp 757_382_400_000_000_000L);
+  ("timespan", Timespan 1_000_000_000L);
+  ("guid", Guid (String.init 16 (fun i -> Char.chr (i * 17))));
+]
+
+let vectors = [
+  ("v_bool", V_bool (ba int8_unsigned [1; 0; 1], A_none));
+  ("v_byte", V_byte (ba int8_unsigned [0; 0x7f; 0xff], A_none));
+  ("v_short", V_short (ba int16_unsigned [1; 2; 0x7fff], A_none));
+  ("v_int32", V_int32 (ba int32 [1l; 2l; Int32.min_int], A_none));
+  ("v_int32_sorted", V_int32 (ba int32 [1l; 2l; 3l], A_s));
+  ("v_int64", V_int64 (ba int64 [Int64.min_int; 0L; Int64.max_int], A_u));
+  ("v_float32", V_float32 (ba float32 [1.5; Float.nan; Float.infinity], A_none));
+  ("v_float64", V_float64 (ba float64 [-2.25; Float.nan; 1e300], A_none));
+  ("v_char", V_char (chars "hello", A_none));
+  ("v_char_nul", V_char (chars "a\000b", A_none));
+  ("v_symbol", V_symbol ([| "a"; "bb"; ""; "a" |], A_g));
+  ("v_month", V_month (ba int32 [0l; 288l; Int32.min_int], A_none));
+  ("v_date", V_date (ba int32 [0l; 8766l; Int32.max_int], A_s));
+  ("v_datetime", V_datetime (ba float64 [0.; 8766.5; Float.nan], A_none));
+  ("v_minute", V_minute (ba int32 [0l; 600l], A_none));
+  ("v_second", V_second (ba int32 [0l; 36_000l], A_none));
+  ("v_time", V_time (ba int32 [0l; 36_000_000l], A_none));
+  ("v_timestamp", V_timestamp (ba int64 [0L; 757_382_400_000_000_000L; Int64.min_int], A_p));
+  ("v_timespan", V_timespan (ba int64 [0L; 1_000_000_000L], A_none));
+  ("v_guid", V_guid (guids 2, A_none));
+  ("v_int64_empty", V_int64 (ba int64 [], A_none));
+  ("v_symbol_empty", V_symbol ([||], A_none));
+  ("v_large", V_float64 (Array1.init float64 c_layout 100_000 float_of_int, A_none));
+]
+
+let table n =
+  { colnames = V_symbol ([| "sym"; "price"; "time" |], A_none);
+    cols = V_mixed [| V_symbol (Array.init n (fun i -> if i land 1 = 0 then "a" else "b"), A_none);
+                      V_float64 (Array1.init float64 c_layout n float_of_int, A_none);
+                      V_timestamp (Array1.init int64 c_layout n Int64.of_int, A_none) |];
+    attrib_t = A_none }
+
+let composites = [
+  ("mixed", V_mixed [| Int64 1L; V_char (chars "text", A_none); Symbol "s"; Unit |]);
+  ("mixed_empty", V_mixed [||]);
+  ("strings", V_mixed [| V_char (chars "one", A_none); V_char (chars "", A_none);
+                         V_char (chars "three", A_none) |]);
+  ("dict", Dict { keys = V_symbol ([| "a"; "b" |], A_none);
+                  vals = V_int64 (ba int64 [1L; 2L], A_none); attrib_d = A_none });
+  ("table", Table (table 10));
+  ("table_empty", Table (table 0));
+  ("keyed_table", Dict { keys = Table { colnames = V_symbol ([| "id" |], A_none);
+                                        cols = V_mixed [| V_int64 (ba int64 [1L; 2L], A_u) |];
+                                        attrib_t = A_none };
+                         vals = Table (table 2); attrib_d = A_none });
+  ("unit", Unit);
+]
+
+let fixtures = scalars @ vectors @ composites
+
+
+(* Codec *)
+
+let test_codec () =
+  List.iter (fun (name, v) ->
+      List.iter (fun ty ->
+          match Ipc.deserialize (Ipc.serialize ty v) with
+          | (ty', v') -> check ("codec " ^ name) (ty = ty' && same v v')
+          | exception e -> check ("codec " ^ name ^ ": " ^ Printexc.to_string e) false)
+        [Ipc.Async; Ipc.Sync; Ipc.Response];
+      (match Ipc.deserialize (Ipc.serialize ~compression_threshold:0 Ipc.Response v) with
+       | (_, v') -> check ("codec compressed " ^ name) (same v v')
+       | exception e -> check ("codec compressed " ^ name ^ ": " ^ Printexc.to_string e) false);
+      (* Through K objects, as eval and rpc convert *)
+      check ("kobj " ^ name) (same v (Kobj.to_q_val (Kobj.of_q_val v))))
+    fixtures
+
+let test_options () =
+  (* Lists of strings as one buffer and offsets *)
+  let msg = Ipc.serialize Ipc.Response (List.assoc "strings" composites) in
+  (match Ipc.deserialize ~packed_strings:true msg with
+   | (_, V_strings (c, o)) ->
+     check "packed_strings" (string_of_chars c = "onethree" && same o (ba int64 [0L; 3L; 3L; 8L]))
+   | _ -> check "packed_strings" false);
+  (* Symbol vectors as indices into a dictionary *)
+  let syms = [| "a"; "bb"; ""; "a" |] in
+  let dict = Sym_dict.create () in
+  let msg = Ipc.serialize Ipc.Response (V_symbol (syms, A_g)) in
+  (match Ipc.deserialize ~sym_dict:dict msg with
+   | (_, (V_symbol_enum (idx, _, A_g) as v)) ->
+     check "symbol_enum" (Array.for_all Fun.id (Array.mapi (fun i s -> Sym_dict.get dict idx.{i} = s) syms));
+     check "symbol_enum encode" (Ipc.serialize Ipc.Response v = msg)
+   | _ -> check "symbol_enum" false)
+
+let test_parser () =
+  let p = Ipc.Parser.create () in
+  let msgs = List.map (fun (_, v) -> Ipc.serialize Ipc.Response v) fixtures in
+  (* Fed one byte at a time, and all at once *)
+  List.iter2 (fun (name, v) msg ->
+      let got = ref None in
+      Bytes.iteri (fun i _ ->
+          check ("parser early " ^ name) (!got = None);
+          Ipc.Parser.feed p msg i 1;
+          got := Ipc.Parser.next p)
+        msg;
+      check ("parser " ^ name) (match !got with Some (_, v') -> same v v' | None -> false))
+    fixtures msgs;
+  let all = Bytes.concat Bytes.empty msgs in
+  Ipc.Parser.feed p all 0 (Bytes.length all);
+  List.iter (fun (name, v) ->
+      check ("parser batch " ^ name)
+        (match Ipc.Parser.next p with Some (_, v') -> same v v' | None -> false))
+    fixtures;
+  check "parser drained" (Ipc.Parser.next p = None && Ipc.Parser.buffered p = 0)
+
+
+(* A stand-in for a kdb+ server on the loopback interface. It replies to the
+   query [name] with the fixture [name], to [(f; x)] with [x], and to
+   ["fail"] with the q error 'boom *)
+
+let error_reply = Bytes.of_string "\001\002\000\000\014\000\000\000\128boom\000"
+
+let rec really_read fd buf off len =
+  if len > 0 then begin
+    let n = Unix.read fd buf off len in
+    if n = 0 then raise End_of_file;
+    really_read fd buf (off + n) (len - n)
+  end
+
+let rec write_all fd buf off len =
+  if len > 0 then begin
+    let n = Unix.write fd buf off len in
+    write_all fd buf (off + n) (len - n)
+  end
+
+let serve_connection fd =
+  let b = Bytes.create 1 in
+  (* Handshake: credentials and capability, up to a NUL *)
+  let rec handshake () =
+    really_read fd b 0 1;
+    if Bytes.get b 0 <> '\000' then handshake () in
+  let header = Bytes.create 8 in
+  try
+    handshake ();
+    write_all fd (Bytes.of_string "\003") 0 1;
+    while true do
+      really_read fd header 0 8;
+      let len = Int32.to_int (Bytes.get_int32_le header 4) in
+      let msg = Bytes.create len in
+      Bytes.blit header 0 msg 0 8;
+      really_read fd msg 8 (len - 8);
+      let reply =
+        match Ipc.deserialize msg with
+        | (ty, V_char (s, _)) when string_of_chars s = "fail" -> (ty, error_reply)
+        | (ty, V_char (s, _)) ->
+          (ty, Ipc.serialize Ipc.Response
+             (Option.value ~default:Unit (List.assoc_opt (string_of_chars s) fixtures)))
+        | (ty, V_mixed [| V_char _; x |]) -> (ty, Ipc.serialize Ipc.Response x)
+        | (ty, _) -> (ty, Ipc.serialize Ipc.Response Unit) in
+      match reply with
+      | (Ipc.Sync, out) -> write_all fd out 0 (Bytes.length out)
+      | _ -> ()
+    done
+  with End_of_file | Unix.Unix_error _ | Failure _ -> Unix.close fd
+
+let start_server () =
+  let sock = Unix.socket Unix.PF_INET Unix.SOCK_STREAM 0 in
+  Unix.setsockopt sock Unix.SO_REUSEADDR true;
+  Unix.bind sock (Unix.ADDR_INET (Unix.inet_addr_loopback, 0));
+  Unix.listen sock 8;
+  let port = match Unix.getsockname sock with
+    | Unix.ADDR_INET (_, port) -> port
+    | Unix.ADDR_UNIX _ -> assert false in
+  let rec accept () =
+    let (fd, _) = Unix.accept sock in
+    ignore (Thread.create serve_connection fd);
+    accept () in
+  ignore (Thread.create accept ());
+  port
+
+let test_loopback port ~compression_threshold =
+  let conn = open_connection ~compression_threshold "127.0.0.1" port in
+  let label name = Printf.sprintf "%s (compression %d)" name compression_threshold in
+  List.iter (fun (name, v) ->
+      let k = eval conn name in
+      let ipc = Ipc.eval conn name in
+      check (label ("eval " ^ name)) (same v k && same k ipc);
+      let k = rpc conn "echo" v in
+      let ipc = Ipc.rpc conn "echo" v in
+      check (label ("rpc " ^ name)) (same v k && same k ipc))
+    fixtures;
+  (* Typed columns, converted straight from the K object *)
+  let column name v = match v with
+    | Table t | Dict { vals = Table t; _ } -> Schema.(decode (col name q_val @@ nil) (Table t)) |> fst
+    | _ -> assert false in
+  let (sym, (price, ())) = Schema.(eval (col "sym" symbol @@ col "price" float64 @@ nil)) conn "table" in
+  let table = List.assoc "table" fixtures in
+  check (label "schema") (same (V_symbol (sym, A_none)) (column "sym" table)
+                          && same (V_float64 (price, A_none)) (column "price" table));
+  let (id, (price, ())) = Schema.(eval (col "id" int64 @@ col "price" float64 @@ nil)) conn "keyed_table" in
+  check (label "schema keyed") (same id (ba int64 [1L; 2L])
+                                && same (V_float64 (price, A_none)) (column "price" (List.assoc "keyed_table" fixtures)));
+  close_connection conn
+
+let test_errors port =
+  let conn = open_connection "127.0.0.1" port in
+  let q_error f = match f () with _ -> false | exception Q_error "boom" -> true in
+  check "error eval" (q_error (fun () -> eval conn "fail"));
+  check "error Ipc.eval" (q_error (fun () -> Ipc.eval conn "fail"));
+  check "error deserialize" (q_error (fun () -> Ipc.deserialize error_reply));
+  (* A failed request does not disturb the replies to the others *)
+  let p = Pipeline.create conn in
+  let futures = List.map (Pipeline.eval p) ["int64"; "fail"; "symbol"] in
+  (match List.map (fun f -> match Pipeline.await f with v -> Ok v | exception e -> Error e) futures with
+   | [Ok a; Error (Q_error "boom"); Ok b] ->
+     check "error pipeline" (same a (List.assoc "int64" fixtures) && same b (List.assoc "symbol" fixtures))
+   | _ -> check "error pipeline" false);
+  check "error after pipeline" (same (Ipc.eval conn "int64") (List.assoc "int64" fixtures));
+  close_connection conn
+
+
+let () =
+  test_codec ();
+  test_options ();
+  test_parser ();
+  let port = start_server () in
+  test_loopback port ~compression_threshold:max_int;
+  test_loopback port ~compression_threshold:0;
+  test_errors port;
+  if !failures > 0 then begin
+    Printf.printf "%d failures\n" !failures;
+    exit 1
+  end;
+  print_endline "OK"